@@ -5,19 +5,82 @@
 #include <iostream>
 #include "globals.hpp"
 
-std::tuple<in_port_t, std::string, std::string, bool> parseArgs(int argc, const char *argv[]) {
+// options the server was launched with
+struct serverOptions {
+	in_port_t port = defaultPort;
+	std::string logFileName {};
+	std::string dirPath = defaultWorkdir;
+	// serve control connections from the epoll reactor instead of a thread per connection
+	bool reactorMode = false;
+	// number of threads running the command handlers in reactor mode
+	uint32_t reactorThreads = defaultReactorThreads;
+	// number of threads serving sessions in the default mode, 0 means a new thread per connection
+	uint32_t workers = 0;
+	// max number of accepted connections waiting for a worker
+	uint32_t sessionQueue = defaultSessionQueue;
+	// limits on active sessions, 0 means unlimited
+	uint32_t maxSessions = 0, maxPerIp = 0;
+	// engine used for moving file data: sendfile, blocking or uring
+	std::string engine = defaultEngine;
+	// how often the logger writes out the collected records
+	uint32_t logFlushMs = defaultLogFlushMs;
+	// memory for the cached directory listings in megabytes, 0 disables the cache
+	uint32_t listCacheMb = defaultListCacheMb;
+	// range of ports for the pool of passive listeners, 0 means PASV opens an ephemeral port every time
+	in_port_t pasvPortMin = 0, pasvPortMax = 0;
+	// zlib level of the deflate stage in MODE Z
+	int deflateLevel = defaultDeflateLevel;
+	// max number of data connections of one SEGR download
+	uint32_t maxSegments = defaultMaxSegments;
+	// hash uploads while they are written and cache the hash for HASH and the X commands
+	bool hashUploads = false;
+	// memory for the mapped hot files in megabytes, 0 disables the cache
+	uint32_t hotCacheMb = defaultHotCacheMb;
+	// bandwidth limit of the whole server in KiB/s, 0 is unlimited
+	uint32_t rateLimitKb = 0;
+	// bandwidth limit every session starts with in KiB/s, 0 is unlimited
+	uint32_t sessionRateKb = 0;
+	// user who may change the server-wide settings with SITE, nobody if empty
+	std::string adminUser {};
+	// port of the local metrics endpoint, 0 if disabled
+	uint32_t metricsPort = 0;
+	// set if we only printed the help or if the arguments are invalid
+	bool needToClose = false;
+};
+
+serverOptions parseArgs(int argc, const char *argv[]) {
 	// options for program launch
 	typedef std::pair<std::string, std::string> optionPair;
 	static const optionPair portOption = {"-p", "--port"};
 	static const optionPair helpOption = {"-h", "--help"};
 	static const optionPair logOption = {"-l", "--log"};
 	static const optionPair dirOption = {"-d", "--directory"};
+	static const optionPair reactorOption = {"-r", "--reactor"};
+	static const optionPair threadsOption = {"-t", "--threads"};
+	static const optionPair workersOption = {"-w", "--workers"};
+	static const optionPair queueOption = {"-q", "--queue"};
+	static const optionPair maxSessionsOption = {"-m", "--max-sessions"};
+	static const optionPair maxPerIpOption = {"-i", "--max-per-ip"};
+	static const optionPair engineOption = {"-e", "--engine"};
+	static const optionPair logFlushOption = {"-f", "--log-flush"};
+	static const optionPair listCacheOption = {"-c", "--list-cache"};
+	static const optionPair pasvPortsOption = {"-P", "--pasv-ports"};
+	static const optionPair deflateLevelOption = {"-z", "--deflate-level"};
+	static const optionPair maxSegmentsOption = {"-s", "--max-segments"};
+	static const optionPair hashUploadsOption = {"-H", "--hash-uploads"};
+	static const optionPair hotCacheOption = {"-C", "--hot-cache"};
+	static const optionPair rateLimitOption = {"-R", "--rate-limit"};
+	static const optionPair sessionRateOption = {"-S", "--session-rate"};
+	static const optionPair adminOption = {"-a", "--admin"};
+	static const optionPair metricsPortOption = {"-M", "--metrics-port"};
+
+	serverOptions options;
 
 	// no arguments - launch on default port and without logging and no need to close
 	if (argc == 1) {
 		std::cout << "Port not specified, will use default port" << std::endl;
 		std::cout << "Start with \"" << helpOption.first << "\" or \"" << helpOption.second << "\" for help." << std::endl;
-		return {defaultPort, "", defaultWorkdir, false};
+		return options;
 	}
 
 	// lambda which creates a function for checking if arg is equal to an optionList
@@ -31,11 +94,47 @@ std::tuple<in_port_t, std::string, std::string, bool> parseArgs(int argc, const
 	const auto helpOptionFinder = findIfOption(helpOption);
 	const auto logOptionFinder = findIfOption(logOption);
 	const auto dirOptionFinder = findIfOption(dirOption);
+	const auto reactorOptionFinder = findIfOption(reactorOption);
+	const auto threadsOptionFinder = findIfOption(threadsOption);
+	const auto workersOptionFinder = findIfOption(workersOption);
+	const auto queueOptionFinder = findIfOption(queueOption);
+	const auto maxSessionsOptionFinder = findIfOption(maxSessionsOption);
+	const auto maxPerIpOptionFinder = findIfOption(maxPerIpOption);
+	const auto engineOptionFinder = findIfOption(engineOption);
+	const auto logFlushOptionFinder = findIfOption(logFlushOption);
+	const auto listCacheOptionFinder = findIfOption(listCacheOption);
+	const auto pasvPortsOptionFinder = findIfOption(pasvPortsOption);
+	const auto deflateLevelOptionFinder = findIfOption(deflateLevelOption);
+	const auto maxSegmentsOptionFinder = findIfOption(maxSegmentsOption);
+	const auto hashUploadsOptionFinder = findIfOption(hashUploadsOption);
+	const auto hotCacheOptionFinder = findIfOption(hotCacheOption);
+	const auto rateLimitOptionFinder = findIfOption(rateLimitOption);
+	const auto sessionRateOptionFinder = findIfOption(sessionRateOption);
+	const auto adminOptionFinder = findIfOption(adminOption);
+	const auto metricsPortOptionFinder = findIfOption(metricsPortOption);
 
 	const auto portOptionLoc = std::find_if(argv, argv + argc, portOptionFinder);
 	const auto helpOptionLoc = std::find_if(argv, argv + argc, helpOptionFinder);
 	const auto logOptionLoc = std::find_if(argv, argv + argc, logOptionFinder);
 	const auto dirOptionLoc = std::find_if(argv, argv + argc, dirOptionFinder);
+	const auto reactorOptionLoc = std::find_if(argv, argv + argc, reactorOptionFinder);
+	const auto threadsOptionLoc = std::find_if(argv, argv + argc, threadsOptionFinder);
+	const auto workersOptionLoc = std::find_if(argv, argv + argc, workersOptionFinder);
+	const auto queueOptionLoc = std::find_if(argv, argv + argc, queueOptionFinder);
+	const auto maxSessionsOptionLoc = std::find_if(argv, argv + argc, maxSessionsOptionFinder);
+	const auto maxPerIpOptionLoc = std::find_if(argv, argv + argc, maxPerIpOptionFinder);
+	const auto engineOptionLoc = std::find_if(argv, argv + argc, engineOptionFinder);
+	const auto logFlushOptionLoc = std::find_if(argv, argv + argc, logFlushOptionFinder);
+	const auto listCacheOptionLoc = std::find_if(argv, argv + argc, listCacheOptionFinder);
+	const auto pasvPortsOptionLoc = std::find_if(argv, argv + argc, pasvPortsOptionFinder);
+	const auto deflateLevelOptionLoc = std::find_if(argv, argv + argc, deflateLevelOptionFinder);
+	const auto maxSegmentsOptionLoc = std::find_if(argv, argv + argc, maxSegmentsOptionFinder);
+	const auto hashUploadsOptionLoc = std::find_if(argv, argv + argc, hashUploadsOptionFinder);
+	const auto hotCacheOptionLoc = std::find_if(argv, argv + argc, hotCacheOptionFinder);
+	const auto rateLimitOptionLoc = std::find_if(argv, argv + argc, rateLimitOptionFinder);
+	const auto sessionRateOptionLoc = std::find_if(argv, argv + argc, sessionRateOptionFinder);
+	const auto adminOptionLoc = std::find_if(argv, argv + argc, adminOptionFinder);
+	const auto metricsPortOptionLoc = std::find_if(argv, argv + argc, metricsPortOptionFinder);
 
 	// check if the option has an argument, i.e. option isn't the last string in argv
 	const auto isPresent = [=](const auto location){ return location < (argv + argc); };
@@ -50,8 +149,27 @@ std::tuple<in_port_t, std::string, std::string, bool> parseArgs(int argc, const
 				  "\t-p/--port [PORT] -- Specify port in a different manner, overrides the other port specified\n"
 				  "\t-l/--log [LOGFILE] -- Enable logging to LOGFILE\n"
 				  "\t-d/--directory [DIRPATH] -- launch server with server root in a different directory (default is myftpserver)\n"
+				  "\t-r/--reactor -- serve control connections from an epoll reactor instead of a thread per connection\n"
+				  "\t-t/--threads [COUNT] -- number of command handler threads in reactor mode (default is 4)\n"
+				  "\t-w/--workers [COUNT] -- serve sessions from a pool of COUNT threads instead of a thread per connection\n"
+				  "\t-q/--queue [COUNT] -- max number of connections waiting for a free worker (default is 64)\n"
+				  "\t-m/--max-sessions [COUNT] -- max number of active sessions, the rest get 421 (default is unlimited)\n"
+				  "\t-i/--max-per-ip [COUNT] -- max number of active sessions from one address (default is unlimited)\n"
+				  "\t-e/--engine [ENGINE] -- engine for file transfers: sendfile (default), blocking or uring\n"
+				  "\t-f/--log-flush [MS] -- how often the log is written out (default is 100 ms)\n"
+				  "\t-c/--list-cache [MB] -- memory for cached directory listings, 0 disables the cache (default is 64)\n"
+				  "\t-P/--pasv-ports [MIN-MAX] -- serve PASV from listeners opened in advance on this port range (default is a new ephemeral port per PASV)\n"
+				  "\t-z/--deflate-level [LEVEL] -- zlib level of MODE Z transfers, a session can change it with OPTS (default is 1)\n"
+				  "\t-s/--max-segments [COUNT] -- max number of data connections a session may use for one SEGR download (default is 8)\n"
+				  "\t-H/--hash-uploads -- hash uploaded files while they are stored, so HASH answers them from the cache\n"
+				  "\t-C/--hot-cache [MB] -- memory for mapping the most downloaded files, 0 disables the cache (default is 256)\n"
+				  "\t-R/--rate-limit [KIB/S] -- bandwidth limit of the whole server, 0 is unlimited (default is 0)\n"
+				  "\t-S/--session-rate [KIB/S] -- bandwidth limit every session starts with, 0 is unlimited (default is 0)\n"
+				  "\t-a/--admin [USER] -- user who may change the limits of the server and of the users with SITE RATE (default is nobody)\n"
+				  "\t-M/--metrics-port [PORT] -- serve the metrics in the Prometheus format on 127.0.0.1:PORT, 0 is off (default is 0)\n"
 				  "Creator: @renbou :)" << std::endl;
-		return {defaultPort, "", defaultWorkdir, true};
+		options.needToClose = true;
+		return options;
 	}
 
 	// get the log filename if logging is enabled
@@ -82,6 +200,97 @@ std::tuple<in_port_t, std::string, std::string, bool> parseArgs(int argc, const
 		return {defaultWorkdir, false};
 	}();
 
+	// get the admin user if present as option
+	const auto [adminUser, adminError] = [=]() -> std::pair<std::string, bool> {
+		if (isPresent(adminOptionLoc)) {
+			// admin option is present but the user isn't specified then close
+			if (adminOptionLoc == (argv + argc - 1)) {
+				std::cerr << "ERROR! Admin option specified without a user." << std::endl;
+				return {"", true};
+			}
+			return {argv[adminOptionLoc - argv + 1], false};
+		}
+		return {"", false};
+	}();
+
+	// get the transfer engine if present as option
+	const auto [engine, engineError] = [=]() -> std::pair<std::string, bool> {
+		if (isPresent(engineOptionLoc)) {
+			// engine option is present but the engine isn't specified then close
+			if (engineOptionLoc == (argv + argc - 1)) {
+				std::cerr << "ERROR! Engine option specified without an engine." << std::endl;
+				return {defaultEngine, true};
+			}
+			const std::string engineName = argv[engineOptionLoc - argv + 1];
+			if (engineName != "sendfile" and engineName != "blocking" and engineName != "uring") {
+				std::cerr << "ERROR! Unknown engine \"" << engineName << "\", use sendfile, blocking or uring." << std::endl;
+				return {defaultEngine, true};
+			}
+			return {engineName, false};
+		}
+		return {defaultEngine, false};
+	}();
+
+	// get the passive port range if present as option
+	const auto [pasvPorts, pasvPortsError] = [=]() -> std::pair<std::pair<in_port_t, in_port_t>, bool> {
+		if (not isPresent(pasvPortsOptionLoc))
+			return {{0, 0}, false};
+		// passive ports option is present but the range isn't specified then close
+		if (pasvPortsOptionLoc == (argv + argc - 1)) {
+			std::cerr << "ERROR! Passive ports option specified without a port range." << std::endl;
+			return {{0, 0}, true};
+		}
+		const std::string range = argv[pasvPortsOptionLoc - argv + 1];
+		try {
+			const size_t dash = range.find('-');
+			if (dash == std::string::npos)
+				throw std::invalid_argument("expected MIN-MAX");
+			const int64_t minPort = std::stoll(range.substr(0, dash)), maxPort = std::stoll(range.substr(dash + 1));
+			if (minPort < 1 or maxPort > 65535 or minPort > maxPort)
+				throw std::out_of_range("ports must be in 1-65535 with MIN not above MAX");
+			return {{minPort, maxPort}, false};
+		} catch (std::exception &e) {
+			std::cerr << "ERROR! while parsing the passive port range \"" << range << "\": " << e.what() << std::endl;
+			return {{0, 0}, true};
+		}
+	}();
+
+	// get a numeric value of an option if present, checking that it lies in [minValue, maxValue]
+	const auto getNumberOption = [=](const char **optionLoc, const std::string &name, int64_t defaultValue,
+									 int64_t minValue, int64_t maxValue) -> std::pair<int64_t, bool> {
+		if (not isPresent(optionLoc))
+			return {defaultValue, false};
+		if (optionLoc == (argv + argc - 1)) {
+			std::cerr << "ERROR! " << name << " option specified without a value." << std::endl;
+			return {defaultValue, true};
+		}
+		try {
+			const int64_t value = std::stoll(argv[optionLoc - argv + 1]);
+			if (value < minValue or value > maxValue) {
+				std::cerr << "ERROR! " << name << " must be between " << minValue << " and " << maxValue << std::endl;
+				return {defaultValue, true};
+			}
+			return {value, false};
+		} catch (std::exception &e) {
+			std::cerr << "ERROR! while parsing the " << name << " option: " << e.what() << std::endl;
+			return {defaultValue, true};
+		}
+	};
+
+	const auto [threads, threadsError] = getNumberOption(threadsOptionLoc, "Threads", defaultReactorThreads, 1, 1024);
+	const auto [workers, workersError] = getNumberOption(workersOptionLoc, "Workers", 0, 0, 65536);
+	const auto [queue, queueError] = getNumberOption(queueOptionLoc, "Queue", defaultSessionQueue, 1, 1 << 20);
+	const auto [maxSessions, maxSessionsError] = getNumberOption(maxSessionsOptionLoc, "Max sessions", 0, 0, 1 << 24);
+	const auto [maxPerIp, maxPerIpError] = getNumberOption(maxPerIpOptionLoc, "Max sessions per ip", 0, 0, 1 << 24);
+	const auto [logFlush, logFlushError] = getNumberOption(logFlushOptionLoc, "Log flush interval", defaultLogFlushMs, 1, 60000);
+	const auto [listCacheMb, listCacheMbError] = getNumberOption(listCacheOptionLoc, "List cache size", defaultListCacheMb, 0, 1 << 20);
+	const auto [deflateLevel, deflateLevelError] = getNumberOption(deflateLevelOptionLoc, "Deflate level", defaultDeflateLevel, 0, 9);
+	const auto [maxSegments, maxSegmentsError] = getNumberOption(maxSegmentsOptionLoc, "Max segments", defaultMaxSegments, 1, 256);
+	const auto [hotCacheMb, hotCacheMbError] = getNumberOption(hotCacheOptionLoc, "Hot file cache size", defaultHotCacheMb, 0, 1 << 20);
+	const auto [rateLimitKb, rateLimitKbError] = getNumberOption(rateLimitOptionLoc, "Rate limit", 0, 0, 1 << 30);
+	const auto [sessionRateKb, sessionRateKbError] = getNumberOption(sessionRateOptionLoc, "Session rate limit", 0, 0, 1 << 30);
+	const auto [metricsPort, metricsPortError] = getNumberOption(metricsPortOptionLoc, "Metrics port", 0, 0, 65535);
+
 	// get the port if specified
 	// if -p specified it overrides other params
 	const auto [port, portError] = [=]() -> std::pair<in_port_t, bool> {
@@ -102,11 +311,27 @@ std::tuple<in_port_t, std::string, std::string, bool> parseArgs(int argc, const
 				// if we have reached the end then there is no port option
 				if (location == (argv + argc))
 					return nullptr;
-				// if the current or previous argument is an option, skip
+				// if the current argument is an option or the previous one is an option with a value, skip
 				if ((
 						logOptionFinder(*(location - 1)) or
 						helpOptionFinder(*(location - 1)) or
 						dirOptionFinder(*(location - 1)) or
+						threadsOptionFinder(*(location - 1)) or
+						workersOptionFinder(*(location - 1)) or
+						queueOptionFinder(*(location - 1)) or
+						maxSessionsOptionFinder(*(location - 1)) or
+						maxPerIpOptionFinder(*(location - 1)) or
+						engineOptionFinder(*(location - 1)) or
+						logFlushOptionFinder(*(location - 1)) or
+						listCacheOptionFinder(*(location - 1)) or
+						pasvPortsOptionFinder(*(location - 1)) or
+						deflateLevelOptionFinder(*(location - 1)) or
+						maxSegmentsOptionFinder(*(location - 1)) or
+						hotCacheOptionFinder(*(location - 1)) or
+						rateLimitOptionFinder(*(location - 1)) or
+						sessionRateOptionFinder(*(location - 1)) or
+						adminOptionFinder(*(location - 1)) or
+						metricsPortOptionFinder(*(location - 1)) or
 						portOptionFinder(*(location - 1)))
 					or (**location == '-'))
 				{
@@ -136,7 +361,33 @@ std::tuple<in_port_t, std::string, std::string, bool> parseArgs(int argc, const
 	}();
 
 	// finally return parsed variables
-	return {port, logString, dirPath, logError or portError or dirError};
+	options.port = port;
+	options.logFileName = logString;
+	options.dirPath = dirPath;
+	options.reactorMode = isPresent(reactorOptionLoc);
+	options.reactorThreads = threads;
+	options.workers = workers;
+	options.sessionQueue = queue;
+	options.maxSessions = maxSessions;
+	options.maxPerIp = maxPerIp;
+	options.engine = engine;
+	options.logFlushMs = logFlush;
+	options.listCacheMb = listCacheMb;
+	options.pasvPortMin = pasvPorts.first;
+	options.pasvPortMax = pasvPorts.second;
+	options.deflateLevel = deflateLevel;
+	options.maxSegments = maxSegments;
+	options.hashUploads = isPresent(hashUploadsOptionLoc);
+	options.hotCacheMb = hotCacheMb;
+	options.rateLimitKb = rateLimitKb;
+	options.sessionRateKb = sessionRateKb;
+	options.adminUser = adminUser;
+	options.metricsPort = metricsPort;
+	options.needToClose = logError or portError or dirError or threadsError or workersError or queueError or
+						  maxSessionsError or maxPerIpError or engineError or logFlushError or listCacheMbError or
+						  pasvPortsError or deflateLevelError or maxSegmentsError or hotCacheMbError or
+						  rateLimitKbError or sessionRateKbError or adminError or metricsPortError;
+	return options;
 }
 
 #endif //CPP_FTP_ARGPARSE_HPP
@@ -0,0 +1,108 @@
+// benchmark for the MODE Z deflate stage
+// sends temporary files with different contents over a loopback TCP connection through sendFileDeflated
+// and reports the CPU time per GB of file data against the bytes saved on the wire for every zlib level
+// usage: cpp_ftp_deflatebench [FILE SIZE IN MB]
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <sockpp/tcp_acceptor.h>
+#include <sockpp/tcp_connector.h>
+#include "globals.hpp"
+#include "deflatestream.hpp"
+
+// user + system CPU time of the whole process in seconds
+double cpuSeconds() {
+	rusage usage {};
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+// create a file of the requested size from the lines the generator gives
+std::string makeFile(size_t size, const std::function<std::string(uint32_t &)> &nextLine) {
+	char path[] = "/tmp/cpp_ftp_deflatebenchXXXXXX";
+	const uniqueFd fd(mkstemp(path));
+	uint32_t state = 12345;
+	std::string block;
+	for (size_t written = 0; written < size; written += block.size()) {
+		block.clear();
+		while (block.size() < BUFSIZE)
+			block += nextLine(state);
+		block.resize(std::min<size_t>(block.size(), size - written));
+		if (::write(fd.get(), block.data(), block.size()) < 0)
+			break;
+	}
+	return path;
+}
+
+uint32_t nextRandom(uint32_t &state) {
+	return state = state * 1103515245 + 12345;
+}
+
+void runLevel(const std::string &name, const std::string &path, size_t size, int level) {
+	sockpp::tcp_acceptor acceptor(sockpp::inet_address("127.0.0.1", 0));
+	sockpp::tcp_connector connector(acceptor.address());
+	sockpp::tcp_socket sender = acceptor.accept();
+	// the receiving side simply drains the connection, it doesn't inflate
+	std::thread reader([connection = sockpp::tcp_socket(std::move(connector))]() mutable {
+		dataT buffer(1 << 20);
+		while (connection.read(buffer.data(), buffer.size()) > 0) {}
+	});
+
+	const uniqueFd fileFd(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+	transferControl control;
+	uint64_t wireBytes = 0;
+	const double cpuBefore = cpuSeconds();
+	const auto start = std::chrono::steady_clock::now();
+	const auto [status, sent] = sendFileDeflated(sender, fileFd.get(), 0, level, control, wireBytes);
+	sender.shutdown(SHUT_WR);
+	reader.join();
+	const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	const double cpu = cpuSeconds() - cpuBefore;
+	if (status != TRANSFER_DONE or sent != size)
+		std::cerr << name << ": transfer failed after " << sent << " bytes" << std::endl;
+	const double gigabytes = static_cast<double>(size) / (1 << 30);
+	char line[160];
+	snprintf(line, sizeof(line), "%-6s level %d: %7.1f MB/s, %6.2f CPU s/GB, %6.1f%% saved (%lu -> %lu bytes)",
+			 name.c_str(), level, gigabytes * 1024 / seconds, cpu / gigabytes, 100.0 - 100.0 * wireBytes / size, sent, wireBytes);
+	std::cout << line << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+	const size_t size = (argc > 1 ? std::stoull(argv[1]) : 128) << 20;
+	std::cout << "Deflating " << (size >> 20) << " MB per file" << std::endl;
+
+	const std::pair<std::string, std::function<std::string(uint32_t &)>> corpora[] = {
+		{"csv", [](uint32_t &state) {
+			return std::to_string(nextRandom(state) % 1000000) + ",2024-0" + std::to_string(1 + nextRandom(state) % 9) + "-1" +
+				   std::to_string(nextRandom(state) % 10) + ",customer_" + std::to_string(nextRandom(state) % 5000) + "," +
+				   std::to_string(nextRandom(state) % 100000) + "." + std::to_string(nextRandom(state) % 100) + ",EUR\n";
+		}},
+		{"log", [](uint32_t &state) {
+			static const char *levels[] = {"INFO", "WARN", "DEBUG", "ERROR"};
+			return "2024-05-1" + std::to_string(nextRandom(state) % 10) + "T12:" + std::to_string(10 + nextRandom(state) % 50) +
+				   ":00Z [" + levels[nextRandom(state) % 4] + "] [127.0.0.1:" + std::to_string(30000 + nextRandom(state) % 30000) +
+				   "] - user requested file /srv/export/part-" + std::to_string(nextRandom(state) % 100) + ".csv\n";
+		}},
+		{"random", [](uint32_t &state) {
+			std::string chunk(256, '\0');
+			for (auto &value: chunk)
+				value = static_cast<char>(nextRandom(state) >> 24);
+			return chunk;
+		}},
+	};
+	for (const auto &[name, generator]: corpora) {
+		const std::string path = makeFile(size, generator);
+		const uniqueFd fileFd(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+		// the server would send this file with level 0 no matter what the session asked for
+		std::cout << name << ": " << (looksCompressed(fileFd.get(), name) ? "looks compressed" : "compressible") << std::endl;
+		for (const int level: {0, 1, 3, 6, 9})
+			runLevel(name, path, size, level);
+		::unlink(path.c_str());
+	}
+	return 0;
+}
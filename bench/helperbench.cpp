@@ -0,0 +1,230 @@
+// microbenchmarks for the helper functions on the hot paths of the server, each measured on its own:
+// line framing (readline over a loopback connection and extractLine), command parsing (getNextParam, splitByDelim),
+// path normalization (the resolver behind getPath), permissions and LIST lines (getFilePerms, formatListLine,
+// formatListing) and the buffered stream writer (streamTransferWriter::write)
+// build with -DCMAKE_BUILD_TYPE=Release for meaningful numbers, --benchmark_filter=NAME runs a part of them
+#include <benchmark/benchmark.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <sockpp/socket.h>
+#include <sockpp/tcp_acceptor.h>
+#include <sockpp/tcp_connector.h>
+#include "globals.hpp"
+#include "utils.hpp"
+#include "netbuffer.hpp"
+#include "ftp.hpp"
+
+// ignores SIGPIPE, so the threads on the other ends of the connections stop on a write error
+const sockpp::socket_initializer sockInit;
+
+// pipelined commands of the given length (CRLF included) which fill most of the buffer
+std::string makeLines(size_t lineLength) {
+	std::string data;
+	while (data.size() + lineLength <= BUFSIZE - BUFSIZE / 8)
+		data += std::string(lineLength - 2, 'A') + CRLF;
+	return data;
+}
+
+// loopback TCP connection, the benchmark uses one end and a thread the other
+struct loopbackPair {
+	sockpp::tcp_socket local, remote;
+
+	loopbackPair() {
+		sockpp::tcp_acceptor acceptor(sockpp::inet_address("127.0.0.1", 0));
+		sockpp::tcp_connector connector(acceptor.address());
+		local = acceptor.accept();
+		remote = sockpp::tcp_socket(std::move(connector));
+	}
+};
+
+// temporary directory with files for the path and listing benchmarks, removed at exit
+struct benchDirectory {
+	std::string path;
+
+	benchDirectory() {
+		char name[] = "/tmp/cpp_ftp_benchXXXXXX";
+		path = ::mkdtemp(name);
+	}
+
+	~benchDirectory() {
+		fs::remove_all(path);
+	}
+
+	// subdirectory with count empty files, created the first time it is asked for
+	std::string withFiles(size_t count) {
+		const std::string directory = path + "/files" + std::to_string(count);
+		if (fs::exists(directory))
+			return directory;
+		fs::create_directory(directory);
+		for (size_t i = 0; i < count; i++)
+			uniqueFd(::open((directory + "/file" + std::to_string(i) + ".txt").c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644));
+		return directory;
+	}
+};
+benchDirectory tempDirectory;
+
+// readline on a real socket, a thread keeps writing pipelined commands into the other end
+// items processed are the lines read, so the syscalls are spread over the lines which arrive together
+static void readlineLoopback(benchmark::State &state) {
+	loopbackPair connection;
+	const std::string data = makeLines(state.range(0));
+	std::thread writer([&]() {
+		while (connection.remote.write_n(data.data(), data.size()) == ssize_t(data.size())) {}
+	});
+	lineBuffer lines;
+	size_t framed = 0;
+	for (auto _: state) {
+		benchmark::DoNotOptimize(readline(connection.local, lines, []() {}).data());
+		framed++;
+	}
+	connection.local.shutdown(SHUT_RDWR);
+	connection.remote.shutdown(SHUT_RDWR);
+	writer.join();
+	state.SetItemsProcessed(framed);
+	state.SetBytesProcessed(framed * state.range(0));
+}
+BENCHMARK(readlineLoopback)->Arg(8)->Arg(32)->Arg(128)->Arg(1024)->Arg(4096);
+
+// extractLine alone on data which is already in the buffer, the part of readline findPair used to be
+static void extractLines(benchmark::State &state) {
+	const std::string data = makeLines(state.range(0));
+	lineBuffer lines;
+	std::string_view line;
+	size_t framed = 0;
+	for (auto _: state) {
+		std::copy(data.begin(), data.end(), lines.storage.data());
+		lines.tail = data.size();
+		while (extractLine(lines, line) == LINE_READY) {
+			benchmark::DoNotOptimize(line.data());
+			framed++;
+		}
+	}
+	state.SetItemsProcessed(framed);
+	state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(extractLines)->Arg(8)->Arg(32)->Arg(128)->Arg(1024)->Arg(4096);
+
+// take every parameter of a command apart with getNextParam
+static void nextParams(benchmark::State &state) {
+	static const std::string_view commands[] = {
+		"NOOP", "RETR some/file.bin", "PORT 127,0,0,1,195,80", "SITE RATE USER someone 1024", "MLSD"
+	};
+	const std::string_view command = commands[state.range(0)];
+	for (auto _: state) {
+		std::string_view rest = command;
+		while (not rest.empty()) {
+			const auto [param, leftover] = getNextParam(rest);
+			benchmark::DoNotOptimize(param.data());
+			rest = leftover;
+		}
+	}
+	state.SetLabel(std::string(command));
+}
+BENCHMARK(nextParams)->DenseRange(0, 4);
+
+// split a PORT argument and longer lists, the recursion copies the rest of the string at every field
+static void splitDelim(benchmark::State &state) {
+	std::string list = "127";
+	for (int64_t i = 1; i < state.range(0); i++)
+		list += "," + std::to_string(i);
+	for (auto _: state)
+		benchmark::DoNotOptimize(splitByDelim(list, ","));
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(splitDelim)->Arg(6)->Arg(32)->Arg(256);
+
+// normalization of a client path against the current directory, what getPath does for every path argument
+// relative paths of the given depth, the same with a ".." and "." in every component, and an absolute path
+static void normalizePath(benchmark::State &state) {
+	const uniqueFd rootFd(::open(tempDirectory.path.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC));
+	const pathResolver resolver(rootFd.get(), tempDirectory.path);
+	const std::string rootName = fs::path(tempDirectory.path).filename().generic_string();
+	std::string path;
+	for (int64_t depth = 0; depth < state.range(0); depth++) {
+		if (not path.empty())
+			path += '/';
+		if (state.range(1) == 1)
+			path += "skip/.././";
+		path += "dir" + std::to_string(depth);
+	}
+	if (state.range(1) == 2)
+		path = "/" + rootName + "/" + path;
+	std::string relative;
+	for (auto _: state) {
+		benchmark::DoNotOptimize(resolver.normalize(path, relative));
+		benchmark::DoNotOptimize(relative.data());
+	}
+	state.SetLabel(state.range(1) == 0 ? "relative" : state.range(1) == 1 ? "dot segments" : "absolute");
+}
+BENCHMARK(normalizePath)->ArgsProduct({{1, 4, 16, 64}, {0, 1, 2}});
+
+// permission string of one file the old way, fs::status and a string built char by char
+static void filePerms(benchmark::State &state) {
+	const std::string path = tempDirectory.withFiles(1) + "/file0.txt";
+	for (auto _: state)
+		benchmark::DoNotOptimize(getFilePerms(path));
+}
+BENCHMARK(filePerms);
+
+// LIST line of one file the way the listing engine builds it, statx and formatListLine into a stack buffer
+static void listLine(benchmark::State &state) {
+	const uniqueFd dirFd(::open(tempDirectory.withFiles(1).c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+	char line[listingLineSize];
+	struct statx stx {};
+	for (auto _: state) {
+		statEntry(dirFd.get(), "file0.txt", listStatxMask, stx);
+		benchmark::DoNotOptimize(formatListLine(line, stx, "file0.txt"));
+	}
+}
+BENCHMARK(listLine);
+
+// formatListLine alone, without the statx
+static void listLineFormat(benchmark::State &state) {
+	char line[listingLineSize];
+	struct statx stx {};
+	stx.stx_mode = S_IFREG | 0644;
+	stx.stx_size = 123456789;
+	for (auto _: state) {
+		benchmark::DoNotOptimize(formatListLine(line, stx, "some-file-name.txt"));
+		benchmark::ClobberMemory();
+	}
+}
+BENCHMARK(listLineFormat);
+
+// whole LIST output of a directory, items processed are the entries
+static void listDirectory(benchmark::State &state) {
+	const std::string directory = tempDirectory.withFiles(state.range(0));
+	for (auto _: state)
+		benchmark::DoNotOptimize(formatListing(uniqueFd(::open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC))));
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(listDirectory)->Arg(10)->Arg(1000)->Arg(10000);
+
+// streamTransferWriter::write with chunks of the given size into a loopback connection which a thread drains
+// every iteration writes 1 MB, the small chunks show the cost of the buffering itself
+static void streamWriter(benchmark::State &state) {
+	loopbackPair connection;
+	std::thread reader([&]() {
+		dataT buffer(1 << 20);
+		while (connection.remote.read(buffer.data(), buffer.size()) > 0) {}
+	});
+	const size_t chunkSize = state.range(0), total = 1 << 20;
+	const dataT chunk(chunkSize, 'x');
+	streamTransferWriter writer;
+	for (auto _: state) {
+		for (size_t written = 0; written < total; written += chunkSize)
+			writer.write(connection.local, chunk.data(), chunkSize);
+	}
+	writer.finish(connection.local);
+	connection.local.shutdown(SHUT_WR);
+	reader.join();
+	state.SetBytesProcessed(state.iterations() * total);
+}
+BENCHMARK(streamWriter)->Arg(16)->Arg(256)->Arg(4096)->Arg(BUFSIZE)->Arg(1 << 20);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,117 @@
+// microbenchmark for the control connection line framing
+// compares the lineBuffer framer against the previous readline implementation
+// (recursive findPair, rescan of the whole buffer after every read, a new vector per line)
+// build with -DCMAKE_BUILD_TYPE=Release for meaningful numbers
+#include <benchmark/benchmark.h>
+#include <algorithm>
+#include <string_view>
+#include "globals.hpp"
+#include "netbuffer.hpp"
+
+namespace legacy {
+	// previous framer, kept here as the baseline
+	dataT::iterator findPair(dataT::iterator start, dataT::iterator end, const std::pair<byte, byte> &toFind) {
+		if (start == end or start + 1 == end)
+			return end;
+		if (*start == toFind.first and *(start + 1) == toFind.second)
+			return start;
+		return findPair(start + 1, end, toFind);
+	}
+
+	void readyBuffer(netbuffer &netbuff, dataT::iterator pos) {
+		std::move_backward(pos + 2, netbuff.buffer.end(), netbuff.buffer.begin() + (netbuff.buffer.end() - pos - 2));
+		netbuff.buffer.resize(netbuff.buffer.end() - pos - 2);
+	}
+
+	lineStatus extractLine(netbuffer &netbuff, dataT &line) {
+		const dataT::iterator ptrToCRLF = findPair(netbuff.buffer.begin(), netbuff.buffer.end(), CRLFp);
+		if (ptrToCRLF == netbuff.buffer.end()) {
+			if (netbuff.buffer.size() == netbuff.buffer.capacity()) {
+				netbuff.buffer.clear();
+				return LINE_TOO_LONG;
+			}
+			return LINE_PARTIAL;
+		}
+		line.assign(netbuff.buffer.begin(), ptrToCRLF);
+		readyBuffer(netbuff, ptrToCRLF);
+		return LINE_READY;
+	}
+}
+
+// pipelined commands of the given length (CRLF included) which fill most of the buffer
+dataT makeLines(size_t lineLength) {
+	dataT data;
+	while (data.size() + lineLength <= BUFSIZE - BUFSIZE / 8) {
+		data.insert(data.end(), lineLength - 2, 'A');
+		data.push_back('\r');
+		data.push_back('\n');
+	}
+	return data;
+}
+
+// deliver the data in chunks of chunkSize like the socket would and cut out every line
+// items processed are the lines framed
+static void legacyFramer(benchmark::State &state) {
+	const dataT data = makeLines(state.range(0));
+	const size_t chunkSize = state.range(1);
+	netbuffer netbuff;
+	dataT line;
+	size_t lines = 0;
+	for (auto _: state) {
+		for (size_t offset = 0; offset < data.size(); offset += chunkSize) {
+			const size_t chunk = std::min(chunkSize, data.size() - offset);
+			netbuff.buffer.insert(netbuff.buffer.end(), data.begin() + offset, data.begin() + offset + chunk);
+			while (legacy::extractLine(netbuff, line) == LINE_READY) {
+				benchmark::DoNotOptimize(line.data());
+				lines++;
+			}
+		}
+	}
+	state.SetItemsProcessed(lines);
+	state.SetBytesProcessed(state.iterations() * data.size());
+}
+
+static void lineFramer(benchmark::State &state) {
+	const dataT data = makeLines(state.range(0));
+	const size_t chunkSize = state.range(1);
+	lineBuffer lines;
+	std::string_view line;
+	size_t framed = 0;
+	for (auto _: state) {
+		for (size_t offset = 0; offset < data.size(); ) {
+			const auto [space, spaceSize] = lineSpace(lines);
+			const size_t chunk = std::min({chunkSize, data.size() - offset, spaceSize});
+			std::copy_n(data.begin() + offset, chunk, space);
+			lines.tail += chunk;
+			offset += chunk;
+			while (extractLine(lines, line) == LINE_READY) {
+				benchmark::DoNotOptimize(line.data());
+				framed++;
+			}
+		}
+	}
+	state.SetItemsProcessed(framed);
+	state.SetBytesProcessed(state.iterations() * data.size());
+}
+
+// {line length, read chunk size}: short commands, long paths, and a long line arriving in small reads
+#define FRAMER_ARGS ->Args({16, 1 << 16})->Args({64, 1 << 16})->Args({512, 1 << 16})->Args({4096, 1 << 16}) \
+	->Args({4096, 64})->Args({16384, 512})
+BENCHMARK(legacyFramer) FRAMER_ARGS;
+BENCHMARK(lineFramer) FRAMER_ARGS;
+
+// raw CRLF search over a buffer without any CRLF in it
+template<size_t (*search)(const byte *, size_t)>
+static void crlfSearch(benchmark::State &state) {
+	const dataT data(state.range(0), 'A');
+	for (auto _: state)
+		benchmark::DoNotOptimize(search(data.data(), data.size()));
+	state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK_TEMPLATE(crlfSearch, findCRLFScalar)->Arg(64)->Arg(4096)->Arg(BUFSIZE);
+#if defined(__SSE2__)
+BENCHMARK_TEMPLATE(crlfSearch, findCRLFSse2)->Arg(64)->Arg(4096)->Arg(BUFSIZE);
+BENCHMARK_TEMPLATE(crlfSearch, findCRLFAvx2)->Arg(64)->Arg(4096)->Arg(BUFSIZE);
+#endif
+
+BENCHMARK_MAIN();
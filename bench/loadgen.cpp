@@ -0,0 +1,401 @@
+// load generator for the server
+// opens many concurrent control sessions against a running server, every session runs a weighted random mix
+// of operations until the time is up, then the connection setup time, the throughput and the latency
+// percentiles of every command are reported, and optionally written as JSON so runs can be compared
+// usage: ftp_loadgen [-h HOST] [-p PORT] [-u USER:PASS] [-n SESSIONS] [-d SECONDS] [-m MIX] [-c DIR] [-f FILE]
+//                    [-s STOR SIZE IN KB] [-t LABEL] [-j JSON FILE]
+// MIX are the weights of the operations, like login=1,cwd=4,list=2,retr=2,stor=1
+// login logs in again on a new connection, cwd changes to DIR, retr downloads FILE, stor uploads loadgen-N.bin
+// into the current directory, DIR and FILE are best given as absolute paths the way PWD shows them
+// every session is a thread, so thousands of sessions may need a higher ulimit -n on both sides
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <sockpp/tcp_connector.h>
+#include "globals.hpp"
+
+enum operation {OP_LOGIN, OP_CWD, OP_LIST, OP_RETR, OP_STOR, OP_COUNT};
+const char *operationNames[OP_COUNT] = {"login", "cwd", "list", "retr", "stor"};
+
+// what the latencies are recorded for: the connection setup up to the greeting and every command sent
+// the transfer commands are timed from the command up to the final reply, so the data is included
+enum metric {METRIC_CONNECT, METRIC_USER, METRIC_PASS, METRIC_TYPE, METRIC_CWD, METRIC_PASV, METRIC_LIST, METRIC_RETR,
+			 METRIC_STOR, METRIC_COUNT};
+const char *metricNames[METRIC_COUNT] = {"connect", "USER", "PASS", "TYPE", "CWD", "PASV", "LIST", "RETR", "STOR"};
+
+struct loadOptions {
+	std::string host = "127.0.0.1";
+	in_port_t port = 21;
+	std::string user = "anonymous", password = "loadgen";
+	uint32_t sessions = 100;
+	double seconds = 10;
+	uint32_t weights[OP_COUNT] = {1, 4, 2, 2, 1};
+	std::string directory = "/", file = "file.bin";
+	size_t storSize = 64 << 10;
+	std::string label, jsonPath;
+	sockpp::inet_address address;
+};
+
+// what one session measured, merged once every session is done
+struct sessionStats {
+	std::vector<uint32_t> latencies[METRIC_COUNT];
+	uint64_t errors[METRIC_COUNT] {};
+	uint64_t operations[OP_COUNT] {};
+	uint64_t bytesIn = 0, bytesOut = 0;
+};
+
+// parse the weights of the mix, returns false if an operation is unknown or a weight isn't a number
+bool parseMix(std::string_view mix, uint32_t (&weights)[OP_COUNT]) {
+	std::fill(std::begin(weights), std::end(weights), 0);
+	while (not mix.empty()) {
+		const std::string_view item = mix.substr(0, mix.find(','));
+		mix.remove_prefix(std::min(mix.size(), item.size() + 1));
+		const size_t equals = item.find('=');
+		const auto found = std::find(std::begin(operationNames), std::end(operationNames), item.substr(0, equals));
+		if (equals == std::string_view::npos or found == std::end(operationNames))
+			return false;
+		try {
+			weights[found - std::begin(operationNames)] = std::stoul(std::string(item.substr(equals + 1)));
+		} catch (const std::exception &) {
+			return false;
+		}
+	}
+	return std::any_of(std::begin(weights), std::end(weights), [](uint32_t weight) { return weight != 0; });
+}
+
+// control connection of one session
+class ftpClient {
+public:
+	std::string lastReply;
+
+	bool connect(const sockpp::inet_address &address) {
+		buffer.clear();
+		sock = sockpp::tcp_connector(address);
+		// a server which stops answering shows up as errors instead of hanging the run
+		sock.read_timeout(std::chrono::seconds(30));
+		return bool(sock);
+	}
+
+	void close() {
+		sock.close();
+	}
+
+	bool send(std::string_view line) {
+		const std::string command = std::string(line) + CRLF;
+		return sock.write_n(command.data(), command.size()) == ssize_t(command.size());
+	}
+
+	// read a whole reply, multiline replies included, returns its code or -1 if the connection broke
+	int readReply() {
+		std::string line;
+		if (not readLine(line) or line.size() < 3)
+			return -1;
+		lastReply = line;
+		// a multiline reply ends with the line which starts with its code and a space
+		if (line.size() > 3 and line[3] == '-') {
+			const std::string end = line.substr(0, 3) + " ";
+			do {
+				if (not readLine(line))
+					return -1;
+			} while (line.compare(0, 4, end) != 0);
+		}
+		return std::atoi(lastReply.c_str());
+	}
+
+private:
+	sockpp::tcp_connector sock;
+	std::string buffer;
+
+	bool readLine(std::string &line) {
+		size_t end;
+		while ((end = buffer.find(CRLF)) == std::string::npos) {
+			char chunk[4096];
+			const ssize_t numRead = sock.read(chunk, sizeof(chunk));
+			if (numRead <= 0)
+				return false;
+			buffer.append(chunk, numRead);
+		}
+		line = buffer.substr(0, end);
+		buffer.erase(0, end + CRLF.size());
+		return true;
+	}
+};
+
+uint32_t microsSince(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+// send a command and time its reply, a reply of another class than expected counts as an error
+// returns the code of the reply or -1 if the connection broke
+int timedCommand(ftpClient &client, sessionStats &stats, metric type, std::string_view line, int expectedClass) {
+	const auto start = std::chrono::steady_clock::now();
+	const int code = client.send(line) ? client.readReply() : -1;
+	stats.latencies[type].push_back(microsSince(start));
+	if (code / 100 != expectedClass)
+		stats.errors[type]++;
+	return code;
+}
+
+// open a new control connection and log in, returns false if the session can't be used
+bool login(ftpClient &client, const loadOptions &options, sessionStats &stats) {
+	const auto start = std::chrono::steady_clock::now();
+	if (not client.connect(options.address) or client.readReply() != 220) {
+		stats.errors[METRIC_CONNECT]++;
+		return false;
+	}
+	stats.latencies[METRIC_CONNECT].push_back(microsSince(start));
+	return timedCommand(client, stats, METRIC_USER, "USER " + options.user, 3) >= 0 and
+		   timedCommand(client, stats, METRIC_PASS, "PASS " + options.password, 2) / 100 == 2 and
+		   timedCommand(client, stats, METRIC_TYPE, "TYPE I", 2) >= 0;
+}
+
+// data port from the PASV reply, the address is always the one of the control connection
+in_port_t pasvPort(const std::string &reply) {
+	std::vector<uint32_t> numbers;
+	for (size_t position = 4; position < reply.size(); ) {
+		if (not std::isdigit(static_cast<unsigned char>(reply[position]))) {
+			position++;
+			continue;
+		}
+		size_t length = 0;
+		numbers.push_back(std::stoul(reply.substr(position), &length));
+		position += length;
+	}
+	return numbers.size() >= 2 ? numbers[numbers.size() - 2] * 256 + numbers.back() : 0;
+}
+
+// run a command with a data connection opened with PASV, the data is drained or, for an upload, generated
+// returns false if the control connection broke
+bool dataCommand(ftpClient &client, const loadOptions &options, sessionStats &stats, metric type, const std::string &line,
+				 bool upload) {
+	const int pasv = timedCommand(client, stats, METRIC_PASV, "PASV", 2);
+	if (pasv != 227)
+		return pasv >= 0;
+	const in_port_t port = pasvPort(client.lastReply);
+	sockpp::tcp_connector data(sockpp::inet_address(options.address.address(), port));
+	const auto start = std::chrono::steady_clock::now();
+	if (not client.send(line))
+		return false;
+	const int code = client.readReply();
+	if (code / 100 != 1) {
+		stats.latencies[type].push_back(microsSince(start));
+		stats.errors[type]++;
+		return code >= 0;
+	}
+	if (upload) {
+		static const dataT block(BUFSIZE, 'x');
+		for (size_t sent = 0; sent < options.storSize; ) {
+			const ssize_t written = data.write_n(block.data(), std::min(block.size(), options.storSize - sent));
+			if (written <= 0)
+				break;
+			sent += written;
+			stats.bytesOut += written;
+		}
+		data.shutdown(SHUT_WR);
+	} else {
+		dataT buffer(1 << 16);
+		ssize_t numRead;
+		while ((numRead = data.read(buffer.data(), buffer.size())) > 0)
+			stats.bytesIn += numRead;
+	}
+	data.close();
+	const int result = client.readReply();
+	stats.latencies[type].push_back(microsSince(start));
+	if (result / 100 != 2)
+		stats.errors[type]++;
+	return result >= 0;
+}
+
+// one session, runs operations picked by their weights until the end of the run
+void runSession(const loadOptions &options, uint32_t index, std::chrono::steady_clock::time_point end, sessionStats &stats) {
+	uint32_t totalWeight = 0;
+	for (const uint32_t weight: options.weights)
+		totalWeight += weight;
+	uint64_t state = 0x9e3779b97f4a7c15ull * (index + 1);
+	ftpClient client;
+	bool connected = false;
+	while (std::chrono::steady_clock::now() < end) {
+		if (not connected) {
+			connected = login(client, options, stats);
+			if (not connected) {
+				client.close();
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			}
+			continue;
+		}
+		// xorshift, every session has its own sequence
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		uint32_t pick = state % totalWeight, op = 0;
+		while (pick >= options.weights[op])
+			pick -= options.weights[op++];
+		stats.operations[op]++;
+		switch (op) {
+			case OP_LOGIN:
+				client.send("QUIT");
+				client.readReply();
+				client.close();
+				connected = login(client, options, stats);
+				break;
+			case OP_CWD:
+				connected = timedCommand(client, stats, METRIC_CWD, "CWD " + options.directory, 2) >= 0;
+				break;
+			case OP_LIST:
+				connected = dataCommand(client, options, stats, METRIC_LIST, "LIST", false);
+				break;
+			case OP_RETR:
+				connected = dataCommand(client, options, stats, METRIC_RETR, "RETR " + options.file, false);
+				break;
+			case OP_STOR:
+				connected = dataCommand(client, options, stats, METRIC_STOR, "STOR loadgen-" + std::to_string(index) + ".bin", true);
+				break;
+		}
+		if (not connected)
+			client.close();
+	}
+	if (connected) {
+		client.send("QUIT");
+		client.readReply();
+	}
+}
+
+// value below which the fraction q of the sorted latencies lies
+uint32_t percentile(const std::vector<uint32_t> &sorted, double q) {
+	if (sorted.empty())
+		return 0;
+	return sorted[std::min(sorted.size() - 1, size_t(q * (sorted.size() - 1) + 0.5))];
+}
+
+bool parseOptions(int argc, char *argv[], loadOptions &options) {
+	for (int i = 1; i < argc; i += 2) {
+		const std::string flag = argv[i];
+		if (i + 1 >= argc)
+			return false;
+		const std::string value = argv[i + 1];
+		try {
+			if (flag == "-h")
+				options.host = value;
+			else if (flag == "-p")
+				options.port = std::stoul(value);
+			else if (flag == "-u" and value.find(':') != std::string::npos)
+				options.user = value.substr(0, value.find(':')), options.password = value.substr(value.find(':') + 1);
+			else if (flag == "-n")
+				options.sessions = std::max(1ul, std::stoul(value));
+			else if (flag == "-d")
+				options.seconds = std::stod(value);
+			else if (flag == "-m") {
+				if (not parseMix(value, options.weights))
+					return false;
+			} else if (flag == "-c")
+				options.directory = value;
+			else if (flag == "-f")
+				options.file = value;
+			else if (flag == "-s")
+				options.storSize = std::stoull(value) << 10;
+			else if (flag == "-t")
+				options.label = value;
+			else if (flag == "-j")
+				options.jsonPath = value;
+			else
+				return false;
+		} catch (const std::exception &) {
+			return false;
+		}
+	}
+	try {
+		options.address = sockpp::inet_address(options.host, options.port);
+	} catch (const std::exception &error) {
+		std::cerr << "Can't resolve " << options.host << ": " << error.what() << std::endl;
+		return false;
+	}
+	return true;
+}
+
+int main(int argc, char *argv[]) {
+	const sockpp::socket_initializer sockInit;
+	loadOptions options;
+	if (not parseOptions(argc, argv, options)) {
+		std::cerr << "usage: ftp_loadgen [-h HOST] [-p PORT] [-u USER:PASS] [-n SESSIONS] [-d SECONDS] "
+					 "[-m login=1,cwd=4,list=2,retr=2,stor=1] [-c DIR] [-f FILE] [-s STOR SIZE IN KB] [-t LABEL] [-j JSON FILE]"
+				  << std::endl;
+		return 1;
+	}
+	std::cout << "Running " << options.sessions << " sessions against " << options.address.to_string() << " for " <<
+			  options.seconds << " s" << std::endl;
+
+	std::vector<sessionStats> stats(options.sessions);
+	std::vector<std::thread> sessions;
+	const auto start = std::chrono::steady_clock::now();
+	const auto end = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+			std::chrono::duration<double>(options.seconds));
+	for (uint32_t i = 0; i < options.sessions; i++)
+		sessions.emplace_back(runSession, std::cref(options), i, end, std::ref(stats[i]));
+	for (auto &thr: sessions)
+		thr.join();
+	const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	sessionStats total;
+	for (auto &session: stats) {
+		for (int type = 0; type < METRIC_COUNT; type++) {
+			total.latencies[type].insert(total.latencies[type].end(), session.latencies[type].begin(), session.latencies[type].end());
+			total.errors[type] += session.errors[type];
+		}
+		for (int op = 0; op < OP_COUNT; op++)
+			total.operations[op] += session.operations[op];
+		total.bytesIn += session.bytesIn;
+		total.bytesOut += session.bytesOut;
+	}
+	uint64_t operations = 0;
+	for (const uint64_t count: total.operations)
+		operations += count;
+
+	char line[200];
+	snprintf(line, sizeof(line), "%lu operations in %.1f s: %.0f ops/s, %.2f MB/s down, %.2f MB/s up", operations, seconds,
+			 operations / seconds, total.bytesIn / seconds / (1 << 20), total.bytesOut / seconds / (1 << 20));
+	std::cout << line << std::endl;
+	std::cout << "command        count   errors     p50 us     p90 us     p99 us     max us" << std::endl;
+	std::string json = "{\"label\": \"" + options.label + "\", \"host\": \"" + options.address.to_string() +
+					   "\", \"sessions\": " + std::to_string(options.sessions) + ", \"seconds\": " + std::to_string(seconds) +
+					   ", \"mix\": {";
+	for (int op = 0; op < OP_COUNT; op++)
+		json += std::string(op ? ", " : "") + "\"" + operationNames[op] + "\": " + std::to_string(options.weights[op]);
+	json += "}, \"operations\": " + std::to_string(operations) + ", \"ops_per_second\": " + std::to_string(operations / seconds) +
+			", \"bytes_in\": " + std::to_string(total.bytesIn) + ", \"bytes_out\": " + std::to_string(total.bytesOut) +
+			", \"commands\": {";
+	bool first = true;
+	for (int type = 0; type < METRIC_COUNT; type++) {
+		auto &latencies = total.latencies[type];
+		if (latencies.empty() and total.errors[type] == 0)
+			continue;
+		std::sort(latencies.begin(), latencies.end());
+		const uint32_t p50 = percentile(latencies, 0.5), p90 = percentile(latencies, 0.9), p99 = percentile(latencies, 0.99),
+					   max = latencies.empty() ? 0 : latencies.back();
+		snprintf(line, sizeof(line), "%-8s %11zu %8lu %10u %10u %10u %10u", metricNames[type], latencies.size(),
+				 total.errors[type], p50, p90, p99, max);
+		std::cout << line << std::endl;
+		json += std::string(first ? "" : ", ") + "\"" + metricNames[type] + "\": {\"count\": " + std::to_string(latencies.size()) +
+				", \"errors\": " + std::to_string(total.errors[type]) + ", \"p50_us\": " + std::to_string(p50) +
+				", \"p90_us\": " + std::to_string(p90) + ", \"p99_us\": " + std::to_string(p99) +
+				", \"max_us\": " + std::to_string(max) + "}";
+		first = false;
+	}
+	json += "}}\n";
+	if (not options.jsonPath.empty()) {
+		std::ofstream output(options.jsonPath);
+		output << json;
+		if (not output) {
+			std::cerr << "Can't write the results to " << options.jsonPath << std::endl;
+			return 1;
+		}
+	}
+	return 0;
+}
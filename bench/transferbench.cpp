@@ -0,0 +1,105 @@
+// benchmark for the file transfer engines
+// sends a temporary file over loopback TCP connections with the blocking, sendfile and io_uring engines
+// and reports throughput and the CPU time the process spent
+// usage: cpp_ftp_transferbench [FILE SIZE IN MB] [CONCURRENT TRANSFERS]
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sockpp/tcp_acceptor.h>
+#include <sockpp/tcp_connector.h>
+#include "globals.hpp"
+#include "ftptransfer.h"
+#include "uringengine.hpp"
+
+// user + system CPU time of the whole process in seconds
+double cpuSeconds() {
+	rusage usage {};
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+// create a file with pseudo-random contents of the requested size
+std::string makeFile(size_t size) {
+	char path[] = "/tmp/cpp_ftp_transferbenchXXXXXX";
+	const uniqueFd fd(mkstemp(path));
+	dataT block(BUFSIZE);
+	uint32_t state = 12345;
+	for (auto &value: block)
+		value = static_cast<byte>(state = state * 1103515245 + 12345);
+	for (size_t written = 0; written < size; written += BUFSIZE) {
+		if (::write(fd.get(), block.data(), std::min<size_t>(BUFSIZE, size - written)) < 0)
+			break;
+	}
+	return path;
+}
+
+template<typename SendFunction>
+void runEngine(const std::string &name, const std::string &path, size_t size, uint32_t streams, SendFunction send) {
+	sockpp::tcp_acceptor acceptor(sockpp::inet_address("127.0.0.1", 0));
+	const sockpp::inet_address address = acceptor.address();
+
+	std::vector<sockpp::tcp_socket> senders;
+	std::vector<std::thread> readers;
+	for (uint32_t i = 0; i < streams; i++) {
+		sockpp::tcp_connector connector(address);
+		senders.push_back(acceptor.accept());
+		// the receiving side simply drains the connection
+		readers.emplace_back([connection = sockpp::tcp_socket(std::move(connector))]() mutable {
+			dataT buffer(1 << 20);
+			while (connection.read(buffer.data(), buffer.size()) > 0) {}
+		});
+	}
+
+	const double cpuBefore = cpuSeconds();
+	const auto start = std::chrono::steady_clock::now();
+	std::vector<std::thread> workers;
+	for (auto &sock: senders) {
+		workers.emplace_back([&]() {
+			const uniqueFd fileFd(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+			const auto [status, sent] = send(sock, fileFd.get());
+			if (status != TRANSFER_DONE or sent != size)
+				std::cerr << name << ": transfer failed after " << sent << " bytes" << std::endl;
+			sock.shutdown(SHUT_WR);
+		});
+	}
+	for (auto &thr: workers)
+		thr.join();
+	for (auto &thr: readers)
+		thr.join();
+	const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	const double cpu = cpuSeconds() - cpuBefore;
+	const double gigabytes = static_cast<double>(size) * streams / (1 << 30);
+	std::cout << name << ": " << static_cast<uint64_t>(gigabytes * 1024 / seconds) << " MB/s, " <<
+			  cpu / gigabytes << " CPU s/GB (receiving side included)" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+	const size_t size = (argc > 1 ? std::stoull(argv[1]) : 512) << 20;
+	const uint32_t streams = argc > 2 ? std::stoul(argv[2]) : 4;
+	const std::string path = makeFile(size);
+	std::cout << "Sending " << (size >> 20) << " MB over " << streams << " connections" << std::endl;
+
+	runEngine("blocking", path, size, streams, [](sockpp::stream_socket &sock, int fileFd) {
+		transferControl control;
+		return sendFileBuffered(sock, fileFd, 0, control);
+	});
+	runEngine("sendfile", path, size, streams, [](sockpp::stream_socket &sock, int fileFd) {
+		transferControl control;
+		return sendFile(sock, fileFd, 0, control);
+	});
+	uringEngine uring;
+	if (uring)
+		runEngine("uring", path, size, streams, [&](sockpp::stream_socket &sock, int fileFd) {
+			transferControl control;
+			return uring.sendFile(sock, fileFd, 0, control);
+		});
+	else
+		std::cout << "uring: not supported by the kernel" << std::endl;
+
+	::unlink(path.c_str());
+	return 0;
+}
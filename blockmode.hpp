@@ -0,0 +1,130 @@
+#ifndef CPP_FTP_BLOCKMODE_HPP
+#define CPP_FTP_BLOCKMODE_HPP
+
+#include <sockpp/tcp_socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include "globals.hpp"
+#include "utils.hpp"
+#include "ftptransfer.h"
+
+// MODE B data path as specified in RFC 959
+// every block starts with a descriptor byte and a 16 bit big-endian byte count, the last block of a file carries
+// the EOF descriptor, so the end of the file doesn't depend on closing the data connection
+// that lets one data connection carry any number of files, which saves a handshake per file for small files
+
+// descriptor bits of a block header
+enum blockDescriptor : byte {BLOCK_EOR = 128, BLOCK_EOF = 64, BLOCK_ERRORS = 32, BLOCK_MARKER = 16};
+// size of the block header and the max number of data bytes in a block
+const size_t blockHeaderSize = 3;
+const size_t blockMaxSize = 65535;
+
+// fill in the header in front of the block data
+inline void setBlockHeader(byte *header, byte descriptor, size_t count) {
+	header[0] = descriptor;
+	header[1] = count >> 8;
+	header[2] = count & 0xff;
+}
+
+// splits everything written to it into blocks, the block ending the data is marked with EOF by finish()
+class blockWriter {
+public:
+	blockWriter() : buffer(blockHeaderSize + blockMaxSize) {}
+
+	// returns true on error
+	const bool write(sockpp::stream_socket &sock, const byte *data, size_t size) {
+		while (size) {
+			// a full block is only sent once more data comes, so the last one can still get the EOF descriptor
+			if (filled == blockMaxSize) {
+				if (sendBlock(sock, 0))
+					return true;
+			}
+			const size_t part = std::min(size, blockMaxSize - filled);
+			std::copy(data, data + part, buffer.data() + blockHeaderSize + filled);
+			filled += part;
+			data += part;
+			size -= part;
+		}
+		return false;
+	}
+
+	// send the last block with the EOF descriptor, it is empty if there was no data left
+	const bool finish(sockpp::stream_socket &sock) {
+		return sendBlock(sock, BLOCK_EOF);
+	}
+
+private:
+	dataT buffer;
+	size_t filled = 0;
+
+	const bool sendBlock(sockpp::stream_socket &sock, byte descriptor) {
+		setBlockHeader(buffer.data(), descriptor, filled);
+		const size_t size = blockHeaderSize + filled;
+		filled = 0;
+		return sock.write_n(buffer.data(), size) < ssize_t(size);
+	}
+};
+
+// send the file from offset up to its end as blocks, the data is read straight behind the block header
+// a short read means the end of a regular file, so small files go out as a single EOF block in one write
+const transferResult sendFileBlocks(sockpp::stream_socket &sock, int fileFd, off_t offset, transferControl &control) {
+	dataT buffer(blockHeaderSize + blockMaxSize);
+	uint64_t sentTotal = 0;
+	while (true) {
+		if (control.stopped())
+			return {TRANSFER_ERROR, sentTotal};
+		const ssize_t numRead = ::pread(fileFd, buffer.data() + blockHeaderSize, blockMaxSize, offset);
+		if (numRead < 0 and errno == EINTR)
+			continue;
+		if (numRead < 0)
+			return {TRANSFER_ERROR, sentTotal};
+		const bool last = size_t(numRead) < blockMaxSize;
+		setBlockHeader(buffer.data(), last ? BLOCK_EOF : 0, numRead);
+		if (sock.write_n(buffer.data(), blockHeaderSize + numRead) < ssize_t(blockHeaderSize + numRead))
+			return {TRANSFER_ERROR, sentTotal};
+		offset += numRead;
+		sentTotal += numRead;
+		control.add(numRead);
+		if (last)
+			return {TRANSFER_DONE, sentTotal};
+	}
+}
+
+// receive the blocks of one file into the file at offset, stops at the block with the EOF descriptor
+// restart markers carry no file data and are skipped, the connection closing before EOF fails the transfer
+const transferResult receiveFileBlocks(sockpp::stream_socket &sock, int fileFd, off_t offset, transferControl &control) {
+	dataT buffer(blockMaxSize);
+	uint64_t received = 0;
+	while (true) {
+		if (control.stopped())
+			return {TRANSFER_ERROR, received};
+		byte header[blockHeaderSize];
+		if (sock.read_n(header, blockHeaderSize) < ssize_t(blockHeaderSize)) {
+			errno = control.canceled ? ECANCELED : EPIPE;
+			return {TRANSFER_ERROR, received};
+		}
+		const size_t count = size_t(header[1]) << 8 | header[2];
+		if (count and sock.read_n(buffer.data(), count) < ssize_t(count)) {
+			errno = control.canceled ? ECANCELED : EPIPE;
+			return {TRANSFER_ERROR, received};
+		}
+		if (not (header[0] & BLOCK_MARKER)) {
+			for (size_t written = 0; written < count; ) {
+				const ssize_t writeResult = ::pwrite(fileFd, buffer.data() + written, count - written, offset);
+				if (writeResult < 0 and errno == EINTR)
+					continue;
+				if (writeResult <= 0)
+					return {TRANSFER_ERROR, received};
+				written += writeResult;
+				offset += writeResult;
+			}
+			received += count;
+			control.add(count);
+		}
+		if (header[0] & BLOCK_EOF)
+			return {TRANSFER_DONE, received};
+	}
+}
+
+#endif //CPP_FTP_BLOCKMODE_HPP
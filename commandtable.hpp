@@ -0,0 +1,83 @@
+#ifndef CPP_FTP_COMMANDTABLE_HPP
+#define CPP_FTP_COMMANDTABLE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string_view>
+
+// ftp command verbs are short ascii words, so the whole verb is packed into an integer
+// the verb is uppercased on the way since commands are case insensitive
+// returns 0 for verbs which can't be a valid command (empty or longer than 8 chars)
+constexpr uint64_t verbKey(std::string_view verb) {
+	if (verb.empty() or verb.size() > 8)
+		return 0;
+	uint64_t key = 0;
+	for (const char c: verb)
+		key = key << 8 | static_cast<unsigned char>(c >= 'a' and c <= 'z' ? c - 'a' + 'A' : c);
+	return key;
+}
+
+template<typename handlerT>
+struct commandEntry {
+	uint64_t key = 0;
+	handlerT handler = nullptr;
+};
+
+// perfect hash table from verb keys to handlers, built at compile time
+// the slot is picked with multiplicative hashing, the constructor searches for a multiplier
+// which puts every command in its own slot, so a lookup is one multiplication and one compare
+template<typename handlerT, size_t N>
+class commandTable {
+public:
+	constexpr commandTable(const commandEntry<handlerT> (&entries)[N]) {
+		uint64_t candidate = 0x9e3779b97f4a7c15ull;
+		for (uint32_t attempt = 0; attempt < 100000; attempt++) {
+			// next odd multiplier from a simple xorshift sequence
+			candidate ^= candidate << 13;
+			candidate ^= candidate >> 7;
+			candidate ^= candidate << 17;
+			multiplier = candidate | 1;
+			if (tryFill(entries))
+				return;
+		}
+		// only reachable during constant evaluation, so this fails the build
+		throw std::logic_error("no perfect hash for the command table");
+	}
+
+	// handler of the command or nullptr if the command doesn't exist
+	constexpr handlerT find(uint64_t key) const {
+		const commandEntry<handlerT> &slot = slots[slotOf(key)];
+		return slot.key == key ? slot.handler : nullptr;
+	}
+
+private:
+	// at least four slots per command keeps the multiplier search short
+	static constexpr uint32_t slotBits = [] {
+		uint32_t bits = 1;
+		while ((size_t(1) << bits) < N * 4)
+			bits++;
+		return bits;
+	}();
+
+	commandEntry<handlerT> slots[size_t(1) << slotBits] {};
+	uint64_t multiplier = 0;
+
+	constexpr size_t slotOf(uint64_t key) const {
+		return (key * multiplier) >> (64 - slotBits);
+	}
+
+	constexpr bool tryFill(const commandEntry<handlerT> (&entries)[N]) {
+		for (auto &slot: slots)
+			slot = {};
+		for (const auto &entry: entries) {
+			commandEntry<handlerT> &slot = slots[slotOf(entry.key)];
+			if (slot.handler != nullptr)
+				return false;
+			slot = entry;
+		}
+		return true;
+	}
+};
+
+#endif //CPP_FTP_COMMANDTABLE_HPP
@@ -0,0 +1,259 @@
+#ifndef CPP_FTP_DEFLATESTREAM_HPP
+#define CPP_FTP_DEFLATESTREAM_HPP
+
+#include <sockpp/tcp_socket.h>
+#include <zlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <climits>
+#include <cmath>
+#include <string>
+#include <string_view>
+#include "globals.hpp"
+#include "utils.hpp"
+#include "ftptransfer.h"
+
+// MODE Z data path, the data connection carries a zlib stream as described in the MODE Z draft
+// the stage always works on user space buffers, so the zero-copy engines are bypassed while MODE Z is on
+
+// extensions of the formats which are already compressed, deflate would only burn CPU on them
+const std::array<std::string_view, 28> compressedExtensions = {
+	"7z", "apk", "avi", "br", "bz2", "deb", "docx", "flac", "gif", "gz", "jar", "jpeg", "jpg", "lz4",
+	"lzma", "mkv", "mov", "mp3", "mp4", "ogg", "png", "pptx", "rar", "rpm", "tgz", "webp", "xlsx", "xz"
+};
+
+// deflate stage in front of the data connection, compresses everything written to it into one zlib stream
+class deflateWriter {
+public:
+	explicit deflateWriter(int level) : output(BUFSIZE) {
+		ready = deflateInit(&stream, level) == Z_OK;
+	}
+	deflateWriter(const deflateWriter &) = delete;
+	deflateWriter &operator=(const deflateWriter &) = delete;
+	~deflateWriter() {
+		if (ready)
+			deflateEnd(&stream);
+	}
+
+	// check if zlib could set up the stream
+	explicit operator bool() const {
+		return ready;
+	}
+
+	// compress the data and send whatever comes out of deflate, returns true on error
+	const bool write(sockpp::stream_socket &sock, const byte *data, size_t size) {
+		// avail_in is only 32 bits wide
+		while (size > UINT_MAX) {
+			if (pump(sock, data, UINT_MAX, Z_NO_FLUSH))
+				return true;
+			data += UINT_MAX;
+			size -= UINT_MAX;
+		}
+		return pump(sock, data, size, Z_NO_FLUSH);
+	}
+
+	// end the zlib stream and send the rest of it
+	const bool finish(sockpp::stream_socket &sock) {
+		return pump(sock, nullptr, 0, Z_FINISH);
+	}
+
+	// number of bytes given to the stage and sent over the connection
+	uint64_t bytesIn() const {
+		return stream.total_in;
+	}
+
+	uint64_t bytesOut() const {
+		return stream.total_out;
+	}
+
+private:
+	z_stream stream {};
+	dataT output;
+	bool ready;
+
+	const bool pump(sockpp::stream_socket &sock, const byte *data, size_t size, int flush) {
+		if (not ready)
+			return true;
+		stream.next_in = const_cast<byte *>(data);
+		stream.avail_in = size;
+		// deflate is called until it leaves space in the output buffer, so everything it had is out
+		do {
+			stream.next_out = output.data();
+			stream.avail_out = output.size();
+			if (deflate(&stream, flush) == Z_STREAM_ERROR)
+				return true;
+			const size_t produced = output.size() - stream.avail_out;
+			if (produced and sock.write_n(output.data(), produced) < ssize_t(produced))
+				return true;
+		} while (stream.avail_out == 0);
+		return false;
+	}
+};
+
+// inflate stage behind the data connection, unpacks the zlib stream sent by the client
+class inflateReader {
+public:
+	inflateReader() {
+		ready = inflateInit(&stream) == Z_OK;
+	}
+	inflateReader(const inflateReader &) = delete;
+	inflateReader &operator=(const inflateReader &) = delete;
+	~inflateReader() {
+		if (ready)
+			inflateEnd(&stream);
+	}
+
+	explicit operator bool() const {
+		return ready;
+	}
+
+	// the end of the zlib stream was reached, anything after it is ignored
+	bool finished() const {
+		return ended;
+	}
+
+	// give the next piece of the compressed stream to the stage
+	void feed(byte *data, size_t size) {
+		stream.next_in = data;
+		stream.avail_in = size;
+	}
+
+	// unpack as much of the fed data as fits into the output
+	// returns the number of bytes unpacked or -1 if the stream is corrupted
+	ssize_t unpack(byte *output, size_t size) {
+		// inflate may still hold output when all of the input is used up, so it is called until it makes no progress
+		if (ended)
+			return 0;
+		stream.next_out = output;
+		stream.avail_out = size;
+		const int status = inflate(&stream, Z_NO_FLUSH);
+		if (status == Z_STREAM_END)
+			ended = true;
+		else if (status != Z_OK and status != Z_BUF_ERROR)
+			return -1;
+		return size - stream.avail_out;
+	}
+
+	uint64_t bytesIn() const {
+		return stream.total_in;
+	}
+
+private:
+	z_stream stream {};
+	bool ready, ended = false;
+};
+
+// check if the file is already compressed, first by its extension and then by the entropy of a few samples
+// compressed data is close to 8 bits of entropy per byte, while text stays well below 6
+const bool looksCompressed(int fileFd, std::string_view name) {
+	const size_t dot = name.rfind('.');
+	if (dot != std::string_view::npos and name.size() - dot - 1 <= 5) {
+		std::string extension(name.substr(dot + 1));
+		std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) { return std::tolower(c); });
+		if (std::binary_search(compressedExtensions.begin(), compressedExtensions.end(), extension))
+			return true;
+	}
+	struct stat fileStat {};
+	if (::fstat(fileFd, &fileStat) < 0 or fileStat.st_size < off_t(entropySampleSize))
+		return false;
+	// samples from the start, the middle and the end, so a text header doesn't hide a packed body
+	uint64_t histogram[256] {};
+	byte sample[entropySampleSize];
+	size_t sampled = 0;
+	for (const off_t at: {off_t(0), (fileStat.st_size - off_t(entropySampleSize)) / 2, fileStat.st_size - off_t(entropySampleSize)}) {
+		const ssize_t numRead = ::pread(fileFd, sample, entropySampleSize, at);
+		for (ssize_t i = 0; i < numRead; i++)
+			histogram[sample[i]]++;
+		sampled += std::max<ssize_t>(numRead, 0);
+	}
+	if (sampled == 0)
+		return false;
+	double entropy = 0;
+	for (const uint64_t count: histogram) {
+		if (count == 0)
+			continue;
+		const double probability = double(count) / sampled;
+		entropy -= probability * std::log2(probability);
+	}
+	return entropy >= compressedEntropyBits;
+}
+
+// send the file from offset up to its end through the deflate stage
+// the result counts the bytes of the file, wireBytes gets the number of compressed bytes sent
+const transferResult sendFileDeflated(sockpp::stream_socket &sock, int fileFd, off_t offset, int level,
+									  transferControl &control, uint64_t &wireBytes) {
+	deflateWriter writer(level);
+	if (not writer)
+		return {TRANSFER_ERROR, 0};
+	dataT buffer(BUFSIZE);
+	uint64_t sentTotal = 0;
+	while (true) {
+		if (control.stopped())
+			return {TRANSFER_ERROR, sentTotal};
+		const ssize_t numRead = ::pread(fileFd, buffer.data(), BUFSIZE, offset);
+		if (numRead < 0 and errno == EINTR)
+			continue;
+		if (numRead == 0)
+			break;
+		if (numRead < 0 or writer.write(sock, buffer.data(), numRead))
+			return {TRANSFER_ERROR, sentTotal};
+		offset += numRead;
+		sentTotal += numRead;
+		control.add(numRead);
+	}
+	const bool finishError = writer.finish(sock);
+	wireBytes = writer.bytesOut();
+	return {finishError ? TRANSFER_ERROR : TRANSFER_DONE, sentTotal};
+}
+
+// receive the zlib stream from the socket and write the unpacked data into the file at offset
+// the upload fails if the client closes the connection before the end of the stream
+const transferResult receiveFileInflated(sockpp::stream_socket &sock, int fileFd, off_t offset,
+										 transferControl &control, uint64_t &wireBytes) {
+	inflateReader reader;
+	if (not reader)
+		return {TRANSFER_ERROR, 0};
+	dataT input(BUFSIZE), output(BUFSIZE);
+	uint64_t received = 0;
+	while (not reader.finished()) {
+		if (control.stopped())
+			return {TRANSFER_ERROR, received};
+		const ssize_t numRead = sock.read(input.data(), input.size());
+		if (numRead < 0 and sock.last_error() == EINTR)
+			continue;
+		if (numRead <= 0)
+			break;
+		reader.feed(input.data(), numRead);
+		while (true) {
+			const ssize_t unpacked = reader.unpack(output.data(), output.size());
+			if (unpacked < 0) {
+				errno = EBADMSG;
+				return {TRANSFER_ERROR, received};
+			}
+			if (unpacked == 0)
+				break;
+			for (ssize_t written = 0; written < unpacked; ) {
+				const ssize_t writeResult = ::pwrite(fileFd, output.data() + written, unpacked - written, offset);
+				if (writeResult < 0 and errno == EINTR)
+					continue;
+				if (writeResult <= 0)
+					return {TRANSFER_ERROR, received};
+				written += writeResult;
+				offset += writeResult;
+			}
+			received += unpacked;
+			control.add(unpacked);
+		}
+	}
+	wireBytes = reader.bytesIn();
+	if (not reader.finished()) {
+		errno = control.canceled ? ECANCELED : EPIPE;
+		return {TRANSFER_ERROR, received};
+	}
+	return {TRANSFER_DONE, received};
+}
+
+#endif //CPP_FTP_DEFLATESTREAM_HPP
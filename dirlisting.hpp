@@ -0,0 +1,141 @@
+#ifndef CPP_FTP_DIRLISTING_HPP
+#define CPP_FTP_DIRLISTING_HPP
+
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <charconv>
+#include <cstring>
+#include <ctime>
+#include <string_view>
+#include "globals.hpp"
+#include "utils.hpp"
+
+// listing engine shared by LIST, MLSD and MLST
+// entries are read in big getdents64 batches and only the attributes we print are requested with statx,
+// so a directory costs one syscall per few thousand entries plus a single statx per entry
+
+// record returned by getdents64
+struct linuxDirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+// reads the entries of a directory with getdents64 into a fixed buffer, so memory use doesn't depend on the directory size
+class directoryReader {
+public:
+	// takes over an fd of the directory opened with O_RDONLY | O_DIRECTORY
+	explicit directoryReader(uniqueFd dirFd_t) : dirFd(std::move(dirFd_t)), buffer(direntBatchSize) {}
+
+	// check if the directory could be opened
+	explicit operator bool() const {
+		return static_cast<bool>(dirFd);
+	}
+
+	int fd() const {
+		return dirFd.get();
+	}
+
+	// set if reading stopped because of an error and not at the end of the directory
+	bool failed() const {
+		return readError;
+	}
+
+	// name of the next entry, . and .. are skipped
+	// returns nullptr at the end of the directory or on error
+	const char *next() {
+		while (true) {
+			if (position >= filled) {
+				const long readn = ::syscall(SYS_getdents64, dirFd.get(), buffer.data(), buffer.size());
+				if (readn < 0 and errno == EINTR)
+					continue;
+				if (readn <= 0) {
+					readError = readn < 0;
+					return nullptr;
+				}
+				filled = readn;
+				position = 0;
+			}
+			const linuxDirent64 *entry = reinterpret_cast<const linuxDirent64 *>(buffer.data() + position);
+			position += entry->d_reclen;
+			if (std::strcmp(entry->d_name, ".") != 0 and std::strcmp(entry->d_name, "..") != 0)
+				return entry->d_name;
+		}
+	}
+
+private:
+	uniqueFd dirFd;
+	dataT buffer;
+	size_t position = 0, filled = 0;
+	bool readError = false;
+};
+
+// attributes needed for the LIST and MLSD/MLST lines
+const unsigned listStatxMask = STATX_TYPE | STATX_MODE | STATX_SIZE;
+const unsigned factsStatxMask = STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME;
+
+// statx of an entry relative to the directory, symlinks are followed like in the old fs::status based listing
+inline bool statEntry(int dirFd, const char *name, unsigned mask, struct statx &stx) {
+	return ::statx(dirFd, name, AT_STATX_SYNC_AS_STAT, mask, &stx) == 0;
+}
+
+// LIST line "drwxr-xr-x SIZEb NAME CRLF", out must have room for listLineSize bytes
+inline size_t formatListLine(char *out, const struct statx &stx, std::string_view name) {
+	static const char permChars[] = "rwxrwxrwx";
+	char *end = out;
+	*end++ = S_ISDIR(stx.stx_mode) ? 'd' : '-';
+	for (int bit = 0; bit < 9; bit++)
+		*end++ = stx.stx_mode & (0400 >> bit) ? permChars[bit] : '-';
+	*end++ = ' ';
+	end = std::to_chars(end, end + 20, stx.stx_size).ptr;
+	*end++ = 'b';
+	*end++ = ' ';
+	end = std::copy(name.begin(), name.end(), end);
+	*end++ = '\r';
+	*end++ = '\n';
+	return end - out;
+}
+
+// RFC 3659 facts "type=...;size=...;modify=...;perm=...; " followed by the name, without CRLF
+// perm lists what this server allows: files can be retrieved and stored, directories entered, listed and created in
+inline size_t formatFacts(char *out, const struct statx &stx, std::string_view name) {
+	const bool isDir = S_ISDIR(stx.stx_mode);
+	char *end = out;
+	const auto append = [&](std::string_view text) {
+		end = std::copy(text.begin(), text.end(), end);
+	};
+	append(isDir ? "type=dir;" : "type=file;");
+	if (not isDir) {
+		append("size=");
+		end = std::to_chars(end, end + 20, stx.stx_size).ptr;
+		*end++ = ';';
+	}
+	const time_t modified = stx.stx_mtime.tv_sec;
+	tm modifiedTm {};
+	gmtime_r(&modified, &modifiedTm);
+	append("modify=");
+	end += std::strftime(end, 16, "%Y%m%d%H%M%S", &modifiedTm);
+	append(";perm=");
+	if (isDir) {
+		if (stx.stx_mode & S_IXUSR)
+			*end++ = 'e';
+		if (stx.stx_mode & S_IRUSR)
+			*end++ = 'l';
+		if (stx.stx_mode & S_IWUSR)
+			append("cm");
+	} else {
+		if (stx.stx_mode & S_IRUSR)
+			*end++ = 'r';
+		if (stx.stx_mode & S_IWUSR)
+			*end++ = 'w';
+	}
+	append("; ");
+	append(name);
+	return end - out;
+}
+
+#endif //CPP_FTP_DIRLISTING_HPP
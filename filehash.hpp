@@ -0,0 +1,203 @@
+#ifndef CPP_FTP_FILEHASH_HPP
+#define CPP_FTP_FILEHASH_HPP
+
+#include <openssl/evp.h>
+#include <zlib.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include "globals.hpp"
+#include "ftptransfer.h"
+
+// content hashes for HASH (draft-bryan-ftpext-hash) and XCRC/XMD5/XSHA256
+// MD5 and the SHA family come from OpenSSL, which picks the SHA-NI and AVX2 kernels of the CPU on its own,
+// CRC32 comes from zlib and CRC32C uses the SSE4.2 crc32 instruction on x86-64 CPUs which have it
+enum hashAlgorithm {HASH_CRC32, HASH_CRC32C, HASH_MD5, HASH_SHA1, HASH_SHA256, HASH_SHA512, HASH_COUNT};
+// names as used by the HASH draft, in the order of hashAlgorithm
+const std::array<std::string_view, HASH_COUNT> hashNames = {"CRC32", "CRC32C", "MD5", "SHA-1", "SHA-256", "SHA-512"};
+// extended attributes which cache the hash of a file, in the order of hashAlgorithm
+const std::array<const char *, HASH_COUNT> hashAttributes = {
+	"user.cpp_ftp.crc32", "user.cpp_ftp.crc32c", "user.cpp_ftp.md5", "user.cpp_ftp.sha1", "user.cpp_ftp.sha256", "user.cpp_ftp.sha512"
+};
+
+// find the algorithm by its name, returns HASH_COUNT if it isn't supported
+inline hashAlgorithm findHashAlgorithm(std::string_view name) {
+	for (size_t i = 0; i < hashNames.size(); i++) {
+		if (hashNames[i].size() == name.size() and strncasecmp(hashNames[i].data(), name.data(), name.size()) == 0)
+			return hashAlgorithm(i);
+	}
+	return HASH_COUNT;
+}
+
+#if defined(__x86_64__)
+// CRC32C (Castagnoli) of the data with the SSE4.2 crc32 instruction, 8 bytes at a time
+__attribute__((target("sse4.2")))
+inline uint32_t crc32cHardware(uint32_t crc, const byte *data, size_t size) {
+	uint64_t value = crc;
+	for (; size >= 8; data += 8, size -= 8) {
+		uint64_t word;
+		std::memcpy(&word, data, 8);
+		value = _mm_crc32_u64(value, word);
+	}
+	for (; size; data++, size--)
+		value = _mm_crc32_u8(value, *data);
+	return value;
+}
+#endif
+
+// table driven CRC32C for CPUs without SSE4.2
+inline uint32_t crc32cSoftware(uint32_t crc, const byte *data, size_t size) {
+	static const std::array<uint32_t, 256> table = []() {
+		std::array<uint32_t, 256> result {};
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t value = i;
+			for (int bit = 0; bit < 8; bit++)
+				value = value & 1 ? (value >> 1) ^ 0x82f63b78 : value >> 1;
+			result[i] = value;
+		}
+		return result;
+	}();
+	for (; size; data++, size--)
+		crc = table[(crc ^ *data) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+// builds for SSE4.2 always use the instruction, other x86-64 builds check the CPU once, other targets use the table
+inline uint32_t crc32c(uint32_t crc, const byte *data, size_t size) {
+#if defined(__SSE4_2__)
+	return crc32cHardware(crc, data, size);
+#elif defined(__x86_64__)
+	static const bool hardware = __builtin_cpu_supports("sse4.2");
+	return hardware ? crc32cHardware(crc, data, size) : crc32cSoftware(crc, data, size);
+#else
+	return crc32cSoftware(crc, data, size);
+#endif
+}
+
+// incremental hash of a stream of data with one of the algorithms
+class contentHasher {
+public:
+	explicit contentHasher(hashAlgorithm algorithm_t) : algorithm(algorithm_t) {
+		// CRC32C runs on the inverted value, zlib inverts CRC32 on its own
+		crc = algorithm == HASH_CRC32C ? 0xffffffff : 0;
+		const EVP_MD *digest = algorithm == HASH_MD5 ? EVP_md5() : algorithm == HASH_SHA1 ? EVP_sha1() :
+							   algorithm == HASH_SHA256 ? EVP_sha256() : algorithm == HASH_SHA512 ? EVP_sha512() : nullptr;
+		if (digest) {
+			context = EVP_MD_CTX_new();
+			if (context and EVP_DigestInit_ex(context, digest, nullptr) != 1) {
+				EVP_MD_CTX_free(context);
+				context = nullptr;
+			}
+		}
+	}
+	contentHasher(const contentHasher &) = delete;
+	contentHasher &operator=(const contentHasher &) = delete;
+	~contentHasher() {
+		if (context)
+			EVP_MD_CTX_free(context);
+	}
+
+	// check if OpenSSL could set up the digest
+	explicit operator bool() const {
+		return context or algorithm == HASH_CRC32 or algorithm == HASH_CRC32C;
+	}
+
+	void update(const byte *data, size_t size) {
+		if (algorithm == HASH_CRC32)
+			crc = ::crc32_z(crc, data, size);
+		else if (algorithm == HASH_CRC32C)
+			crc = crc32c(crc, data, size);
+		else
+			EVP_DigestUpdate(context, data, size);
+	}
+
+	// the hash as lowercase hex, the hasher can't be updated afterwards
+	std::string hexDigest() {
+		byte digest[EVP_MAX_MD_SIZE];
+		unsigned int digestSize = 4;
+		if (algorithm == HASH_CRC32 or algorithm == HASH_CRC32C) {
+			const uint32_t value = algorithm == HASH_CRC32C ? ~crc : crc;
+			for (int i = 0; i < 4; i++)
+				digest[i] = value >> (24 - 8 * i);
+		} else {
+			EVP_DigestFinal_ex(context, digest, &digestSize);
+		}
+		static const char hexDigits[] = "0123456789abcdef";
+		std::string hex(digestSize * 2, '0');
+		for (unsigned int i = 0; i < digestSize; i++) {
+			hex[2 * i] = hexDigits[digest[i] >> 4];
+			hex[2 * i + 1] = hexDigits[digest[i] & 0xf];
+		}
+		return hex;
+	}
+
+private:
+	hashAlgorithm algorithm;
+	EVP_MD_CTX *context = nullptr;
+	uint32_t crc;
+};
+
+// value of the cache attribute, the hash is only valid for the same inode, modification time and size
+inline std::string hashCacheKey(const struct stat &fileStat) {
+	return std::to_string(fileStat.st_ino) + ":" + std::to_string(fileStat.st_mtim.tv_sec) + "." +
+		   std::to_string(fileStat.st_mtim.tv_nsec) + ":" + std::to_string(fileStat.st_size) + ":";
+}
+
+// hash of the file cached in its extended attribute, empty if there is none or the file changed since
+inline std::string cachedHash(int fileFd, hashAlgorithm algorithm, const struct stat &fileStat) {
+	char value[256];
+	const ssize_t size = ::fgetxattr(fileFd, hashAttributes[algorithm], value, sizeof(value));
+	if (size <= 0)
+		return {};
+	const std::string key = hashCacheKey(fileStat);
+	const std::string_view stored(value, size);
+	if (stored.size() <= key.size() or stored.substr(0, key.size()) != key)
+		return {};
+	return std::string(stored.substr(key.size()));
+}
+
+// remember the hash in an extended attribute of the file
+// filesystems without user attributes or files we can't modify simply don't get the cache
+inline void storeHash(int fileFd, hashAlgorithm algorithm, const struct stat &fileStat, const std::string &hex) {
+	const std::string value = hashCacheKey(fileStat) + hex;
+	::fsetxattr(fileFd, hashAttributes[algorithm], value.data(), value.size(), 0);
+}
+
+// hash of the whole file, read with large positional reads
+// the progress is counted in control and canceling it stops the hashing
+// returns an empty string with errno set on error
+inline std::string hashFile(int fileFd, hashAlgorithm algorithm, transferControl &control) {
+	contentHasher hasher(algorithm);
+	if (not hasher) {
+		errno = ENOSYS;
+		return {};
+	}
+	::posix_fadvise(fileFd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	dataT buffer(hashReadSize);
+	for (off_t offset = 0; ; ) {
+		if (control.stopped())
+			return {};
+		const ssize_t numRead = ::pread(fileFd, buffer.data(), buffer.size(), offset);
+		if (numRead < 0 and errno == EINTR)
+			continue;
+		if (numRead < 0)
+			return {};
+		if (numRead == 0)
+			break;
+		hasher.update(buffer.data(), numRead);
+		offset += numRead;
+		control.count(numRead);
+	}
+	return hasher.hexDigest();
+}
+
+#endif //CPP_FTP_FILEHASH_HPP
@@ -3,14 +3,75 @@
 
 #include <sockpp/tcp_socket.h>
 #include <sockpp/tcp_acceptor.h>
-#include <sockpp/tcp_connector.h>
 #include <sockpp/inet_address.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
 #include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <climits>
+#include <cstring>
 #include <fstream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
 #include "globals.hpp"
+#include "commandtable.hpp"
 #include "utils.hpp"
 #include "netbuffer.hpp"
+#include "replyqueue.hpp"
 #include "ftptransfer.h"
+#include "uringengine.hpp"
+#include "listingcache.hpp"
+#include "dirlisting.hpp"
+#include "resolver.hpp"
+#include "pasvpool.hpp"
+#include "transfertask.hpp"
+#include "deflatestream.hpp"
+#include "blockmode.hpp"
+#include "uploadregistry.hpp"
+#include "filehash.hpp"
+#include "hotfilecache.hpp"
+#include "metrics.hpp"
+
+// engines which can move file data over the data connections
+// BLOCKING - buffered reads and writes on the session thread
+// SENDFILE - zero-copy sendfile for RETR and splice for STOR on the session thread
+// URING - io_uring engine driving every transfer from one thread
+enum transferEngineT {ENGINE_BLOCKING, ENGINE_SENDFILE, ENGINE_URING};
+
+// server-wide state shared by all of the sessions
+struct serverContext {
+	transferEngineT engine = ENGINE_SENDFILE;
+	// set only when the io_uring engine is selected and supported by the kernel
+	std::unique_ptr<uringEngine> uring;
+	// cache of formatted directory listings, not set if disabled
+	std::unique_ptr<listingCache> listings;
+	// mapped files which are downloaded most often, not set if disabled
+	std::unique_ptr<hotFileCache> hotFiles;
+	// fd of the work directory, the paths of every session are resolved beneath it
+	uniqueFd rootFd;
+	// listeners opened in advance for PASV, not set if PASV opens a new port every time
+	std::unique_ptr<passivePool> pasvPool;
+	// zlib level the sessions start with in MODE Z
+	int deflateLevel = defaultDeflateLevel;
+	// max number of data connections of one SEGR download
+	uint32_t maxSegments = defaultMaxSegments;
+	// files uploaded in ranges by several sessions at once
+	uploadRegistry uploads;
+	// hash new uploads while they are stored and cache the hash on the file
+	bool hashUploads = false;
+	// bandwidth limits of the whole server and of every user
+	rateLimits rates;
+	// user who may change the server-wide settings with SITE, nobody if empty
+	std::string adminUser;
+	// latency histograms and counters shown by SITE STATS and the metrics endpoint
+	serverMetrics metrics;
+};
 
 // ftp structure for holding the connections and the state of the ftp control connection
 struct FTP {
@@ -19,8 +80,10 @@ struct FTP {
 	// we need to store the passive socket separately cause we need to listen and accept on it multiple times
 	// after we accepted we just write the socket to dataSocket
 	sockpp::tcp_acceptor pasvSock;
+	// with the passive port pool PASV only reserves a port and the connection comes from the pool
+	passiveTicket pasvTicket;
 	// if we are using an active data connection (server connects to client)
-	// then we use tcp_connector and then store the socket here
+	// then we connect to the client and then store the socket here
 	sockpp::tcp_socket dataSocket;
 	// we need to store the control connection peer for logging
 	// and data socket peer for error logging
@@ -29,36 +92,76 @@ struct FTP {
 	// if we don't have logging to file enabled then we don't need to worry
 	// because logger handles it on its own
 	loggerT &logger;
-	// server root directory path and current path
-	fs::path serverRoot, workDir, curDir;
+	// server root directory path and work directory path
+	fs::path serverRoot, workDir;
+	// current directory as shown to the user by PWD, kept in sync with the resolver
+	std::string displayDir;
+	// resolves the paths of the session and holds the fd of the current directory
+	pathResolver resolver;
 	// we store the valid users in this map so we can authenticate easily
 	stringHashMap &users;
 	// the buffer of the ftp control socket
-	netbuffer ftpBuf;
+	lineBuffer ftpBuf;
+	// replies waiting to be sent on the control socket
+	replyQueue replies;
+	// server-wide state
+	serverContext &server;
+	// serializes the writes to the control socket, a finished transfer sends its reply from its own thread
+	std::mutex sendMutex;
 
 	// set active to false and the server quits
 	bool passiveMode = false, active = true;
 	// store the user here for auth check
 	std::pair<std::string, std::string> user {};
-	// needed to check previous received command to validate the order
-	std::string prevCommand {};
+	// needed to check previous received command to validate the order, stored as its verb key
+	uint64_t prevCommand = 0;
+	// size announced with ALLO for the next STOR, 0 if nothing was announced
+	uint64_t allocSize = 0;
+	// offset set by REST for the next RETR or STOR
+	uint64_t restartOffset = 0;
 
 	// ftp data transfer formatting
 	// we only support ascii-nonprint and image(binary), everything else is obsolete
 	enum FMTTYPE {ASCII_N, IMAGE} ftpFormatType = ASCII_N;
-	// we don't support compressed mode or block mode
-	enum FMTMODE {STREAM} ftpFormatMode = STREAM;
+	// stream mode, block mode which keeps the data connection open between transfers and deflate mode (MODE Z)
+	enum FMTMODE {STREAM, BLOCK, DEFLATE} ftpFormatMode = STREAM;
+	// zlib level of MODE Z, set with OPTS MODE Z LEVEL
+	int deflateLevel;
+	// algorithm of HASH and of the uploads hashed on the way, set with OPTS HASH
+	hashAlgorithm hashType = HASH_SHA256;
+	// ALLO, REST and STOR upload one range of a file shared with other sessions instead of resuming it, set with OPTS RANGE
+	bool rangeUploads = false;
 	// accept only file structure
 	enum FTPSTRU {FILE} ftpFormatStru = FILE;
 
+	// bandwidth limits the transfers of the session are throttled by
+	rateLimiter rate;
+	// data transfer running next to the control connection
+	// declared last so that it is stopped before anything it uses is destroyed
+	transferTask transfer;
+
 
 	// we use std::move to move unique_ptr type variables that can't be copied
-	FTP(stringHashMap &users_t, sockpp::tcp_socket controlSock_t, sockpp::inet_address peer_t, fs::path workDir_t, loggerT &logger_t)
-		: logger(logger_t), ftpBuf(), users(users_t) {
+	FTP(stringHashMap &users_t, sockpp::tcp_socket controlSock_t, sockpp::inet_address peer_t, fs::path workDir_t, loggerT &logger_t,
+		serverContext &server_t)
+		: logger(logger_t), resolver(server_t.rootFd.get(), workDir_t), users(users_t), ftpBuf(), server(server_t),
+		  deflateLevel(server_t.deflateLevel) {
+		rate.global = &server.rates.global;
+		rate.session.setRate(server.rates.sessionRate);
+		transfer.control.limiter = &rate;
 		controlSock = std::move(controlSock_t);
-		curDir = workDir = workDir_t;
+		// replies are already coalesced by the reply queue, so nagle would only delay them
+		controlSock.set_option(IPPROTO_TCP, TCP_NODELAY, 1);
+		workDir = workDir_t;
 		serverRoot = workDir.parent_path();
+		displayDir = resolver.displayPath(resolver.currentDir());
 		peer = peer_t;
+		server.metrics.sessionsActive++;
+		server.metrics.sessionsTotal++;
+	}
+
+	~FTP() {
+		server.metrics.sessionsActive--;
 	}
 };
 
@@ -68,75 +171,305 @@ const std::string getPeer(FTP &ftp) {
 }
 
 // helper function which sends an error string and writes it to the logger
+// the replies which are still queued go out before it
 const bool shutdownError(FTP& ftp, std::string error) {
-	const std::string shutdownErrorString = "421 Error - " + error + CRLF;
 	ftp.logger << getPeer(ftp) << " - Have to shutdown the connection because of error - " <<
 			   error << " " << ftp.controlSock.last_error_str() << ENDL;
-	ftp.controlSock.write_n(shutdownErrorString.c_str(), shutdownErrorString.size());
+	ftp.replies.push("421 Error - " + error + CRLF);
+	std::lock_guard<std::mutex> lock(ftp.sendMutex);
+	ftp.replies.flush(ftp.controlSock);
 	return true;
 }
 
-// helper function for sending simple c++ string replies
-const bool sendString(FTP& ftp, std::string str) {
-	if (ftp.controlSock.write_n(str.data(), str.size()) < str.size())
-		return shutdownError(ftp, "error while sending string");
+// send everything in the reply queue
+// called once the pipelined commands in the buffer are processed and before waiting for the client
+const bool flushReplies(FTP& ftp) {
+	if (ftp.replies.empty())
+		return false;
+	bool error;
+	{
+		std::lock_guard<std::mutex> lock(ftp.sendMutex);
+		error = ftp.replies.flush(ftp.controlSock);
+	}
+	if (error)
+		return shutdownError(ftp, "error while sending replies");
 	return false;
 }
 
-// helper function for sending simple replies
-const bool sendReply(FTP& ftp, uint32_t code, std::string str) {
-	return sendString(ftp, std::to_string(code) + " " + str + CRLF);
+// helper function for queueing a reply, it is sent with the other replies of the batch
+void queueReply(FTP& ftp, uint32_t code, std::string_view str) {
+	ftp.server.metrics.recordReply(code);
+	ftp.replies.pushReply(code, str);
+}
+
+// helper function for sending simple c++ string replies right away
+const bool sendString(FTP& ftp, std::string_view str) {
+	ftp.replies.push(str);
+	return flushReplies(ftp);
+}
+
+// helper function for sending simple replies right away, together with anything queued before
+const bool sendReply(FTP& ftp, uint32_t code, std::string_view str) {
+	queueReply(ftp, code, str);
+	return flushReplies(ftp);
+}
+
+// send a reply right away from the transfer thread
+// the reply queue belongs to the thread serving the control connection, so it isn't used here
+void sendAsyncReply(FTP& ftp, uint32_t code, std::string_view str) {
+	ftp.server.metrics.recordReply(code);
+	const std::string reply = std::to_string(code) + " " + std::string(str) + CRLF;
+	std::lock_guard<std::mutex> lock(ftp.sendMutex);
+	if (ftp.controlSock.write_n(reply.data(), reply.size()) < reply.size())
+		ftp.logger << getPeer(ftp) << " - can't send the transfer reply: " << ftp.controlSock.last_error_str() << ENDL;
+}
+
+// log how well the replies were coalesced during the session
+void logReplyStats(FTP& ftp) {
+	const replyQueue &replies = ftp.replies;
+	ftp.logger << getPeer(ftp) << " - sent " << replies.replies << " replies, " << replies.bytes << " bytes in " <<
+			   replies.writes << " writes (" << (replies.writes ? replies.bytes / replies.writes : 0) <<
+			   " bytes per write)" << ENDL;
+}
+
+// check if the client still keeps the data connection open
+const bool dataConnectionAlive(FTP &ftp) {
+	pollfd pollDesc {ftp.dataSocket.handle(), POLLRDHUP, 0};
+	return ::poll(&pollDesc, 1, 0) == 0;
+}
+
+// wait until the passive listener without a pool has a connection and accept it
+// the listener is watched meanwhile, so aborting the transfer shuts it down and wakes up the poll
+void acceptPassive(FTP &ftp) {
+	ftp.transfer.watch(ftp.pasvSock.handle());
+	pollfd pollDesc {ftp.pasvSock.handle(), POLLIN, 0};
+	const int ready = ::poll(&pollDesc, 1, pasvAcceptTimeout.count());
+	ftp.transfer.unwatch(ftp.pasvSock.handle());
+	if (ready == 1 and not ftp.transfer.control.canceled)
+		ftp.dataSocket = ftp.pasvSock.accept(&ftp.dataSockAddr);
+	else if (ready >= 0)
+		errno = ready == 0 ? ETIMEDOUT : ECANCELED;
+}
+
+// connect to the address given with PORT, returns the error or 0
+// the connection is made without blocking and watched, so aborting the transfer wakes up the wait for it
+int connectActive(FTP &ftp) {
+	sockpp::tcp_socket dataConnection(::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0));
+	if (not dataConnection)
+		return errno;
+	ftp.transfer.watch(dataConnection.handle());
+	int error = 0;
+	if (::connect(dataConnection.handle(), ftp.dataSockAddr.sockaddr_ptr(), ftp.dataSockAddr.size()) < 0) {
+		error = errno;
+		if (error == EINPROGRESS) {
+			pollfd pollDesc {dataConnection.handle(), POLLOUT, 0};
+			socklen_t errorSize = sizeof(error);
+			if (::poll(&pollDesc, 1, portConnectTimeout.count()) == 0)
+				error = ETIMEDOUT;
+			else if (::getsockopt(dataConnection.handle(), SOL_SOCKET, SO_ERROR, &error, &errorSize) < 0)
+				error = errno;
+		}
+	}
+	ftp.transfer.unwatch(dataConnection.handle());
+	if (ftp.transfer.control.canceled)
+		error = ECANCELED;
+	if (error or not dataConnection.set_non_blocking(false))
+		return error ? error : dataConnection.last_error();
+	ftp.dataSocket = std::move(dataConnection);
+	return 0;
 }
 
 // function to setup the data connection
+// it runs on the transfer thread, so waiting for the client doesn't hold up the other sessions served by the same thread
+// the connection is watched by the transfer, so ABOR shuts it down
 const std::tuple<bool, int32_t, std::string> initDataConnection(FTP &ftp) {
+	// in block mode the connection of the previous transfer is used again until the client closes it
+	if (ftp.dataSocket.is_open()) {
+		if (dataConnectionAlive(ftp)) {
+			ftp.transfer.watch(ftp.dataSocket.handle());
+			return {false, 225, "Data connection already open"};
+		}
+		ftp.dataSocket.close();
+	}
 	// if we have passive mode enabled
 	if (ftp.passiveMode) {
-		ftp.dataSocket = ftp.pasvSock.accept(&ftp.dataSockAddr);
+		if (ftp.pasvTicket) {
+			// the wait for the pool isn't on an fd of the session, so aborting has to wake it up on its own
+			ftp.transfer.interruptWith([&ftp]() { ftp.pasvTicket.interrupt(); });
+			ftp.dataSocket = ftp.pasvTicket.accept(pasvAcceptTimeout, ftp.transfer.control.canceled);
+			ftp.transfer.interruptWith(nullptr);
+			if (not ftp.dataSocket)
+				errno = ftp.transfer.control.canceled ? ECANCELED : ETIMEDOUT;
+		} else {
+			acceptPassive(ftp);
+		}
 		// can't connect
 		if (not ftp.dataSocket) {
 			ftp.logger << getPeer(ftp) << " - error accepting passive connection from " << ftp.dataSockAddr.to_string() <<
-					   ": " << ftp.dataSocket.last_error_str() << ENDL;
+					   ": " << std::strerror(errno) << ENDL;
 			ftp.dataSocket.close();
 			return {true, 425, "Error accepting connection"};
 		}
-	} else {
-		sockpp::tcp_connector dataConnection(ftp.dataSockAddr);
+	} else if (const int error = connectActive(ftp)) {
 		// can't connect
-		if (not dataConnection) {
-			ftp.logger << getPeer(ftp) << " - error making data connection to " << ftp.dataSockAddr.to_string() <<
-					   ": " << dataConnection.last_error_str() << ENDL;
-			dataConnection.close();
-			return {true, 425, "Error making connection"};
-		}
-		ftp.dataSocket = std::move(dataConnection);
+		ftp.logger << getPeer(ftp) << " - error making data connection to " << ftp.dataSockAddr.to_string() <<
+				   ": " << std::strerror(error) << ENDL;
+		return {true, 425, "Error making connection"};
 	}
+	ftp.transfer.watch(ftp.dataSocket.handle());
+	// blocks are written whole, so nagle would only hold back the end of a file until the previous one is acknowledged
+	if (ftp.ftpFormatMode == FTP::BLOCK)
+		ftp.dataSocket.set_option(IPPROTO_TCP, TCP_NODELAY, 1);
 	return {false, 225, "Data connection successfully established"};
 }
 
-// helper function to validate path
-// tries to get the canonical path and then the absolute path
-// and then checks if the path starts with the serverRoot path
-// this is secure, we can't go out of our secure directory
-const std::pair<fs::path, bool> getPath(FTP &ftp, std::string path) {
-	// replace all backslashes
-	std::replace(path.begin(), path.end(), '\\', '/');
-	fs::path resultPath;
-	// if path is not relative
-	if (path[0] == '/')
-		resultPath = ftp.serverRoot.generic_string() + path;
-	else
-		resultPath = ftp.curDir.generic_string() + "/" + path;
-	resultPath = fs::weakly_canonical(resultPath);
-	resultPath = fs::absolute(resultPath);
-	// if the path doesn't begin with work directory then quit
-	const std::string workDirStr = ftp.workDir.generic_string();
-	const std::string resultDirStr = resultPath.generic_string();
-	if ((workDirStr.size() == resultDirStr.size() and workDirStr == resultDirStr) or
-		(workDirStr + "/" == resultDirStr.substr(0, workDirStr.size() + 1))) {
-		return {resultPath, false};
+// shut down and close the data connection
+// a running transfer first forgets the fd, so ABOR can't shut down a socket which reused it
+void closeDataConnection(FTP &ftp) {
+	ftp.transfer.dataClosed();
+	ftp.dataSocket.shutdown();
+	ftp.dataSocket.close();
+}
+
+// done with the data connection after a transfer
+// in stream mode closing it marks the end of the data, in block mode it stays open for the next transfer
+// unless the transfer failed, since the client can't tell where the data of the next one would start
+void releaseDataConnection(FTP &ftp, bool failed) {
+	if (failed or ftp.ftpFormatMode != FTP::BLOCK)
+		return closeDataConnection(ftp);
+	ftp.transfer.dataClosed();
+}
+
+// clients put the telnet interrupt process and synch sequence (IAC IP IAC DM) before ABOR, it isn't part of the command
+std::string_view skipTelnetSignals(std::string_view line) {
+	while (not line.empty() and static_cast<byte>(line[0]) == 0xff) {
+		line.remove_prefix(1);
+		if (not line.empty() and (static_cast<byte>(line[0]) == 0xf4 or static_cast<byte>(line[0]) == 0xf2))
+			line.remove_prefix(1);
 	}
-	return {{}, true};
+	return line;
+}
+
+// check if the command is answered right away while a transfer is running, other commands wait for it to end
+bool answeredDuringTransfer(uint64_t command) {
+	// SITE only shows the statistics or changes the rate limits, so a running transfer can be throttled
+	return command == verbKey("ABOR") or command == verbKey("STAT") or command == verbKey("NOOP") or command == verbKey("SITE");
+}
+
+// run the rest of a command on the transfer thread, its reply is sent once it is done
+// meanwhile the control connection answers the commands of answeredDuringTransfer, the handler itself returns no reply
+// dataFd is the connection shut down by ABOR, -1 if the task doesn't use one
+// the duration and the bytes of the task are recorded under the verb the description starts with
+template<typename bodyFunction>
+void startTask(FTP &ftp, std::string description, uint64_t expected, int dataFd, bodyFunction body) {
+	const uint64_t verb = verbKey(std::string_view(description).substr(0, description.find(' ')));
+	const auto started = std::chrono::steady_clock::now();
+	ftp.transfer.start(std::move(description), expected, dataFd, [&ftp, body = std::move(body), verb, started]() mutable {
+		const response reply = body();
+		serverMetrics &metrics = ftp.server.metrics;
+		const bool canceled = ftp.transfer.control.canceled;
+		metrics.recordTransfer(verb, std::chrono::steady_clock::now() - started, ftp.transfer.control.bytes.load(),
+							   not canceled and reply.code < 400);
+		if (canceled) {
+			metrics.transfersAborted++;
+			ftp.logger << getPeer(ftp) << " - " << ftp.transfer.what() << " aborted after " << ftp.transfer.control.bytes.load() <<
+					   " bytes" << ENDL;
+			sendAsyncReply(ftp, 426, "Transfer aborted");
+			return;
+		}
+		if (reply.code >= 400)
+			metrics.transfersFailed++;
+		sendAsyncReply(ftp, reply.code, reply.text());
+	});
+}
+
+// run the rest of a data transfer command on the transfer thread
+// the body opens the data connection itself with initDataConnection, which lets ABOR shut it down
+// the queued replies are sent first, the client might be waiting for one of them (like the PASV address) to connect
+template<typename bodyFunction>
+void startTransfer(FTP &ftp, std::string description, uint64_t expected, bodyFunction body) {
+	flushReplies(ftp);
+	startTask(ftp, std::move(description), expected, -1, std::move(body));
+}
+
+// send the file from offset up to its end over the data connection with the engine selected for the server
+// every engine falls back to the buffered path if it can't handle the file
+// a file mapped by the hot file cache is written from the mapping instead of being read into a buffer
+const transferResult sendFileData(FTP &ftp, int fileFd, off_t offset, const hotFileCache::hotFile *mapped = nullptr) {
+	transferResult result {TRANSFER_UNSUPPORTED, 0};
+	if (mapped and ftp.server.engine == ENGINE_BLOCKING)
+		result = sendMapped(ftp.dataSocket, *mapped, offset, ftp.transfer.control);
+	else if (ftp.server.engine == ENGINE_URING)
+		result = ftp.server.uring->sendFile(ftp.dataSocket, fileFd, offset, ftp.transfer.control);
+	else if (ftp.server.engine != ENGINE_BLOCKING)
+		result = sendFile(ftp.dataSocket, fileFd, offset, ftp.transfer.control);
+	if (result.first == TRANSFER_UNSUPPORTED)
+		result = sendFileBuffered(ftp.dataSocket, fileFd, offset, ftp.transfer.control);
+	return result;
+}
+
+// receive the data connection contents into the file at offset with the engine selected for the server
+const transferResult receiveFileData(FTP &ftp, int fileFd, off_t offset) {
+	transferResult result {TRANSFER_UNSUPPORTED, 0};
+	if (ftp.server.engine == ENGINE_URING)
+		result = ftp.server.uring->receiveFile(ftp.dataSocket, fileFd, offset, ftp.transfer.control);
+	else if (ftp.server.engine != ENGINE_BLOCKING)
+		result = receiveFile(ftp.dataSocket, fileFd, offset, ftp.transfer.control);
+	if (result.first == TRANSFER_UNSUPPORTED)
+		result = receiveFileBuffered(ftp.dataSocket, fileFd, offset, ftp.transfer.control);
+	return result;
+}
+
+// send the file framed for the transfer mode of the session
+// in MODE Z files which are already compressed are only wrapped with level 0
+const transferResult sendModeData(FTP &ftp, int fileFd, off_t offset, std::string_view name,
+								  const hotFileCache::hotFile *mapped = nullptr) {
+	if (ftp.ftpFormatMode == FTP::BLOCK)
+		return sendFileBlocks(ftp.dataSocket, fileFd, offset, ftp.transfer.control);
+	if (ftp.ftpFormatMode == FTP::STREAM)
+		return sendFileData(ftp, fileFd, offset, mapped);
+	const int level = looksCompressed(fileFd, name) ? 0 : ftp.deflateLevel;
+	uint64_t wireBytes = 0;
+	const transferResult result = sendFileDeflated(ftp.dataSocket, fileFd, offset, level, ftp.transfer.control, wireBytes);
+	ftp.logger << getPeer(ftp) << " - deflated " << result.second << " bytes to " << wireBytes << " with level " << level << ENDL;
+	return result;
+}
+
+// receive the file framed for the transfer mode of the session
+const transferResult receiveModeData(FTP &ftp, int fileFd, off_t offset) {
+	if (ftp.ftpFormatMode == FTP::BLOCK)
+		return receiveFileBlocks(ftp.dataSocket, fileFd, offset, ftp.transfer.control);
+	if (ftp.ftpFormatMode == FTP::STREAM)
+		return receiveFileData(ftp, fileFd, offset);
+	uint64_t wireBytes = 0;
+	const transferResult result = receiveFileInflated(ftp.dataSocket, fileFd, offset, ftp.transfer.control, wireBytes);
+	ftp.logger << getPeer(ftp) << " - inflated " << wireBytes << " bytes to " << result.second << ENDL;
+	return result;
+}
+
+// receive a new file in stream mode and hash it on the way, the hash is cached on the file for HASH
+// the data has to pass through user space for that, so the zero-copy engines are bypassed
+const transferResult receiveHashedData(FTP &ftp, int fileFd, hashAlgorithm algorithm) {
+	contentHasher hasher(algorithm);
+	if (not hasher)
+		return receiveFileData(ftp, fileFd, 0);
+	const transferResult result = receiveFileBuffered(ftp.dataSocket, fileFd, 0, ftp.transfer.control,
+													  [&hasher](const byte *data, size_t size) { hasher.update(data, size); });
+	struct stat fileStat {};
+	if (result.first == TRANSFER_DONE and ::fstat(fileFd, &fileStat) == 0)
+		storeHash(fileFd, algorithm, fileStat, hasher.hexDigest());
+	return result;
+}
+
+// helper function to validate path
+// normalizes the path against the current directory without touching the filesystem
+// and returns it relative to the work directory, so we can't go out of our secure directory
+// the files are then opened through the resolver, which doesn't let symlinks lead outside either
+const std::pair<std::string, bool> getPath(FTP &ftp, std::string_view requestedPath) {
+	std::string relative;
+	if (not ftp.resolver.normalize(requestedPath, relative))
+		return {{}, true};
+	return {relative, false};
 }
 
 // helper function to check if user is logged in
@@ -146,30 +479,108 @@ const bool isAuthed(FTP& ftp) {
 	return ftp.user.first != "" and ftp.user.second != "";
 }
 
+// helper function to get the restart offset for a transfer
+// REST is only valid if it immediately precedes the transfer command, the offset is used up either way
+const uint64_t takeRestartOffset(FTP &ftp) {
+	const uint64_t offset = ftp.prevCommand == verbKey("REST") ? ftp.restartOffset : 0;
+	ftp.restartOffset = 0;
+	return offset;
+}
+
+// format the LIST output for every entry of the directory
+// entries which disappear while listing are skipped, throws if the directory can't be read
+const dataT formatListing(uniqueFd dirFd) {
+	directoryReader reader(std::move(dirFd));
+	if (not reader)
+		throw std::runtime_error(std::strerror(errno));
+	dataT listing;
+	char line[listingLineSize];
+	struct statx stx {};
+	while (const char *name = reader.next()) {
+		if (not statEntry(reader.fd(), name, listStatxMask, stx))
+			continue;
+		const size_t lineSize = formatListLine(line, stx, name);
+		listing.insert(listing.end(), line, line + lineSize);
+	}
+	if (reader.failed())
+		throw std::runtime_error(std::strerror(errno));
+	return listing;
+}
+
+// stream the MLSD lines for every entry of the directory into the data connection
+// memory use is constant, the entries go from the getdents64 batch straight into the transfer buffer
+// in MODE Z the lines go through the deflate stage instead of the plain stream writer
+template<typename writerT>
+const bool sendMachineListing(sockpp::stream_socket &sock, directoryReader &reader, transferControl &control, writerT &writer) {
+	char line[listingLineSize];
+	struct statx stx {};
+	while (const char *name = reader.next()) {
+		if (control.stopped())
+			return true;
+		if (not statEntry(reader.fd(), name, factsStatxMask, stx))
+			continue;
+		size_t lineSize = formatFacts(line, stx, name);
+		line[lineSize++] = '\r';
+		line[lineSize++] = '\n';
+		if (writer.write(sock, reinterpret_cast<const byte *>(line), lineSize))
+			return true;
+		control.add(lineSize);
+	}
+	return reader.failed() or writer.finish(sock);
+}
+
 // ftp noop
 // doesn't do anything
-const response noopFTP(FTP &ftp, const std::string command) {
+const response noopFTP(FTP &ftp, std::string_view command) {
 	return {200, "NOOP"};
 }
 
 // ftp help
 // sends multiline reply of available commands and help message
-const response helpFTP(FTP &ftp, const std::string command) {
+const response helpFTP(FTP &ftp, std::string_view command) {
 	const auto [tmp1, tmp2] = getNextParam(command);
 	if (tmp1 != "")
 		return {502, "HELP command can't have any params"};
-	sendString(ftp, "214-HELP message for server" + CRLF);
-	sendString(ftp, "FTP server " + serverVersion + " based on RFC 959" + CRLF);
-	for (auto message: commandHelp)
-		sendString(ftp, message.first + " - " + message.second + CRLF);
+	// the help lines are queued without copying and go out with the final reply in one write
+	ftp.replies.push("214-HELP message for server" + CRLF);
+	ftp.replies.push("FTP server " + serverVersion + " based on RFC 959" + CRLF);
+	for (const auto &message: commandHelp) {
+		ftp.replies.pushStatic(message.first);
+		ftp.replies.pushStatic(" - ");
+		ftp.replies.pushStatic(message.second);
+		ftp.replies.pushStatic(CRLF);
+	}
 	return {214, "HELP message for server"};
 }
 
+// ftp feat
+// sends multiline reply with the extensions supported by the server, as specified in RFC 2389
+const response featFTP(FTP &ftp, std::string_view command) {
+	const auto [tmp1, tmp2] = getNextParam(command);
+	if (tmp1 != "")
+		return {501, "FEAT command can't have any params"};
+	ftp.replies.push("211-Extensions supported:" + CRLF);
+	for (const auto &feature: featureList) {
+		ftp.replies.pushStatic(" ");
+		ftp.replies.pushStatic(feature);
+		ftp.replies.pushStatic(CRLF);
+	}
+	// the algorithm selected for the session is marked with a star, as specified in the HASH draft
+	std::string hashFeature = " HASH ";
+	for (size_t i = 0; i < hashNames.size(); i++) {
+		hashFeature += hashNames[i];
+		hashFeature += i == size_t(ftp.hashType) ? "*" : "";
+		hashFeature += i + 1 < hashNames.size() ? ";" : "";
+	}
+	ftp.replies.push(hashFeature + CRLF);
+	return {211, "End"};
+}
+
 // function to handle USER
 // USER [username] tries to begin authentication with the specified username
 // if the username is invalid then the process must start again
 // susceptible to username enumeration through bruteforce
-const response userFTP(FTP &ftp, const std::string command) {
+const response userFTP(FTP &ftp, std::string_view command) {
 	// invalidate the user as specified in RFC 959
 	ftp.user = {};
 	const auto [username, leftover] = getNextParam(command);
@@ -180,7 +591,7 @@ const response userFTP(FTP &ftp, const std::string command) {
 	if (leftover != "")
 		return {501, "Excess parameters in command"};
 	// invalid user
-	if (ftp.users.find(username) == ftp.users.end())
+	if (ftp.users.find(std::string(username)) == ftp.users.end())
 		return {430, "Invalid username"};
 	// set username and respond with "need password"
 	ftp.user.first = username;
@@ -191,9 +602,9 @@ const response userFTP(FTP &ftp, const std::string command) {
 // PASS [password] tries to authenticate the user after the username has been specified with USER command
 // if incorrect then the process must start again
 // no bruteforce protection because that shouldn't be the worries of the server
-const response passFTP(FTP &ftp, const std::string command) {
+const response passFTP(FTP &ftp, std::string_view command) {
 	// PASS must be preceded by USER, otherwise it's incorrect
-	if (ftp.prevCommand != "USER") {
+	if (ftp.prevCommand != verbKey("USER")) {
 		ftp.user = {};
 		return {503, "PASS command must be preceded by USER"};
 	}
@@ -218,13 +629,14 @@ const response passFTP(FTP &ftp, const std::string command) {
 	}
 	// successful login
 	ftp.user.second = password;
+	ftp.rate.user = ftp.server.rates.user(ftp.user.first);
 	ftp.logger << getPeer(ftp) << " - user logged in as " << ftp.user.first << ":" << ftp.user.second << ENDL;
 	return {230, "Successfully authorized"};
 }
 
 // function to handle REIN
 // REIN logs out the user, allowing a new user to login on the same control connection
-const response reinFTP(FTP &ftp, const std::string command) {
+const response reinFTP(FTP &ftp, std::string_view command) {
 	const auto [tmp1, tmp2] = getNextParam(command);
 	if (tmp1 != "")
 		return {501, "REIN can't have params"};
@@ -235,7 +647,7 @@ const response reinFTP(FTP &ftp, const std::string command) {
 
 // handle FTP quit
 // QUIT just stops the control connection
-const response quitFTP(FTP &ftp, const std::string command) {
+const response quitFTP(FTP &ftp, std::string_view command) {
 	const auto [param1, leftover] = getNextParam(command);
 	if (param1 != "" or leftover != "")
 		return {501, "QUIT can't have any parameters"};
@@ -247,21 +659,21 @@ const response quitFTP(FTP &ftp, const std::string command) {
 // handle FTP pwd
 // we create a fake filesystem where we are in /$workdir and can't go up
 // PWD prints the current directory (starting from the server root)
-const response pwdFTP(FTP &ftp, const std::string command) {
+const response pwdFTP(FTP &ftp, std::string_view command) {
 	if (not isAuthed(ftp))
 		return {530, "PWD command requires an authenticated session"};
 	const auto [param1, leftover] = getNextParam(command);
 	if (param1 != "" or leftover != "")
 		return {501, "PWD can't have any parameters"};
 	// return current directory starting from server root
-	return {257, ftp.curDir.generic_string().substr(ftp.serverRoot.generic_string().size())};
+	return {257, std::string_view(ftp.displayDir)};
 }
 
 // handle FTP type
 // ASCII and binary format are pretty much indifferent nowadays
 // ASCII used to support different newline sequences but nowadays it doesn't matter
 // so we don't need to convert CRLF to LF and vice-versa
-const response typeFTP(FTP &ftp, const std::string command) {
+const response typeFTP(FTP &ftp, std::string_view command) {
 	if (not isAuthed(ftp))
 		return {530, "TYPE command requires an authenticated session"};
 	const auto [type, leftover] = getNextParam(command);
@@ -285,23 +697,70 @@ const response typeFTP(FTP &ftp, const std::string command) {
 }
 
 // handle FTP mode
-// we only support stream mode
+// we support stream mode, block mode which keeps the data connection open between transfers
+// and deflate mode, where the data connection carries a zlib stream
 // MODE [MODE]
-const response modeFTP(FTP &ftp, const std::string command) {
+const response modeFTP(FTP &ftp, std::string_view command) {
 	if (not isAuthed(ftp))
 		return {530, "MODE command requires authenticated session"};
 	const auto [mode, leftover] = getNextParam(command);
-	if (mode != "S")
-		return {504, "Server supports only Stream mode"};
+	if (mode != "S" and mode != "B" and mode != "Z")
+		return {504, "Server supports only Stream, Block and Deflate modes"};
 	if (leftover != "")
 		return {501, "MODE command can't have extra params"};
+	// a connection kept open by block mode can't carry the data of the other modes
+	if (ftp.dataSocket.is_open())
+		closeDataConnection(ftp);
+	if (mode == "B") {
+		ftp.ftpFormatMode = FTP::BLOCK;
+		return {200, "Set mode to block"};
+	}
+	if (mode == "Z") {
+		ftp.ftpFormatMode = FTP::DEFLATE;
+		return {200, "Set mode to deflate"};
+	}
 	ftp.ftpFormatMode = FTP::STREAM;
 	return {200, "Set mode to stream"};
 }
 
+// handle FTP OPTS
+// OPTS MODE Z LEVEL [LEVEL] sets the compression level of MODE Z
+// OPTS HASH [ALGORITHM] selects the algorithm of HASH, without the algorithm it shows the selected one
+// OPTS RANGE ON makes ALLO, REST and STOR upload ranges of a file in parallel, see storRange, OPTS RANGE OFF turns it off
+const response optsFTP(FTP &ftp, std::string_view command) {
+	if (not isAuthed(ftp))
+		return {530, "OPTS command requires an authenticated session"};
+	const auto [option, leftover] = getNextParam(command);
+	if (option == "RANGE") {
+		if (leftover != "ON" and leftover != "OFF")
+			return {501, "OPTS RANGE must be in form OPTS RANGE [ON/OFF]"};
+		ftp.rangeUploads = leftover == "ON";
+		return {200, ftp.rangeUploads ? "Range uploads on" : "Range uploads off"};
+	}
+	if (option == "HASH") {
+		if (leftover == "")
+			return {200, hashNames[ftp.hashType]};
+		const hashAlgorithm algorithm = findHashAlgorithm(leftover);
+		if (algorithm == HASH_COUNT)
+			return {504, "Unknown hash algorithm"};
+		ftp.hashType = algorithm;
+		return {200, hashNames[algorithm]};
+	}
+	const auto [mode, settings] = getNextParam(leftover);
+	if (option != "MODE" or mode != "Z")
+		return {501, "Only MODE Z, HASH and RANGE options are supported"};
+	const auto [name, value] = getNextParam(settings);
+	int level = 0;
+	if (name != "LEVEL" or value.size() != 1 or
+		std::from_chars(value.data(), value.data() + value.size(), level).ec != std::errc())
+		return {501, "OPTS MODE Z must be in form OPTS MODE Z LEVEL [0-9]"};
+	ftp.deflateLevel = level;
+	return {200, "MODE Z level set to " + std::string(value)};
+}
+
 // handle FTP structure
 // we don't support anything other than file
-const response struFTP(FTP &ftp, const std::string command) {
+const response struFTP(FTP &ftp, std::string_view command) {
 	if (not isAuthed(ftp))
 		return {530, "STRU command requires an authenticated sesson"};
 	const auto [stru, leftover] = getNextParam(command);
@@ -320,17 +779,33 @@ const response struFTP(FTP &ftp, const std::string command) {
 // the client must connect to the specified connection for data transfer commands
 // YOU SHOULDN'T rely on the ip1.ip2.ip3.ip4 for connections and should use the server's actual IP
 // because the server listens on ALL network interfaces
-const response pasvFTP(FTP &ftp, const std::string command) {
+const response pasvFTP(FTP &ftp, std::string_view command) {
 	if (not isAuthed(ftp))
 		return {530, "PASV command requires an authenticated session"};
 	const auto [tmp1, tmp2] = getNextParam(command);
 	if (tmp1 != "")
 		return {501, "PASV command can't have any parameters"};
+	// the data connection kept open by block mode goes to the old port, so it is closed as well
+	if (ftp.dataSocket.is_open())
+		closeDataConnection(ftp);
 	// if we already have a socket open then close it
 	if (ftp.pasvSock.is_open()) {
 		ftp.pasvSock.shutdown();
 		ftp.pasvSock.close();
 	}
+	// the previous port goes back to the pool before a new one is reserved
+	ftp.pasvTicket.reset();
+	// with the pool we only need a free port, the listener is already open
+	if (ftp.server.pasvPool) {
+		ftp.pasvTicket = passiveTicket(*ftp.server.pasvPool, ftp.server.pasvPool->reserve(ftp.peer.address()));
+		if (not ftp.pasvTicket)
+			return {425, "No free passive ports, try again later"};
+		const in_port_t port = ftp.pasvTicket.port();
+		ftp.dataSockAddr = sockpp::inet_address(0, port);
+		ftp.passiveMode = true;
+		ftp.logger << getPeer(ftp) << " - reserved passive port " << port << ENDL;
+		return {227, "0,0,0,0," + std::to_string(port / 256) + "," + std::to_string(port % 256)};
+	}
 	// bind to any address and start listening
 	ftp.pasvSock.open(sockpp::inet_address(0, 0));
 	if (not ftp.pasvSock) {
@@ -355,21 +830,25 @@ const response pasvFTP(FTP &ftp, const std::string command) {
 // specifies the active connection address as ip1.ip2.ip3.ip4:port1*256+port
 // as specified in RFC 959
 // the client must listen on this address for data connections
-const response portFTP(FTP &ftp, const std::string command) {
+const response portFTP(FTP &ftp, std::string_view command) {
 	if (not isAuthed(ftp))
 		return {530, "PORT command requires an authenticated session"};
 	const auto [address, leftover] = getNextParam(command);
 	// can't have leftover parameters in port
 	if (leftover != "")
 		return {501, "PORT command accepts only one argument"};
+	// the data connection kept open by block mode goes to the old address
+	if (ftp.dataSocket.is_open())
+		closeDataConnection(ftp);
 	// close passive connection if it is open
 	if (ftp.pasvSock.is_open() || ftp.passiveMode) {
 		ftp.passiveMode = false;
 		ftp.pasvSock.shutdown();
 		ftp.pasvSock.close();
+		ftp.pasvTicket.reset();
 	}
 
-	auto tokens = splitByDelim(address, ",");
+	auto tokens = splitByDelim(std::string(address), ",");
 	// we must correctly check that there are 6 values specified and that they are all numbers
 	// simply check by converting to number and back to string
 	const auto checkInt = [](const std::string &value) -> std::string {
@@ -390,29 +869,29 @@ const response portFTP(FTP &ftp, const std::string command) {
 
 // handle FTP cwd
 // CWD [PATH] tries to change the working directory to PATH
-// we don't actually cd anywhere, we just change the curDir variable in the class
-const response cwdFTP(FTP &ftp, const std::string command) {
+// we don't actually cd anywhere, the resolver keeps an fd of the new directory for the session
+const response cwdFTP(FTP &ftp, std::string_view command) {
 	if (not isAuthed(ftp))
 		return {530, "CWD command requires an authenticated session"};
 	auto [path, leftover] = getNextParam(command);
 	if (leftover != "")
 		return {501, "CWD command can't have extra params"};
 	const auto [resPath, error] = getPath(ftp, path);
-	if (error or not fs::exists(resPath))
+	if (error or not ftp.resolver.changeDir(resPath))
 		return {550, "Invalid path or no access"};
-	ftp.curDir = resPath;
+	ftp.displayDir = ftp.resolver.displayPath(resPath);
 	return {200, "Successfully changed directory"};
 }
 
 // handle FTP cdup, just call cwd with .. parameter
 // CDUP goes up one directory, but it's basically cwd ..
-const response cdupFTP(FTP &ftp, const std::string command) {
-	return cwdFTP(ftp, ".. " + command);
+const response cdupFTP(FTP &ftp, std::string_view command) {
+	return cwdFTP(ftp, ".. " + std::string(command));
 }
 
 // handle FTP mkd
 // MKD [PATH] tries to create the directories in PATH
-const response mkdFTP(FTP &ftp, const std::string command) {
+const response mkdFTP(FTP &ftp, std::string_view command) {
 	if (not isAuthed(ftp))
 		return {530, "MKD command requires an authenticated session"};
 	auto [path, leftover] = getNextParam(command);
@@ -422,15 +901,17 @@ const response mkdFTP(FTP &ftp, const std::string command) {
 	const auto [resPath, error] = getPath(ftp, path);
 	if (error)
 		return {550, "Invalid path or no access"};
-	//
-	fs::create_directories(resPath);
-	ftp.logger << getPeer(ftp) << " - user created dir " << resPath.generic_string() << ENDL;
+	if (not ftp.resolver.makeDirs(resPath)) {
+		ftp.logger << getPeer(ftp) << " - can't create dir " << ftp.resolver.fullPath(resPath) << ": " << std::strerror(errno) << ENDL;
+		return {550, "Can't create directory"};
+	}
+	ftp.logger << getPeer(ftp) << " - user created dir " << ftp.resolver.fullPath(resPath) << ENDL;
 	return {200, "Directory created"};
 }
 
 // handle FTP SYST
 // let's just fake our server type and always say we are on linux
-const response systFTP(FTP &ftp, const std::string command) {
+const response systFTP(FTP &ftp, std::string_view command) {
 	return {200, "UNIX Type: L8"};
 }
 
@@ -438,71 +919,225 @@ const response systFTP(FTP &ftp, const std::string command) {
 // LIST [PATH/-a]
 // LIST -a/-al/-la prints "verbose" output with . and ..
 // default LIST sends the directory listing to the data connection
-const response listFTP(FTP &ftp, const std::string command) {
+const response listFTP(FTP &ftp, std::string_view command) {
 	if (not isAuthed(ftp))
 		return {530, "LIST command requires an authenticated session"};
 	const auto [path, tmp2] = getNextParam(command);
 	if (tmp2 != "")
 		return {501, "LIST command can't have extra params"};
-	fs::path requestPath = ftp.curDir;
+	std::string requestPath = ftp.resolver.currentDir();
 	// the path isn't actually a request to send verbose output then check file permissions
 	if (path != "-a" and path != "-al" and path != "-la") {
 		// check if we have access to this path
 		if (path != "") {
 			const auto[resPath, error] = getPath(ftp, path);
-			if (error or not fs::exists(resPath))
+			if (error)
 				return {550, "Invalid path or no access"};
 			requestPath = resPath;
 		}
 	}
-	// try to establish data connection
-	const auto [connectionError, connectionCode, errorString] = initDataConnection(ftp);
-	// couldn't successfully connect for data transmission
-	if (connectionError)
-		return {connectionCode, errorString};
-	ftp.logger << getPeer(ftp) << " - data connection opened for directory listing of " << ftp.curDir.generic_string() << ENDL;
-	// successfully opened connection, send good code
-	sendReply(ftp, 125, "Opened connection, about to begin transfer of directory listing");
-	streamTransferWriter listWriter;
+	// the directory is opened on every LIST, so access is checked even when the listing comes from the cache
+	uniqueFd dirFd = ftp.resolver.open(requestPath, O_RDONLY | O_DIRECTORY);
+	struct stat dirStat {};
+	if (not dirFd or ::fstat(dirFd.get(), &dirStat) < 0)
+		return {550, "Invalid path or no access"};
+	// get the formatted listing before opening the data connection, repeated listings come from the cache
+	// the cache knows the directory by its inode, which doesn't depend on the path or symlinks it was reached through
+	const bool cached = ftp.server.listings != nullptr;
+	listingCache::listingT listing;
+	try {
+		if (cached) {
+			const std::string key = std::to_string(dirStat.st_dev) + ":" + std::to_string(dirStat.st_ino);
+			const std::string watchPath = "/proc/self/fd/" + std::to_string(dirFd.get());
+			listing = ftp.server.listings->get(key, watchPath.c_str(), [&]() { return formatListing(std::move(dirFd)); });
+		} else {
+			listing = std::make_shared<const dataT>(formatListing(std::move(dirFd)));
+		}
+	} catch (std::exception &e) {
+		ftp.logger << getPeer(ftp) << " - can't list directory " << ftp.resolver.fullPath(requestPath) << ": " << e.what() << ENDL;
+		return {550, "Can't read the directory"};
+	}
 	// if we requested verbose output then send classic . and .. directories
-	if (path == "-a" or path == "-al" or path == "-la") {
-		// error during writing
-		if (listWriter.write(ftp.dataSocket, listVerboseData)) {
+	const bool verbose = path == "-a" or path == "-al" or path == "-la";
+	startTransfer(ftp, "LIST " + ftp.resolver.displayPath(requestPath), listing->size() + (verbose ? listVerboseData.size() : 0),
+				  [&ftp, listing, verbose, cached, fullPath = ftp.resolver.fullPath(requestPath)]() -> response {
+		// try to establish data connection
+		const auto [connectionError, connectionCode, errorString] = initDataConnection(ftp);
+		// couldn't successfully connect for data transmission
+		if (connectionError)
+			return {connectionCode, errorString};
+		ftp.logger << getPeer(ftp) << " - data connection opened for directory listing of " << fullPath << ENDL;
+		// successfully opened connection, send good code
+		sendAsyncReply(ftp, 125, "Opened connection, about to begin transfer of directory listing");
+		// block and deflate mode frame the listing with their writers, stream mode writes it as it is
+		const auto sendThrough = [&](auto &&writer) {
+			return (verbose and writer.write(ftp.dataSocket, listVerboseData.data(), listVerboseData.size())) or
+				   writer.write(ftp.dataSocket, listing->data(), listing->size()) or writer.finish(ftp.dataSocket);
+		};
+		bool sendError;
+		if (ftp.ftpFormatMode == FTP::DEFLATE)
+			sendError = sendThrough(deflateWriter(ftp.deflateLevel));
+		else if (ftp.ftpFormatMode == FTP::BLOCK)
+			sendError = sendThrough(blockWriter());
+		else
+			sendError = (verbose and ftp.dataSocket.write_n(listVerboseData.data(), listVerboseData.size()) < listVerboseData.size()) or
+						ftp.dataSocket.write_n(listing->data(), listing->size()) < listing->size();
+		if (sendError) {
 			ftp.logger << getPeer(ftp) << " - error during sending data: " << ftp.dataSocket.last_error_str() << ENDL;
-			ftp.dataSocket.shutdown();
-			ftp.dataSocket.close();
+			closeDataConnection(ftp);
 			return {426, "Error during dir listing transmission"};
 		}
+		ftp.transfer.control.add(listing->size());
+		releaseDataConnection(ftp, false);
+		if (cached)
+			ftp.logger << getPeer(ftp) << " - directory listing was successful, sent all data (listing cache: " <<
+					   ftp.server.listings->hits.load() << " hits, " << ftp.server.listings->misses.load() << " misses, " <<
+					   ftp.server.listings->invalidations.load() << " invalidations)" << ENDL;
+		else
+			ftp.logger << getPeer(ftp) << " - directory listing was successful, sent all data" << ENDL;
+		return {226, "Successfully transferred directory listing"};
+	});
+	return {0, ""};
+}
+
+// handle FTP MLSD
+// MLSD [PATH] sends the machine readable listing of the directory over the data connection as specified in RFC 3659
+const response mlsdFTP(FTP &ftp, std::string_view command) {
+	if (not isAuthed(ftp))
+		return {530, "MLSD command requires an authenticated session"};
+	const auto [path, leftover] = getNextParam(command);
+	if (leftover != "")
+		return {501, "MLSD command can't have extra params"};
+	std::string requestPath = ftp.resolver.currentDir();
+	if (path != "") {
+		const auto [resPath, error] = getPath(ftp, path);
+		if (error)
+			return {550, "Invalid path or no access"};
+		requestPath = resPath;
 	}
-	for (auto entry: fs::directory_iterator(requestPath)) {
-		const std::string currentName = getFilePerms(entry.path()) + " " +
-										std::to_string(fs::file_size(entry.path())) + "b " + entry.path().filename().generic_string() + CRLF;
-		const dataT currentNameData(currentName.begin(), currentName.end());
-		// error happened during writing
-		if (listWriter.write(ftp.dataSocket, currentNameData)) {
-			ftp.logger << getPeer(ftp) << " - error during sending data: " << ftp.dataSocket.last_error_str() << ENDL;
-			ftp.dataSocket.shutdown();
-			ftp.dataSocket.close();
+	directoryReader reader(ftp.resolver.open(requestPath, O_RDONLY | O_DIRECTORY));
+	if (not reader)
+		return {errno == ENOTDIR ? 501 : 550, "Can't read the directory"};
+	startTransfer(ftp, "MLSD " + ftp.resolver.displayPath(requestPath), 0,
+				  [&ftp, reader = std::move(reader), fullPath = ftp.resolver.fullPath(requestPath)]() mutable -> response {
+		// try to establish data connection
+		const auto [connectionError, connectionCode, errorString] = initDataConnection(ftp);
+		// couldn't successfully connect for data transmission
+		if (connectionError)
+			return {connectionCode, errorString};
+		sendAsyncReply(ftp, 125, "Opened connection, about to begin transfer of directory listing");
+		bool sendError;
+		if (ftp.ftpFormatMode == FTP::DEFLATE) {
+			deflateWriter writer(ftp.deflateLevel);
+			sendError = sendMachineListing(ftp.dataSocket, reader, ftp.transfer.control, writer);
+		} else if (ftp.ftpFormatMode == FTP::BLOCK) {
+			blockWriter writer;
+			sendError = sendMachineListing(ftp.dataSocket, reader, ftp.transfer.control, writer);
+		} else {
+			streamTransferWriter writer;
+			sendError = sendMachineListing(ftp.dataSocket, reader, ftp.transfer.control, writer);
+		}
+		releaseDataConnection(ftp, sendError);
+		if (sendError) {
+			ftp.logger << getPeer(ftp) << " - error during machine listing of " << fullPath << ": " << std::strerror(errno) << ENDL;
 			return {426, "Error during dir listing transmission"};
 		}
+		ftp.logger << getPeer(ftp) << " - machine listing of " << fullPath << " was successful" << ENDL;
+		return {226, "Successfully transferred directory listing"};
+	});
+	return {0, ""};
+}
+
+// handle FTP MLST
+// MLST [PATH] sends the facts of a single file or directory over the control connection as specified in RFC 3659
+const response mlstFTP(FTP &ftp, std::string_view command) {
+	if (not isAuthed(ftp))
+		return {530, "MLST command requires an authenticated session"};
+	const auto [path, leftover] = getNextParam(command);
+	if (leftover != "")
+		return {501, "MLST command can't have extra params"};
+	std::string requestPath = ftp.resolver.currentDir();
+	if (path != "") {
+		const auto [resPath, error] = getPath(ftp, path);
+		if (error)
+			return {550, "Invalid path or no access"};
+		requestPath = resPath;
 	}
-	// error during flushing leftover data to the socket
-	if (listWriter.flush(ftp.dataSocket)) {
-		ftp.logger << getPeer(ftp) << " - error during flushing leftover data: " << ftp.dataSocket.last_error_str() << ENDL;
-		ftp.dataSocket.shutdown();
-		ftp.dataSocket.close();
-		return {426, "Error during dir listing transmission"};
+	// stat through an O_PATH fd, so a symlink can't show the facts of a file outside of the work directory
+	const uniqueFd fileFd = ftp.resolver.open(requestPath, O_PATH);
+	struct statx stx {};
+	if (not fileFd or ::statx(fileFd.get(), "", AT_EMPTY_PATH, factsStatxMask, &stx) < 0)
+		return {550, "Invalid path or no access"};
+	// the name is the path as seen by the client, starting from the server root
+	const std::string displayPath = ftp.resolver.displayPath(requestPath);
+	char line[listingLineSize + PATH_MAX];
+	line[0] = ' ';
+	const size_t lineSize = 1 + formatFacts(line + 1, stx, displayPath);
+	ftp.replies.push("250-Listing " + displayPath + CRLF);
+	ftp.replies.push(std::string_view(line, lineSize));
+	ftp.replies.push(CRLF);
+	return {250, "End"};
+}
+
+// receive one range of a file uploaded by several sessions at once, started by ALLO [SIZE] REST [OFFSET] STOR [PATH]
+// in a session which turned range uploads on with OPTS RANGE ON, otherwise the same commands resume the file
+// the range goes into PATH.part at its offset and the last range to arrive renames the file to PATH
+const response storRange(FTP &ftp, const std::string &resPath, int parentFd, std::string_view name, uint64_t size, off_t offset) {
+	if (uint64_t(offset) >= size)
+		return {554, "Restart offset is past the end of file"};
+	const uploadRegistry::uploadT file = ftp.server.uploads.join(resPath, parentFd, std::string(name), size);
+	const std::string fullPath = ftp.resolver.fullPath(resPath);
+	if (not file) {
+		ftp.logger << getPeer(ftp) << " - can't upload a range of " << fullPath << ": " << std::strerror(errno) << ENDL;
+		return {451, errno == EBUSY ? "The file is being uploaded with a different size" : "Can't open the file for writing"};
 	}
-	ftp.dataSocket.shutdown();
-	ftp.dataSocket.close();
-	ftp.logger << getPeer(ftp) << " - directory listing was successful, sent all data" << ENDL;
-	return {226, "Successfully transferred directory listing"};
+	ftp.logger << getPeer(ftp) << " - user stored range at " << offset << " of file " << fullPath << ENDL;
+	startTransfer(ftp, "STOR " + ftp.resolver.displayPath(resPath) + " at " + std::to_string(offset), size - offset,
+				  [&ftp, file, resPath, offset, fullPath]() -> response {
+		const auto [connectionError, connectionCode, errorString] = initDataConnection(ftp);
+		if (connectionError) {
+			ftp.server.uploads.finish(resPath, file, offset, 0);
+			return {connectionCode, errorString};
+		}
+		sendAsyncReply(ftp, 125, "Beginning transfer of the range at " + std::to_string(offset));
+		// the range can't make the file bigger than announced, the transfer stops right after the end of the file
+		ftp.transfer.control.limit = file->size - offset;
+		const auto [status, received] = receiveModeData(ftp, file->fileFd.get(), offset);
+		releaseDataConnection(ftp, status == TRANSFER_ERROR);
+		// a range longer than announced isn't what the client meant to send, so none of it counts
+		// the other ranges only write below the size, so the part past it can be cut off right away
+		if (ftp.transfer.control.exceeded) {
+			::ftruncate(file->fileFd.get(), file->size);
+			ftp.server.uploads.finish(resPath, file, offset, 0);
+			ftp.logger << getPeer(ftp) << " - range at " << offset << " went past the size of " << fullPath << ", " <<
+					   file->size << " bytes" << ENDL;
+			return {552, "The range goes past the size announced with ALLO"};
+		}
+		// whatever arrived is in place, so it counts even if the transfer failed
+		const uploadRegistry::progress done = ftp.server.uploads.finish(resPath, file, offset, received);
+		if (status == TRANSFER_ERROR) {
+			ftp.logger << getPeer(ftp) << " - error during receiving range at " << offset << " after " << received << " bytes: " <<
+					   std::strerror(errno) << ENDL;
+			return {426, "Error during storing the file"};
+		}
+		if (done.failed) {
+			ftp.logger << getPeer(ftp) << " - can't rename the completed upload " << fullPath << ": " << std::strerror(errno) << ENDL;
+			return {451, "Can't rename the completed file"};
+		}
+		if (done.complete) {
+			ftp.logger << getPeer(ftp) << " - every range of " << fullPath << " arrived, " << done.size << " bytes" << ENDL;
+			return {226, "Successful file transfer, the file is complete"};
+		}
+		return {226, "Range stored, " + std::to_string(done.received) + " of " + std::to_string(done.size) + " bytes received"};
+	});
+	return {0, ""};
 }
 
 // handle FTP STOR
 // STOR [PATH] tries to write the file to path
 // only writes if we have access to this path and if the path points to a file in an existing folder
-const response storFTP(FTP &ftp, const std::string command) {
+// with OPTS RANGE ON and both ALLO and REST before it STOR uploads one range of the file, see storRange
+const response storFTP(FTP &ftp, std::string_view command) {
 	if (not isAuthed(ftp))
 		return {530, "STOR command requires an authenticated session"};
 	auto [path, tmp2] = getNextParam(command);
@@ -511,47 +1146,93 @@ const response storFTP(FTP &ftp, const std::string command) {
 	if (path == "")
 		return {501, "You have to specify result filename or path"};
 	const auto [resPath, pathError] = getPath(ftp, path);
-	// if the path is illegal or if the path to the file doesn't exist then we can't write
-	if (pathError or not fs::exists(resPath.parent_path()))
+	// the work directory itself can't be a file
+	if (pathError or resPath.empty())
+		return {550, "Invalid file path"};
+	// if the path to the file doesn't exist then we can't write
+	// the resolver keeps the directory fd, so the file is created in the directory checked here
+	const auto [parent, name] = pathResolver::splitPath(resPath);
+	const int parentFd = ftp.resolver.directoryFd(parent);
+	if (parentFd < 0)
 		return {550, "Invalid file path"};
 	// if the specified filename/path points to directory then we can't convert it to a file
-	if (fs::exists(resPath) and fs::is_directory(resPath))
+	struct stat fileStat {};
+	if (::fstatat(parentFd, name.data(), &fileStat, 0) == 0 and S_ISDIR(fileStat.st_mode))
 		return {550, "Invalid file path"};
+	// the announced size is only valid for one file
+	const uint64_t allocSize = ftp.allocSize;
+	ftp.allocSize = 0;
+	const bool ranged = ftp.rangeUploads and allocSize != 0 and ftp.prevCommand == verbKey("REST");
+	const off_t offset = takeRestartOffset(ftp);
+	if (ranged)
+		return storRange(ftp, resPath, parentFd, name, allocSize, offset);
 	// the filepath is correct, we can write to it
-	// try to establish data connection
-	const auto [connectionError, connectionCode, errorString] = initDataConnection(ftp);
-	// couldn't successfully connect for data transmission
-	if (connectionError)
-		return {connectionCode, errorString};
-	sendReply(ftp, 125, "Beginning file transfer");
-	try {
-		ftp.logger << getPeer(ftp) << " - user stored file " << resPath.generic_string() << ENDL;
-		// open the file in binary output mode and write blocks of bytes
-		std::ofstream file(resPath.generic_string(), std::ofstream::binary);
-		// initialize the local buffer
-		netbuffer localNetbuff;
-		// try to get data and write to file while we can
-		while (true) {
-			const dataT block = read(ftp.dataSocket, localNetbuff);
-			// if the block is empty then finish reading
-			if (block.empty())
-				break;
-			// write the block to the file
-			file.write((char *)block.data(), block.size());
-		}
-		file.close();
-		ftp.dataSocket.shutdown();
-		ftp.dataSocket.close();
-		return {226, "Successful file transfer"};
-	} catch (std::exception &e) {
-		ftp.logger << getPeer(ftp) << " - Error trying to write to file (STOR): " << resPath.generic_string() << " : " << e.what();
-		return {426, "Error during storing the file"};
+	const std::string fullPath = ftp.resolver.fullPath(resPath);
+	// the file is opened here but only truncated once the data connection is there, so a STOR without one doesn't wipe it
+	uniqueFd fileFd = ftp.resolver.open(resPath, O_WRONLY | O_CREAT, 0666);
+	if (not fileFd) {
+		ftp.logger << getPeer(ftp) << " - can't open file for storing " << fullPath << ": " << std::strerror(errno) << ENDL;
+		return {451, "Can't open the file for writing"};
 	}
+	ftp.logger << getPeer(ftp) << " - user stored file " << fullPath << ENDL;
+	// only whole files are hashed on the way, resumed uploads and the other modes get hashed by HASH when asked
+	const bool hashUpload = ftp.server.hashUploads and offset == 0 and ftp.ftpFormatMode == FTP::STREAM;
+	startTransfer(ftp, "STOR " + ftp.resolver.displayPath(resPath), allocSize,
+				  [&ftp, fileFd = std::move(fileFd), offset, allocSize, fullPath, hashUpload, algorithm = ftp.hashType]() -> response {
+		// try to establish data connection
+		const auto [connectionError, connectionCode, errorString] = initDataConnection(ftp);
+		// couldn't successfully connect for data transmission
+		if (connectionError)
+			return {connectionCode, errorString};
+		// when restarting we keep the data which is already in the file and write at the offset
+		if (offset == 0 and ::ftruncate(fileFd.get(), 0) < 0) {
+			ftp.logger << getPeer(ftp) << " - can't truncate file for storing " << fullPath << ": " << std::strerror(errno) << ENDL;
+			closeDataConnection(ftp);
+			return {451, "Can't open the file for writing"};
+		}
+		// reserve the space in one go so that many concurrent uploads don't fragment the filesystem
+		// the file size itself isn't changed, so a short upload doesn't leave garbage at the end
+		if (allocSize and ::fallocate(fileFd.get(), FALLOC_FL_KEEP_SIZE, 0, allocSize) < 0)
+			ftp.logger << getPeer(ftp) << " - can't preallocate " << allocSize << " bytes: " << std::strerror(errno) << ENDL;
+		sendAsyncReply(ftp, 125, "Beginning file transfer");
+		try {
+			const auto [status, received] = hashUpload ? receiveHashedData(ftp, fileFd.get(), algorithm) :
+											receiveModeData(ftp, fileFd.get(), offset);
+			releaseDataConnection(ftp, status == TRANSFER_ERROR);
+			if (status == TRANSFER_ERROR) {
+				ftp.logger << getPeer(ftp) << " - error during receiving file after " << received << " bytes: " << std::strerror(errno) << ENDL;
+				return {426, "Error during storing the file"};
+			}
+			return {226, "Successful file transfer"};
+		} catch (std::exception &e) {
+			ftp.logger << getPeer(ftp) << " - Error trying to write to file (STOR): " << fullPath << " : " << e.what() << ENDL;
+			closeDataConnection(ftp);
+			return {426, "Error during storing the file"};
+		}
+	});
+	return {0, ""};
+}
+
+// handle FTP ALLO
+// ALLO [SIZE] [R RECORDSIZE] announces the size of the file which is stored next
+// we use it to preallocate the space for the file, record size is ignored since we only support file structure
+const response alloFTP(FTP &ftp, std::string_view command) {
+	if (not isAuthed(ftp))
+		return {530, "ALLO command requires an authenticated session"};
+	const auto [size, leftover] = getNextParam(command);
+	if (size == "")
+		return {501, "You have to specify the size"};
+	if (leftover != "" and leftover.substr(0, 2) != "R ")
+		return {501, "ALLO command must be in form ALLO SIZE [R RECORDSIZE]"};
+	if (size.find_first_not_of("0123456789") != std::string_view::npos or
+		std::from_chars(size.data(), size.data() + size.size(), ftp.allocSize).ec != std::errc())
+		return {501, "Invalid size for ALLO command"};
+	return {200, "Will reserve space for " + std::string(size) + " bytes"};
 }
 
 // handle FTP RETR
 // RETR [PATH] tries to retrieve requested file
-const response retrFTP(FTP &ftp, const std::string command) {
+const response retrFTP(FTP &ftp, std::string_view command) {
 	if (not isAuthed(ftp))
 		return {530, "STOR command requires an authenticated session"};
 	auto [path, tmp2] = getNextParam(command);
@@ -560,60 +1241,427 @@ const response retrFTP(FTP &ftp, const std::string command) {
 	if (path == "")
 		return {501, "You have to specify requested filename or path"};
 	const auto [resPath, pathError] = getPath(ftp, path);
-	// if the path is illegal or if the path to the file doesn't exist then we can't write
-	if (pathError or not fs::exists(resPath))
+	// if the path is illegal then we can't read
+	if (pathError)
 		return {550, "Invalid file path"};
+	const off_t offset = takeRestartOffset(ftp);
+	// popular files are served from the hot file cache, which spares opening them and keeps their pages warm
+	hotFileCache::fileT hot;
+	if (ftp.server.hotFiles)
+		hot = ftp.server.hotFiles->get(ftp.server.rootFd.get(), resPath, [&]() { return ftp.resolver.open(resPath, O_RDONLY); });
+	// the checks below are done on the opened fd, so the file can't be swapped between them and the transfer
+	uniqueFd fileFd;
+	struct stat fileStat {};
+	if (hot) {
+		fileStat = hot->fileStat;
+	} else {
+		fileFd = ftp.resolver.open(resPath, O_RDONLY);
+		if (not fileFd or ::fstat(fileFd.get(), &fileStat) < 0) {
+			if (errno == ENOENT or errno == EXDEV)
+				return {550, "Invalid file path"};
+			ftp.logger << getPeer(ftp) << " - can't open requested file " << ftp.resolver.fullPath(resPath) << ": " << std::strerror(errno) << ENDL;
+			return {550, "Can't open the requested file"};
+		}
+	}
 	// if the specified filename/path points to directory then we can't send it as a file
-	if (fs::exists(resPath) and fs::is_directory(resPath))
+	if (S_ISDIR(fileStat.st_mode))
 		return {550, "Invalid file path"};
+	// as specified in RFC 3659 the restart point can't be past the end of file
+	if (offset > fileStat.st_size)
+		return {554, "Restart offset is past the end of file"};
 	// the file exists so we could try sending it
-	// try to establish data connection
-	const auto [connectionError, connectionCode, errorString] = initDataConnection(ftp);
-	// couldn't successfully connect for data transmission
-	if (connectionError)
-		return {connectionCode, errorString};
-	sendReply(ftp, 125, "Beginning file transfer");
-	try {
-		ftp.logger << getPeer(ftp) << " - user requested file " << resPath.generic_string() << ENDL;
-		// open the file in binary output mode and write blocks of bytes
-		fs::ifstream file(resPath.generic_string(), std::ofstream::binary);
-		// initialize the streamwriter class
-		streamTransferWriter localWriter;
-		// local buffer for reading
-		dataT buffer;
-		buffer.reserve(BUFSIZE);
-		// try to get read data and send
-		while (not file.eof()) {
-			file.read(reinterpret_cast<char *>(buffer.data()), BUFSIZE);
-			const int32_t numRead = file.gcount();
-			// we read zero bytes so lets just quit
-			if (!numRead)
-				break;
-			buffer.assign(buffer.data(), buffer.data() + numRead);
-			// error happens during sending data
-			if (localWriter.write(ftp.dataSocket, buffer)) {
-				file.close();
-				ftp.dataSocket.shutdown();
-				ftp.dataSocket.close();
+	const std::string fullPath = ftp.resolver.fullPath(resPath);
+	ftp.logger << getPeer(ftp) << " - user requested file " << fullPath << " from offset " << offset << ENDL;
+	startTransfer(ftp, "RETR " + ftp.resolver.displayPath(resPath), fileStat.st_size - offset,
+				  [&ftp, fileFd = std::move(fileFd), hot, offset, fullPath]() -> response {
+		// try to establish data connection
+		const auto [connectionError, connectionCode, errorString] = initDataConnection(ftp);
+		// couldn't successfully connect for data transmission
+		if (connectionError)
+			return {connectionCode, errorString};
+		sendAsyncReply(ftp, 125, "Beginning file transfer");
+		try {
+			const auto [status, sent] = sendModeData(ftp, hot ? hot->fd.get() : fileFd.get(), offset, fullPath, hot.get());
+			releaseDataConnection(ftp, status == TRANSFER_ERROR);
+			if (status == TRANSFER_ERROR) {
+				ftp.logger << getPeer(ftp) << " - error during sending file after " << sent << " bytes: " << std::strerror(errno) << ENDL;
 				return {426, "Error during file transmission"};
 			}
-			buffer.clear();
+			return {226, "Successful file transfer"};
+		} catch (std::exception &e) {
+			ftp.logger << getPeer(ftp) << " - Error trying to read from file (RETR): " << fullPath << " : " << e.what() << ENDL;
+			closeDataConnection(ftp);
+			return {426, "Error during retrieving the file"};
 		}
-		// try flushing the rest of the data
-		if (localWriter.buffer.size() != 0 and localWriter.flush(ftp.dataSocket)) {
-			file.close();
-			ftp.dataSocket.shutdown();
-			ftp.dataSocket.close();
-			return {426, "Error during file transmission"};
+	});
+	return {0, ""};
+}
+
+// handle FTP SEGR
+// SEGR [COUNT] [PATH] sends the file from the REST offset over COUNT data connections at once, one segment on each
+// every connection starts with the offset and the length of its segment as 64 bit big-endian numbers,
+// so the client can put the segments in place no matter in which order its connections were accepted
+// the segments are read with positional reads, so they run in parallel without sharing a file offset
+const response segrFTP(FTP &ftp, std::string_view command) {
+	if (not isAuthed(ftp))
+		return {530, "SEGR command requires an authenticated session"};
+	const auto [countParam, path] = getNextParam(command);
+	uint32_t count = 0;
+	if (countParam.find_first_not_of("0123456789") != std::string_view::npos or
+		std::from_chars(countParam.data(), countParam.data() + countParam.size(), count).ec != std::errc() or count == 0)
+		return {501, "SEGR command must be in form SEGR [COUNT] [PATH]"};
+	// a single session mustn't take the whole disk and network for itself
+	if (count > ftp.server.maxSegments)
+		return {504, "At most " + std::to_string(ftp.server.maxSegments) + " segments are allowed"};
+	if (path == "")
+		return {501, "You have to specify requested filename or path"};
+	if (ftp.ftpFormatMode != FTP::STREAM)
+		return {504, "SEGR is only supported in stream mode"};
+	const auto [resPath, pathError] = getPath(ftp, path);
+	if (pathError)
+		return {550, "Invalid file path"};
+	const off_t offset = takeRestartOffset(ftp);
+	uniqueFd fileFd = ftp.resolver.open(resPath, O_RDONLY);
+	struct stat fileStat {};
+	if (not fileFd or ::fstat(fileFd.get(), &fileStat) < 0 or S_ISDIR(fileStat.st_mode))
+		return {550, "Invalid file path"};
+	if (offset > fileStat.st_size)
+		return {554, "Restart offset is past the end of file"};
+	const uint64_t length = fileStat.st_size - offset;
+	const std::string fullPath = ftp.resolver.fullPath(resPath);
+	ftp.logger << getPeer(ftp) << " - user requested file " << fullPath << " from offset " << offset << " in " << count << " segments" << ENDL;
+	startTransfer(ftp, "SEGR " + ftp.resolver.displayPath(resPath), length,
+				  [&ftp, fileFd = std::move(fileFd), count, offset, length, fullPath]() mutable -> response {
+		// every segment gets its own connection, opened one after another like for any other transfer
+		std::vector<sockpp::tcp_socket> connections;
+		for (uint32_t i = 0; i < count; i++) {
+			const auto [connectionError, connectionCode, errorString] = initDataConnection(ftp);
+			if (connectionError) {
+				ftp.transfer.dataClosed();
+				for (auto &connection: connections)
+					connection.close();
+				return {connectionCode, errorString};
+			}
+			connections.push_back(std::move(ftp.dataSocket));
 		}
-		file.close();
-		ftp.dataSocket.shutdown();
-		ftp.dataSocket.close();
-		return {226, "Successful file transfer"};
-	} catch (std::exception &e) {
-		ftp.logger << getPeer(ftp) << " - Error trying to read from file (RETR): " << resPath.generic_string() << " : " << e.what();
-		return {426, "Error during retrieving the file"};
+		sendAsyncReply(ftp, 125, "Sending " + std::to_string(length) + " bytes in " + std::to_string(count) + " segments");
+		const uint64_t segmentSize = (length + connections.size() - 1) / connections.size();
+		const bool zeroCopy = ftp.server.engine != ENGINE_BLOCKING;
+		std::atomic<bool> failed {false};
+		const auto sendSegment = [&](size_t index) {
+			const uint64_t start = std::min(length, index * segmentSize), size = std::min(length - start, segmentSize);
+			byte header[segmentHeaderSize];
+			for (size_t i = 0; i < 8; i++) {
+				header[i] = (offset + start) >> (56 - 8 * i);
+				header[8 + i] = size >> (56 - 8 * i);
+			}
+			sockpp::tcp_socket &connection = connections[index];
+			if (::send(connection.handle(), header, segmentHeaderSize, MSG_MORE | MSG_NOSIGNAL) < ssize_t(segmentHeaderSize) or
+				sendFileRange(connection, fileFd.get(), offset + start, size, zeroCopy, ftp.transfer.control).first == TRANSFER_ERROR) {
+				ftp.logger << getPeer(ftp) << " - error during sending segment " << index << " of " << fullPath << ": " <<
+						   std::strerror(errno) << ENDL;
+				failed = true;
+			}
+		};
+		// the first segment is sent by the transfer thread itself
+		std::vector<std::thread> workers;
+		for (size_t i = 1; i < connections.size(); i++)
+			workers.emplace_back(sendSegment, i);
+		sendSegment(0);
+		for (auto &worker: workers)
+			worker.join();
+		ftp.transfer.dataClosed();
+		for (auto &connection: connections) {
+			connection.shutdown();
+			connection.close();
+		}
+		if (failed)
+			return {426, "Error during segmented file transmission"};
+		return {226, "Successful segmented file transfer"};
+	});
+	return {0, ""};
+}
+
+// handle FTP REST
+// REST [OFFSET] sets the offset at which the next RETR or STOR starts
+// this is the stream mode restart from RFC 3659, so the offset is simply the number of bytes to skip
+const response restFTP(FTP &ftp, std::string_view command) {
+	if (not isAuthed(ftp))
+		return {530, "REST command requires an authenticated session"};
+	const auto [offset, leftover] = getNextParam(command);
+	if (leftover != "")
+		return {501, "REST command can't have extra params"};
+	// a rejected REST mustn't leave the offset of an earlier one behind for the next transfer
+	ftp.restartOffset = 0;
+	uint64_t parsed = 0;
+	// the offset becomes an off_t for the file, so anything past its range can't be a position in a file
+	if (offset == "" or offset.find_first_not_of("0123456789") != std::string_view::npos or
+		std::from_chars(offset.data(), offset.data() + offset.size(), parsed).ec != std::errc() or
+		parsed > uint64_t(std::numeric_limits<off_t>::max()))
+		return {501, "Invalid offset for REST command"};
+	ftp.restartOffset = parsed;
+	return {350, "Restarting at " + std::string(offset) + ". Send STOR or RETR to initiate transfer"};
+}
+
+// handle FTP SIZE
+// SIZE [PATH] returns the size of the file as specified in RFC 3659
+// clients use it to find out from where to resume an upload
+const response sizeFTP(FTP &ftp, std::string_view command) {
+	if (not isAuthed(ftp))
+		return {530, "SIZE command requires an authenticated session"};
+	auto [path, leftover] = getNextParam(command);
+	if (leftover != "")
+		return {501, "SIZE command can't have extra params"};
+	if (path == "")
+		return {501, "You have to specify filename or path"};
+	const auto [resPath, pathError] = getPath(ftp, path);
+	if (pathError)
+		return {550, "Invalid file path"};
+	const uniqueFd fileFd = ftp.resolver.open(resPath, O_PATH);
+	struct stat fileStat {};
+	if (not fileFd or ::fstat(fileFd.get(), &fileStat) < 0 or not S_ISREG(fileStat.st_mode))
+		return {550, "Invalid file path"};
+	return {213, std::to_string(fileStat.st_size)};
+}
+
+// helper function to reply with the hash of the file at path, format turns the hash and the size of the file into the reply
+// a hash cached on the file is answered right away, otherwise the file is hashed on the transfer thread,
+// so a large file can be followed with STAT and stopped with ABOR
+template<typename formatFunction>
+const response hashPath(FTP &ftp, std::string_view path, std::string_view verb, hashAlgorithm algorithm, formatFunction format) {
+	if (path == "")
+		return {501, "You have to specify filename or path"};
+	const auto [resPath, pathError] = getPath(ftp, path);
+	if (pathError)
+		return {550, "Invalid file path"};
+	uniqueFd fileFd = ftp.resolver.open(resPath, O_RDONLY);
+	struct stat fileStat {};
+	if (not fileFd or ::fstat(fileFd.get(), &fileStat) < 0 or not S_ISREG(fileStat.st_mode))
+		return {550, "Invalid file path"};
+	const std::string cached = cachedHash(fileFd.get(), algorithm, fileStat);
+	if (not cached.empty())
+		return format(cached, fileStat.st_size);
+	const std::string fullPath = ftp.resolver.fullPath(resPath);
+	startTask(ftp, std::string(verb) + " " + ftp.resolver.displayPath(resPath), fileStat.st_size, -1,
+			  [&ftp, fileFd = std::move(fileFd), fileStat, algorithm, format, fullPath]() -> response {
+		const std::string hex = hashFile(fileFd.get(), algorithm, ftp.transfer.control);
+		if (hex.empty()) {
+			ftp.logger << getPeer(ftp) << " - can't hash file " << fullPath << ": " << std::strerror(errno) << ENDL;
+			return {451, "Can't read the file"};
+		}
+		// the hash is only cached if the file didn't change while it was read
+		struct stat hashedStat {};
+		if (::fstat(fileFd.get(), &hashedStat) == 0 and hashCacheKey(hashedStat) == hashCacheKey(fileStat))
+			storeHash(fileFd.get(), algorithm, fileStat, hex);
+		return format(hex, fileStat.st_size);
+	});
+	return {0, ""};
+}
+
+// reply of the XCRC, XMD5 and XSHA256 commands, only the hash itself
+const response hashOnlyFTP(FTP &ftp, std::string_view command, std::string_view verb, hashAlgorithm algorithm) {
+	if (not isAuthed(ftp))
+		return {530, std::string(verb) + " command requires an authenticated session"};
+	const auto [path, leftover] = getNextParam(command);
+	if (leftover != "")
+		return {501, std::string(verb) + " command can't have extra params"};
+	return hashPath(ftp, path, verb, algorithm, [](const std::string &hex, off_t) -> response {
+		return {250, hex};
+	});
+}
+
+// handle FTP HASH
+// HASH [PATH] returns the hash of the whole file with the algorithm selected by OPTS HASH
+// the reply is "213 ALGORITHM START-END HASH PATH" as specified in the HASH draft, with the range inclusive
+const response hashFTP(FTP &ftp, std::string_view command) {
+	if (not isAuthed(ftp))
+		return {530, "HASH command requires an authenticated session"};
+	const auto [path, leftover] = getNextParam(command);
+	if (leftover != "")
+		return {501, "HASH command can't have extra params"};
+	const hashAlgorithm algorithm = ftp.hashType;
+	return hashPath(ftp, path, "HASH", algorithm, [algorithm, path = std::string(path)](const std::string &hex, off_t size) -> response {
+		return {213, std::string(hashNames[algorithm]) + " 0-" + std::to_string(size ? size - 1 : 0) + " " + hex + " " + path};
+	});
+}
+
+// handle FTP XCRC, XMD5 and XSHA256
+// the older commands some clients use instead of HASH, each with a fixed algorithm
+const response xcrcFTP(FTP &ftp, std::string_view command) {
+	return hashOnlyFTP(ftp, command, "XCRC", HASH_CRC32);
+}
+
+const response xmd5FTP(FTP &ftp, std::string_view command) {
+	return hashOnlyFTP(ftp, command, "XMD5", HASH_MD5);
+}
+
+const response xsha256FTP(FTP &ftp, std::string_view command) {
+	return hashOnlyFTP(ftp, command, "XSHA256", HASH_SHA256);
+}
+
+// handle FTP ABOR
+// ABOR stops the running transfer and closes its data connection
+// the transfer is answered with 426 and then ABOR itself with 226, as specified in RFC 959
+const response aborFTP(FTP &ftp, std::string_view command) {
+	if (not isAuthed(ftp))
+		return {530, "ABOR command requires an authenticated session"};
+	const auto [tmp1, tmp2] = getNextParam(command);
+	if (tmp1 != "")
+		return {501, "ABOR command can't have any params"};
+	if (not ftp.transfer.running())
+		return {225, "No transfer in progress"};
+	ftp.transfer.cancel();
+	ftp.transfer.wait();
+	return {226, "Transfer aborted, data connection closed"};
+}
+
+// handle FTP STAT
+// STAT without params shows the progress of the running transfer or the state of the session
+const response statFTP(FTP &ftp, std::string_view command) {
+	if (not isAuthed(ftp))
+		return {530, "STAT command requires an authenticated session"};
+	if (command != "")
+		return {504, "STAT is only supported without params, use LIST or MLST for files"};
+	if (ftp.transfer.running()) {
+		const uint64_t done = ftp.transfer.control.bytes.load(), expected = ftp.transfer.expectedBytes();
+		const double seconds = ftp.transfer.elapsedSeconds();
+		char progress[160];
+		const int length = expected ?
+			snprintf(progress, sizeof(progress), " %lu of %lu bytes (%.1f%%) in %.1f s, %.2f MB/s", done, expected,
+					 100.0 * done / expected, seconds, done / seconds / (1 << 20)) :
+			snprintf(progress, sizeof(progress), " %lu bytes in %.1f s, %.2f MB/s", done, seconds, done / seconds / (1 << 20));
+		ftp.replies.push("211-Transfer in progress" + CRLF + " " + ftp.transfer.what() + CRLF);
+		ftp.replies.push(std::string_view(progress, length));
+		ftp.replies.push(CRLF);
+		return {211, "End of status"};
+	}
+	ftp.replies.push("211-FTP server status" + CRLF + " Connected from " + ftp.peer.to_string() + CRLF +
+					 " Logged in as " + ftp.user.first + CRLF +
+					 " TYPE: " + (ftp.ftpFormatType == FTP::IMAGE ? "Image" : "ASCII non-print") + ", MODE: " +
+					 (ftp.ftpFormatMode == FTP::DEFLATE ? "Deflate (level " + std::to_string(ftp.deflateLevel) + ")" :
+					  ftp.ftpFormatMode == FTP::BLOCK ? "Block" : "Stream") +
+					 ", STRU: File" + CRLF +
+					 " No data transfer in progress" + CRLF);
+	return {211, "End of status"};
+}
+
+// helper function to format a duration in microseconds for SITE STATS
+const std::string formatMicros(uint64_t micros) {
+	char text[32];
+	if (micros < 1000)
+		snprintf(text, sizeof(text), "%luus", micros);
+	else if (micros < 1000000)
+		snprintf(text, sizeof(text), "%.1fms", micros / 1e3);
+	else
+		snprintf(text, sizeof(text), "%.2fs", micros / 1e6);
+	return text;
+}
+
+// helper function for SITE STATS, the server-wide metrics as a multiline reply
+// the percentiles are the upper edges of the histogram buckets, so they are at most 12.5% too high
+const response siteStats(FTP &ftp) {
+	const serverMetrics &metrics = ftp.server.metrics;
+	std::string text = "211-Server statistics" + CRLF + " Sessions: " + std::to_string(metrics.sessionsActive.load()) +
+					   " active, " + std::to_string(metrics.sessionsTotal.load()) + " total" + CRLF + " Replies:";
+	for (int replyClass = 1; replyClass <= 5; replyClass++)
+		text += " " + std::to_string(replyClass) + "xx " + std::to_string(metrics.replies[replyClass].load());
+	text += ", unknown commands " + std::to_string(metrics.unknownCommands.load()) + CRLF + " Commands:" + CRLF;
+	const auto verbs = metrics.verbs();
+	char line[256];
+	for (const auto &[row, verb]: verbs) {
+		const histogramSnapshot latency = metrics.commandLatency(row);
+		if (latency.total == 0)
+			continue;
+		snprintf(line, sizeof(line), "  %-8s %10lu  p50 %-9s p99 %-9s max %s", verb.c_str(), latency.total,
+				 formatMicros(latency.quantile(0.5)).c_str(), formatMicros(latency.quantile(0.99)).c_str(),
+				 formatMicros(latency.quantile(1)).c_str());
+		text += line + CRLF;
+	}
+	text += " Transfers: " + std::to_string(metrics.transfersFailed.load()) + " failed, " +
+			std::to_string(metrics.transfersAborted.load()) + " aborted" + CRLF;
+	for (const auto &[row, verb]: verbs) {
+		const histogramSnapshot duration = metrics.transferDuration(row);
+		const uint64_t bytes = metrics.transferBytes(row);
+		if (duration.total == 0 and bytes == 0)
+			continue;
+		snprintf(line, sizeof(line), "  %-8s %10lu  %lu bytes, p50 %-9s p99 %-9s %.2f MB/s", verb.c_str(), duration.total,
+				 bytes, formatMicros(duration.quantile(0.5)).c_str(), formatMicros(duration.quantile(0.99)).c_str(),
+				 duration.sum ? bytes / (duration.sum / 1e6) / (1 << 20) : 0.0);
+		text += line + CRLF;
+	}
+	ftp.replies.push(text);
+	return {211, "End of statistics"};
+}
+
+// the metrics of the server in the Prometheus text format, together with the counters of the caches
+const std::string metricsText(serverContext &server) {
+	std::string text = server.metrics.prometheus();
+	const auto cache = [&](const char *name, const char *description, const auto &counters) {
+		text += std::string("# HELP cpp_ftp_") + name + "_cache_total Lookups of the " + description + " cache by result.\n" +
+				"# TYPE cpp_ftp_" + name + "_cache_total counter\n";
+		for (const auto &[result, value]: {std::pair("hit", &counters.hits), std::pair("miss", &counters.misses),
+										   std::pair("invalidation", &counters.invalidations)})
+			text += std::string("cpp_ftp_") + name + "_cache_total{result=\"" + result + "\"} " +
+					std::to_string(value->load()) + "\n";
+	};
+	if (server.listings)
+		cache("listing", "directory listing", *server.listings);
+	if (server.hotFiles)
+		cache("hot_file", "hot file", *server.hotFiles);
+	return text;
+}
+
+// handle FTP SITE
+// SITE STATS shows the statistics of the whole server to any user
+// SITE RATE shows the bandwidth limits of the session in KiB/s, SITE RATE SESSION [KIB/S] changes the limit of the session,
+// which only the admin user can raise above the limit the sessions start with
+// SITE RATE USER [NAME] [KIB/S] and SITE RATE GLOBAL [KIB/S] change the limits of a user and of the whole server,
+// only the admin user may do that, 0 removes a limit and the running transfers follow the new limits right away
+const response siteFTP(FTP &ftp, std::string_view command) {
+	if (not isAuthed(ftp))
+		return {530, "SITE command requires an authenticated session"};
+	const auto [subcommand, leftover] = getNextParam(command);
+	if (subcommand == "STATS" and leftover == "")
+		return siteStats(ftp);
+	if (subcommand != "RATE")
+		return {504, "Only SITE RATE and SITE STATS are supported"};
+	if (leftover == "")
+		return {200, "Rate limits in KiB/s (0 is unlimited): global " + std::to_string(ftp.server.rates.global.rate() >> 10) +
+					 ", user " + std::to_string(ftp.rate.user ? ftp.rate.user->rate() >> 10 : 0) +
+					 ", session " + std::to_string(ftp.rate.session.rate() >> 10)};
+	const auto [scope, settings] = getNextParam(leftover);
+	uint64_t rate = 0;
+	const bool admin = not ftp.server.adminUser.empty() and ftp.user.first == ftp.server.adminUser;
+	// the limits of the user still apply, so the session can't get more than them by raising its own limit
+	// the limit every session starts with is the operator's, so only the admin user can go above it
+	if (scope == "SESSION") {
+		if (not parseRate(settings, rate))
+			return {501, "SITE RATE SESSION must be in form SITE RATE SESSION [KIB/S]"};
+		const uint64_t cap = ftp.server.rates.sessionRate;
+		if (not admin and cap and (rate == 0 or rate > cap))
+			return {550, "The session limit can't be raised above " + std::to_string(cap >> 10) + " KiB/s"};
+		ftp.rate.session.setRate(rate);
+		return {200, "Session rate limit set to " + std::string(settings) + " KiB/s"};
+	}
+	if (scope != "GLOBAL" and scope != "USER")
+		return {501, "SITE RATE must be followed by GLOBAL, USER or SESSION"};
+	if (not admin)
+		return {550, "Only the admin user can change the limits of the server and of the users"};
+	if (scope == "GLOBAL") {
+		if (not parseRate(settings, rate))
+			return {501, "SITE RATE GLOBAL must be in form SITE RATE GLOBAL [KIB/S]"};
+		ftp.server.rates.global.setRate(rate);
+		ftp.logger << getPeer(ftp) << " - global rate limit set to " << settings << " KiB/s" << ENDL;
+		return {200, "Global rate limit set to " + std::string(settings) + " KiB/s"};
 	}
+	const auto [name, value] = getNextParam(settings);
+	if (not parseRate(value, rate))
+		return {501, "SITE RATE USER must be in form SITE RATE USER [NAME] [KIB/S]"};
+	if (ftp.users.find(std::string(name)) == ftp.users.end())
+		return {501, "Unknown user"};
+	ftp.server.rates.setUserRate(std::string(name), rate);
+	ftp.logger << getPeer(ftp) << " - rate limit of user " << name << " set to " << value << " KiB/s" << ENDL;
+	return {200, "Rate limit of user " + std::string(name) + " set to " + std::string(value) + " KiB/s"};
 }
 
 #endif //CPP_FTP_FTP_HPP
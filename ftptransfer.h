@@ -2,7 +2,20 @@
 #define CPP_FTP_FTPTRANSFER_H
 
 #include <sockpp/tcp_socket.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <functional>
+#include <limits>
+#include <mutex>
 #include "globals.hpp"
+#include "utils.hpp"
+#include "netbuffer.hpp"
+#include "ratelimit.hpp"
 
 class streamTransferWriter {
 public:
@@ -20,20 +33,314 @@ public:
 	}
 
 	// lazily write data to socket
-	const bool write(sockpp::stream_socket &sock, dataT data) {
-		// if we don't have enough space then flush
-		int32_t leftspace = buffer.capacity() - buffer.size();
-		if (leftspace < data.size()) {
-			buffer.insert(buffer.end(), data.begin(), data.begin() + leftspace);
+	const bool write(sockpp::stream_socket &sock, const byte *data, size_t size) {
+		// while we don't have enough space fill the buffer up and flush
+		size_t leftspace = buffer.capacity() - buffer.size();
+		while (leftspace < size) {
+			buffer.insert(buffer.end(), data, data + leftspace);
 			if (flush(sock))
 				return true;
 			buffer.clear();
-			buffer.insert(buffer.end(), data.begin() + leftspace, data.end());
-			return false;
+			data += leftspace;
+			size -= leftspace;
+			leftspace = buffer.capacity();
 		}
-		buffer.insert(buffer.end(), data.begin(), data.end());
+		buffer.insert(buffer.end(), data, data + size);
 		return false;
 	}
+
+	const bool write(sockpp::stream_socket &sock, const dataT &data) {
+		return write(sock, data.data(), data.size());
+	}
+
+	// write out whatever is still buffered
+	const bool finish(sockpp::stream_socket &sock) {
+		return buffer.size() != 0 and flush(sock);
+	}
 };
 
+// result of moving a file over the data connection
+// TRANSFER_UNSUPPORTED means that the method can't be used for these descriptors and nothing was moved yet,
+// so the caller should fall back to the buffered path
+enum transferStatus {TRANSFER_DONE, TRANSFER_UNSUPPORTED, TRANSFER_ERROR};
+// status and the number of bytes moved
+typedef std::pair<transferStatus, uint64_t> transferResult;
+
+// progress of a running transfer and the flag which stops it, shared with the control connection
+// the transfer methods count the bytes as they go and check the flag between chunks
+// counting the bytes also pays for them in the rate limits, a throttled transfer sleeps there until its tokens
+// are refilled and is woken right away if it is canceled
+struct transferControl {
+	static constexpr uint64_t noLimit = std::numeric_limits<uint64_t>::max();
+
+	std::atomic<uint64_t> bytes {0};
+	std::atomic<bool> canceled {false};
+	// rate limits of the session, not set for transfers which are never throttled
+	rateLimiter *limiter = nullptr;
+	// most bytes the transfer may move, set by the transfer itself before it starts moving data
+	// going past it sets exceeded and stops the transfer, at most one chunk gets past the limit
+	uint64_t limit = noLimit;
+	std::atomic<bool> exceeded {false};
+
+	// check the flags, a canceled transfer fails with ECANCELED and one which went past its limit with EFBIG
+	bool stopped() const {
+		if (exceeded.load(std::memory_order_relaxed)) {
+			errno = EFBIG;
+			return true;
+		}
+		if (not canceled.load(std::memory_order_relaxed))
+			return false;
+		errno = ECANCELED;
+		return true;
+	}
+
+	void add(uint64_t moved) {
+		count(moved);
+		pace(moved);
+	}
+
+	// wait for the rate limits of bytes which were already counted, for transfers which count on another thread
+	void pace(uint64_t moved) {
+		if (limiter)
+			pause(limiter->take(moved));
+	}
+
+	// check if the rate limits apply to the transfer right now, they can be changed while it runs
+	bool throttled() const {
+		return limiter and limiter->limited();
+	}
+
+	// count the bytes without waiting for the rate limits, for work which shouldn't be throttled
+	void count(uint64_t moved) {
+		if (bytes.fetch_add(moved, std::memory_order_relaxed) + moved > limit)
+			exceeded = true;
+	}
+
+	// size of the next chunk of a transfer, throttled transfers move smaller chunks
+	// a transfer near its limit asks for one byte more than it may move, which is enough to tell that there is more
+	size_t chunk(size_t preferred) const {
+		const size_t size = limiter ? limiter->chunk(preferred) : preferred;
+		if (limit == noLimit)
+			return size;
+		return std::min<uint64_t>(size, limit - std::min(limit, bytes.load(std::memory_order_relaxed)) + 1);
+	}
+
+	// stop the transfer and wake it up if it waits for the rate limits
+	void cancel() {
+		{
+			std::lock_guard<std::mutex> lock(pauseMutex);
+			canceled = true;
+		}
+		wakeup.notify_all();
+	}
+
+private:
+	std::mutex pauseMutex;
+	std::condition_variable wakeup;
+
+	void pause(std::chrono::nanoseconds wait) {
+		if (wait.count() <= 0)
+			return;
+		std::unique_lock<std::mutex> lock(pauseMutex);
+		wakeup.wait_for(lock, wait, [this]() { return canceled.load(); });
+	}
+};
+
+// zero-copy transfer of the file from offset up to its end straight from the page cache to the socket
+const transferResult sendFile(sockpp::stream_socket &sock, int fileFd, off_t offset, transferControl &control) {
+	uint64_t sentTotal = 0;
+	while (true) {
+		if (control.stopped())
+			return {TRANSFER_ERROR, sentTotal};
+		const ssize_t sent = ::sendfile(sock.handle(), fileFd, &offset, control.chunk(sendfileChunk));
+		// reached the end of file
+		if (sent == 0)
+			return {TRANSFER_DONE, sentTotal};
+		if (sent > 0) {
+			sentTotal += sent;
+			control.add(sent);
+			continue;
+		}
+		if (errno == EINTR)
+			continue;
+		if (sentTotal == 0 and (errno == EINVAL or errno == ENOSYS or errno == EOPNOTSUPP))
+			return {TRANSFER_UNSUPPORTED, 0};
+		return {TRANSFER_ERROR, sentTotal};
+	}
+}
+
+// transfer of length bytes of the file starting at offset, each SEGR segment is sent with it
+// zero-copy with sendfile unless zeroCopy is off or the file doesn't support it, then with pread and write
+// a file which got shorter than the range fails the transfer
+const transferResult sendFileRange(sockpp::stream_socket &sock, int fileFd, off_t offset, uint64_t length, bool zeroCopy,
+								   transferControl &control) {
+	dataT buffer;
+	uint64_t sentTotal = 0;
+	while (sentTotal < length) {
+		if (control.stopped())
+			return {TRANSFER_ERROR, sentTotal};
+		const size_t chunk = std::min<uint64_t>(length - sentTotal, control.chunk(zeroCopy ? sendfileChunk : BUFSIZE));
+		ssize_t sent;
+		if (zeroCopy) {
+			sent = ::sendfile(sock.handle(), fileFd, &offset, chunk);
+			if (sent < 0 and sentTotal == 0 and (errno == EINVAL or errno == ENOSYS or errno == EOPNOTSUPP)) {
+				zeroCopy = false;
+				continue;
+			}
+		} else {
+			buffer.resize(BUFSIZE);
+			sent = ::pread(fileFd, buffer.data(), chunk, offset);
+			if (sent > 0 and sock.write_n(buffer.data(), sent) < sent)
+				return {TRANSFER_ERROR, sentTotal};
+			if (sent > 0)
+				offset += sent;
+		}
+		if (sent < 0 and errno == EINTR)
+			continue;
+		if (sent == 0)
+			errno = ENODATA;
+		if (sent <= 0)
+			return {TRANSFER_ERROR, sentTotal};
+		sentTotal += sent;
+		control.add(sent);
+	}
+	return {TRANSFER_DONE, sentTotal};
+}
+
+// buffered transfer of the file from offset up to its end, reads with pread and writes through streamTransferWriter
+// works with any kind of file, so it is the fallback for every other method
+const transferResult sendFileBuffered(sockpp::stream_socket &sock, int fileFd, off_t offset, transferControl &control) {
+	// initialize the streamwriter class
+	streamTransferWriter localWriter;
+	// local buffer for reading
+	dataT buffer(BUFSIZE);
+	uint64_t sentTotal = 0;
+	// try to get read data and send
+	while (true) {
+		if (control.stopped())
+			return {TRANSFER_ERROR, sentTotal};
+		const ssize_t numRead = ::pread(fileFd, buffer.data(), BUFSIZE, offset);
+		if (numRead < 0 and errno == EINTR)
+			continue;
+		// we read zero bytes so lets just quit
+		if (numRead == 0)
+			break;
+		// error happens during reading or sending data
+		if (numRead < 0 or localWriter.write(sock, buffer.data(), numRead))
+			return {TRANSFER_ERROR, sentTotal};
+		offset += numRead;
+		sentTotal += numRead;
+		control.add(numRead);
+	}
+	// try flushing the rest of the data
+	if (localWriter.buffer.size() != 0 and localWriter.flush(sock))
+		return {TRANSFER_ERROR, sentTotal};
+	return {TRANSFER_DONE, sentTotal};
+}
+
+// buffered receive of the data from the socket into the file at offset until the peer closes the connection
+// writes with pwrite straight from the netbuffer, observe gets every block written, e.g. to hash the upload
+const transferResult receiveFileBuffered(sockpp::stream_socket &sock, int fileFd, off_t offset, transferControl &control,
+										 const std::function<void(const byte *, size_t)> &observe = nullptr) {
+	// initialize the local buffer
+	netbuffer localNetbuff;
+	uint64_t received = 0;
+	// try to get data and write to file while we can
+	while (not control.stopped() and fillBuffer(sock, localNetbuff) != 0) {
+		// write the block straight from the buffer to the file
+		for (size_t written = 0; written < localNetbuff.buffer.size(); ) {
+			const ssize_t writeResult = ::pwrite(fileFd, localNetbuff.buffer.data() + written,
+												 localNetbuff.buffer.size() - written, offset);
+			if (writeResult < 0 and errno == EINTR)
+				continue;
+			if (writeResult <= 0)
+				return {TRANSFER_ERROR, received};
+			written += writeResult;
+			offset += writeResult;
+			received += writeResult;
+		}
+		if (observe)
+			observe(localNetbuff.buffer.data(), localNetbuff.buffer.size());
+		control.add(localNetbuff.buffer.size());
+		localNetbuff.buffer.clear();
+	}
+	if (control.stopped())
+		return {TRANSFER_ERROR, received};
+	return {TRANSFER_DONE, received};
+}
+
+
+// copy size bytes waiting in the pipe to the file at offset with read and pwrite, offset moves past them
+inline bool drainPipe(int pipeFd, int fileFd, off_t &offset, size_t size) {
+	dataT buffer(std::min<size_t>(size, BUFSIZE));
+	while (size > 0) {
+		const ssize_t numRead = ::read(pipeFd, buffer.data(), std::min(size, buffer.size()));
+		if (numRead < 0 and errno == EINTR)
+			continue;
+		if (numRead <= 0)
+			return false;
+		for (ssize_t written = 0; written < numRead; ) {
+			const ssize_t writeResult = ::pwrite(fileFd, buffer.data() + written, numRead - written, offset);
+			if (writeResult < 0 and errno == EINTR)
+				continue;
+			if (writeResult <= 0)
+				return false;
+			written += writeResult;
+			offset += writeResult;
+		}
+		size -= numRead;
+	}
+	return true;
+}
+
+// zero-copy receive of the data from the socket into the file at offset until the peer closes the connection
+// the data moves socket -> pipe -> file without ever being copied to user space
+const transferResult receiveFile(sockpp::stream_socket &sock, int fileFd, off_t offset, transferControl &control) {
+	int pipeFds[2];
+	if (::pipe2(pipeFds, O_CLOEXEC) < 0)
+		return {TRANSFER_UNSUPPORTED, 0};
+	const uniqueFd pipeRead(pipeFds[0]), pipeWrite(pipeFds[1]);
+	// bigger pipe means fewer splice calls, if we can't resize it the default size still works
+	::fcntl(pipeWrite.get(), F_SETPIPE_SZ, splicePipeSize);
+	uint64_t received = 0;
+	while (true) {
+		if (control.stopped())
+			return {TRANSFER_ERROR, received};
+		const ssize_t inPipe = ::splice(sock.handle(), nullptr, pipeWrite.get(), nullptr, control.chunk(splicePipeSize),
+										SPLICE_F_MOVE | SPLICE_F_MORE);
+		// the peer closed the connection, the whole file has been received
+		if (inPipe == 0)
+			return {TRANSFER_DONE, received};
+		if (inPipe < 0) {
+			if (errno == EINTR)
+				continue;
+			if (received == 0 and (errno == EINVAL or errno == ENOSYS or errno == EOPNOTSUPP))
+				return {TRANSFER_UNSUPPORTED, 0};
+			return {TRANSFER_ERROR, received};
+		}
+		// drain everything we moved into the pipe to the file
+		ssize_t leftInPipe = inPipe;
+		while (leftInPipe > 0) {
+			const ssize_t written = ::splice(pipeRead.get(), nullptr, fileFd, &offset, leftInPipe, SPLICE_F_MOVE);
+			if (written < 0 and errno == EINTR)
+				continue;
+			// the filesystem can't take a splice, but the data already left the socket,
+			// so it is copied out of the pipe and the rest of the upload goes the buffered way
+			if (written < 0 and (errno == EINVAL or errno == ENOSYS or errno == EOPNOTSUPP)) {
+				if (not drainPipe(pipeRead.get(), fileFd, offset, leftInPipe))
+					return {TRANSFER_ERROR, received};
+				received += leftInPipe;
+				control.add(inPipe);
+				const transferResult rest = receiveFileBuffered(sock, fileFd, offset, control);
+				return {rest.first, received + rest.second};
+			}
+			if (written <= 0)
+				return {TRANSFER_ERROR, received};
+			leftInPipe -= written;
+			received += written;
+		}
+		control.add(inPipe);
+	}
+}
+
 #endif //CPP_FTP_FTPTRANSFER_H
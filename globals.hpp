@@ -2,8 +2,12 @@
 #define CPP_FTP_GLOBALS_HPP
 
 #include <sockpp/socket.h>
+#include <chrono>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 #include <utility>
+#include <vector>
 
 // server version
 const std::string serverVersion("v0.1");
@@ -19,6 +23,89 @@ const std::string defaultWorkdir = "myftpserver";
 // the default size of a buffer
 // large so that the reads are fast
 const uint32_t BUFSIZE = (1 << 16);
+// number of threads running command handlers in reactor mode
+const uint32_t defaultReactorThreads = 4;
+// max number of epoll events a reactor thread takes at once
+const uint32_t reactorMaxEvents = 64;
+// max number of accepted connections waiting for a free worker
+const uint32_t defaultSessionQueue = 64;
+// preformatted replies for connections rejected by admission control
+const std::string serverBusyReply = "421 Server is busy, try again later" + CRLF;
+const std::string tooManySessionsReply = "421 Too many sessions, try again later" + CRLF;
+const std::string tooManyFromIpReply = "421 Too many sessions from your address, try again later" + CRLF;
+// max number of bytes handed to a single sendfile call
+const size_t sendfileChunk = (1 << 21);
+// size of the pipe which carries spliced data from a socket to a file
+const int splicePipeSize = (1 << 20);
+// default engine for moving file data over the data connections
+const std::string defaultEngine = "sendfile";
+// size of the io_uring submission queue used by the transfer engine
+const uint32_t uringEntries = 256;
+// number of BUFSIZE buffers registered with io_uring, also the max number of transfers running at once
+const uint32_t uringBuffers = 64;
+// how often the logger writes and flushes the collected records
+const uint32_t defaultLogFlushMs = 100;
+// number of records the logger ring holds, must be a power of two
+const size_t logRingSlots = (1 << 13);
+// max length of a single log record, longer records are truncated
+const size_t logRecordSize = 512;
+// initial size of the buffer which collects the replies of pipelined commands
+const size_t replyStagingSize = (1 << 12);
+// max number of pieces sent with one writev on the control connection
+const size_t replyIovecs = 64;
+// default memory for the cached directory listings in megabytes
+const uint32_t defaultListCacheMb = 64;
+// size of the buffer for one getdents64 batch of directory entries
+const size_t direntBatchSize = (1 << 17);
+// max length of one formatted listing line, names are at most 255 bytes
+const size_t listingLineSize = 512;
+// number of recently used directory fds each session keeps for resolving paths
+const size_t resolverCacheSize = 8;
+// how long a cached directory fd is used before the path is resolved again
+const std::chrono::milliseconds resolverCacheTtl(1000);
+// listen queue of the control port, a burst of new sessions waits in it while the accept loop catches up
+// the kernel caps it at net.core.somaxconn
+const int controlListenQueue = 1024;
+// listen queue of every listener in the passive port pool
+const int pasvListenQueue = 64;
+// how long the control acceptor and the passive listeners stop accepting after accept ran out of fds or buffers
+const std::chrono::milliseconds acceptBackoff(100);
+// how long a transfer waits for the client to connect to its passive port
+const std::chrono::milliseconds pasvAcceptTimeout(60000);
+// how long a transfer waits for the connection to the address given with PORT
+const std::chrono::milliseconds portConnectTimeout(60000);
+// default zlib level of the deflate stage in MODE Z, level 1 saves most of what higher levels do for a fraction of the CPU
+const int defaultDeflateLevel = 1;
+// size of each of the samples which decide if a file is already compressed
+const size_t entropySampleSize = 4096;
+// bits of entropy per byte above which the data counts as compressed and is sent with level 0
+const double compressedEntropyBits = 7.5;
+// default max number of data connections one SEGR download may use
+const uint32_t defaultMaxSegments = 8;
+// size of the header in front of every SEGR segment, the offset and the length as 64 bit big-endian numbers
+const size_t segmentHeaderSize = 16;
+// how long a file uploaded in ranges is remembered after its last range, its .part file is kept after that
+const std::chrono::minutes uploadIdleTimeout(10);
+// size of the reads which feed the hash of a file
+const size_t hashReadSize = (1 << 20);
+// default memory for the mapped hot files in megabytes
+const uint32_t defaultHotCacheMb = 256;
+// number of downloads after which a file is mapped by the hot file cache
+const uint32_t hotFileThreshold = 3;
+// max number of files whose downloads are counted before they become hot
+const size_t hotFileCandidates = 4096;
+// data a full token bucket lets through at once, as the time it takes at the limited rate
+const std::chrono::milliseconds rateBurst(100);
+// smallest chunk a throttled transfer moves at once
+const size_t rateMinChunk = 4096;
+// number of shards the metrics are recorded into, the threads are spread over them
+const size_t metricShards = 8;
+// max number of verbs with their own latency histograms
+const size_t metricVerbs = 64;
+// listen queue, max size and read timeout of the requests of the metrics endpoint
+const int metricsListenQueue = 16;
+const size_t metricsRequestSize = 8192;
+const std::chrono::seconds metricsRequestTimeout(2);
 // data type for sending bytes
 typedef std::vector<unsigned char> dataT;
 // ftp LIST -a . and ..
@@ -28,8 +115,22 @@ const dataT listVerboseData(listVerbose.begin(), listVerbose.end());
 typedef std::unordered_map<std::string, std::string> stringHashMap;
 // byte type
 typedef unsigned char byte;
-// type of return string from command
-typedef std::pair<int, std::string> response;
+// reply of a command handler
+// fixed replies only point to the string literal or to a string owned by the session, so they don't allocate,
+// replies built at runtime own their text, code 0 means that the reply is sent later by the transfer
+struct response {
+	int code;
+	std::string_view view;
+	std::string owned;
+
+	response(int code_t, const char *literal_t) : code(code_t), view(literal_t) {}
+	response(int code_t, std::string_view view_t) : code(code_t), view(view_t) {}
+	response(int code_t, std::string owned_t) : code(code_t), owned(std::move(owned_t)) {}
+
+	const std::string_view text() const {
+		return owned.empty() ? view : std::string_view(owned);
+	}
+};
 
 // help command answers for available commands
 std::vector<std::pair<std::string, std::string>> commandHelp = {
@@ -39,7 +140,8 @@ std::vector<std::pair<std::string, std::string>> commandHelp = {
 	{"REIN", "Logs out the user, you can login with a different user"},
 	{"QUIT", "Stops the control connection, disconnecting you from the server"},
 	{"TYPE [TYPE]", "Specifies the type of data for transfer. Available: A - Ascii, I - Binary data. Doesn't matter, TYPE command is obsolete"},
-	{"MODE [MODE]", "Specifies the mode of data transfer. Available: S - stream (simply sends data to the data connection and then closes)"},
+	{"MODE [MODE]", "Specifies the mode of data transfer. Available: S - stream (simply sends data to the data connection and then closes), B - block (files are framed in blocks and the data connection stays open for the next transfer), Z - deflate (the data is sent as a zlib stream)"},
+	{"OPTS MODE Z LEVEL [LEVEL]", "Sets the compression level (0-9) of MODE Z for the session"},
 	{"STRU [STRUCTURE]", "Specifies the structure of data transfer. Available: F - file (no structure). Obsolete command, but required by standard."},
 	{"SYST", "Returns the system on which the FTP server is running"},
 	{"PASV", "Initializes passive connection and returns the ip and port. You shouldn't use the returned IP and should instead use the main servers's IP address for data connections."},
@@ -49,9 +151,34 @@ std::vector<std::pair<std::string, std::string>> commandHelp = {
 	{"CDUP", "Tries to change current directory to parent directory"},
 	{"MKD [PATH]", "Makes directory (and all intermediate and non-existent directories)"},
 	{"LIST [PATH/-a/-al]", "Tries to list the directories contents on PATH (or current directory if path not specified) to the data connection. If -a or -al is specified instead of path, the LIST command also lists hidden files."},
+	{"ALLO [SIZE]", "Announces the size of the next stored file so the server can reserve space for it. After OPTS RANGE ON, ALLO followed by REST and STOR uploads one range of the file, sessions can upload the ranges in parallel"},
 	{"STOR [FILENAME]", "Tries to receive data from the data connection and stores them to the specified file/path"},
 	{"RETR [FILENAME]", "Tries to send requested file to data connection"},
+	{"SEGR [COUNT] [PATH]", "Sends the file over COUNT data connections at once, each one starts with the 8 byte big-endian offset and length of its segment"},
+	{"REST [OFFSET]", "Sets the byte offset at which the following RETR or STOR starts, for resuming transfers"},
+	{"SIZE [PATH]", "Returns the size of the file in bytes"},
+	{"FEAT", "Lists the extensions supported by the server"},
+	{"MLSD [PATH]", "Sends the machine readable listing of the directory (RFC 3659) to the data connection"},
+	{"MLST [PATH]", "Returns the machine readable facts of the file or directory (RFC 3659)"},
+	{"ABOR", "Aborts the running transfer and closes its data connection"},
+	{"HASH [PATH]", "Returns the hash of the file with the algorithm selected by OPTS HASH (default is SHA-256)"},
+	{"OPTS RANGE [ON/OFF]", "Turns range uploads with ALLO, REST and STOR on or off for the session, off by default so they resume files"},
+	{"OPTS HASH [ALGORITHM]", "Selects the algorithm of HASH: CRC32, CRC32C, MD5, SHA-1, SHA-256 or SHA-512, without an argument shows the selected one"},
+	{"XCRC [PATH]", "Returns the CRC32 of the file"},
+	{"XMD5 [PATH]", "Returns the MD5 hash of the file"},
+	{"XSHA256 [PATH]", "Returns the SHA-256 hash of the file"},
+	{"SITE STATS", "Prints the server statistics: sessions, replies, latency of the commands and the transfers by verb"},
+	{"SITE RATE [GLOBAL/USER NAME/SESSION] [KIB/S]", "Shows the bandwidth limits of the session, or changes one of them. 0 is unlimited, only the admin user can change the GLOBAL and USER limits or raise SESSION above the limit sessions start with"},
+	{"STAT", "Shows the progress of the running transfer or the state of the session"},
 	{"NOOP", "No operation, just to test connection"}
 };
 
+// extensions listed by the FEAT command
+std::vector<std::string> featureList = {
+	"REST STREAM",
+	"SIZE",
+	"MLST type*;size*;modify*;perm*;",
+	"MODE Z"
+};
+
 #endif //CPP_FTP_GLOBALS_HPP
@@ -0,0 +1,157 @@
+#ifndef CPP_FTP_HOTFILECACHE_HPP
+#define CPP_FTP_HOTFILECACHE_HPP
+
+#include <sockpp/tcp_socket.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include "globals.hpp"
+#include "utils.hpp"
+#include "ftptransfer.h"
+
+// server-wide cache of the files downloaded most often
+// a file requested hotFileThreshold times is opened and mapped once, and every following RETR of it
+// is served from the shared fd and mapping, without opening the file again
+// the mapping is advised sequential and prefetched, so the pages stay warm for the next downloads
+// an entry is checked against the inode, modification and change time and size of the path on every hit,
+// so a file which was changed or replaced is mapped again instead of being served stale
+// and a file whose permissions were taken away is opened through the resolver again, which refuses it
+class hotFileCache {
+public:
+	// one mapped file, shared by the transfers sending it, so eviction never unmaps a file in use
+	struct hotFile {
+		uniqueFd fd;
+		const byte *data = nullptr;
+		struct stat fileStat {};
+
+		hotFile() = default;
+		hotFile(const hotFile &) = delete;
+		hotFile &operator=(const hotFile &) = delete;
+		~hotFile() {
+			if (data)
+				::munmap(const_cast<byte *>(data), fileStat.st_size);
+		}
+	};
+	typedef std::shared_ptr<const hotFile> fileT;
+
+	std::atomic<uint64_t> hits {0}, misses {0}, invalidations {0};
+
+	explicit hotFileCache(size_t maxBytes_t) : maxBytes(maxBytes_t) {}
+
+	// mapped file at the path relative to rootFd, nullptr if the file isn't hot (yet)
+	// open is called to open the file once it becomes hot and has to give an fd opened for reading
+	template<typename openFunction>
+	fileT get(int rootFd, const std::string &path, openFunction open) {
+		std::unique_lock<std::mutex> lock(mutex);
+		const auto found = entries.find(path);
+		if (found != entries.end()) {
+			// the path is only checked with stat, the fd we keep is the file which was opened through the resolver
+			struct stat pathStat {};
+			if (::fstatat(rootFd, path.c_str(), &pathStat, 0) == 0 and sameFile(pathStat, found->second.file->fileStat)) {
+				hits.fetch_add(1, std::memory_order_relaxed);
+				found->second.lastUse = ++useClock;
+				return found->second.file;
+			}
+			usedBytes -= found->second.file->fileStat.st_size;
+			entries.erase(found);
+			invalidations.fetch_add(1, std::memory_order_relaxed);
+		}
+		misses.fetch_add(1, std::memory_order_relaxed);
+		// the counters are only a hint, so they are simply forgotten once there are too many of them
+		if (requests.size() >= hotFileCandidates)
+			requests.clear();
+		if (++requests[path] < hotFileThreshold)
+			return nullptr;
+		requests.erase(path);
+		lock.unlock();
+
+		fileT file = mapFile(open());
+		if (not file)
+			return nullptr;
+		lock.lock();
+		// another session could have mapped the file meanwhile
+		if (entries.count(path))
+			return file;
+		while (usedBytes + file->fileStat.st_size > maxBytes)
+			evictOldest();
+		entries[path] = {file, ++useClock};
+		usedBytes += file->fileStat.st_size;
+		return file;
+	}
+
+private:
+	struct cacheEntry {
+		fileT file;
+		uint64_t lastUse;
+	};
+
+	const size_t maxBytes;
+	std::mutex mutex;
+	std::unordered_map<std::string, cacheEntry> entries;
+	// number of requests of the files which aren't mapped yet
+	std::unordered_map<std::string, uint32_t> requests;
+	size_t usedBytes = 0;
+	uint64_t useClock = 0;
+
+	static bool sameFile(const struct stat &first, const struct stat &second) {
+		return first.st_dev == second.st_dev and first.st_ino == second.st_ino and first.st_size == second.st_size and
+			   first.st_mtim.tv_sec == second.st_mtim.tv_sec and first.st_mtim.tv_nsec == second.st_mtim.tv_nsec and
+			   first.st_ctim.tv_sec == second.st_ctim.tv_sec and first.st_ctim.tv_nsec == second.st_ctim.tv_nsec;
+	}
+
+	// map the whole regular file and start reading it in, empty files aren't worth a mapping
+	// files bigger than the whole cache are refused before they are mapped, so they are never prefetched
+	fileT mapFile(uniqueFd fd) const {
+		auto file = std::make_shared<hotFile>();
+		if (not fd or ::fstat(fd.get(), &file->fileStat) < 0 or not S_ISREG(file->fileStat.st_mode) or
+			file->fileStat.st_size == 0 or size_t(file->fileStat.st_size) > maxBytes)
+			return nullptr;
+		void *data = ::mmap(nullptr, file->fileStat.st_size, PROT_READ, MAP_SHARED, fd.get(), 0);
+		if (data == MAP_FAILED)
+			return nullptr;
+		::madvise(data, file->fileStat.st_size, MADV_SEQUENTIAL);
+		::madvise(data, file->fileStat.st_size, MADV_WILLNEED);
+		file->data = static_cast<const byte *>(data);
+		file->fd = std::move(fd);
+		return file;
+	}
+
+	// drop the least recently used file, called with the mutex locked
+	// transfers still sending it keep the mapping until they are done
+	void evictOldest() {
+		auto oldest = entries.begin();
+		for (auto entry = entries.begin(); entry != entries.end(); entry++)
+			if (entry->second.lastUse < oldest->second.lastUse)
+				oldest = entry;
+		usedBytes -= oldest->second.file->fileStat.st_size;
+		entries.erase(oldest);
+	}
+};
+
+// send the mapped file from offset, the data goes to the socket straight from the mapping
+// the mapping is only handed to the kernel, so a file truncated meanwhile fails the write with EFAULT instead of SIGBUS
+const transferResult sendMapped(sockpp::stream_socket &sock, const hotFileCache::hotFile &file, off_t offset,
+								transferControl &control) {
+	uint64_t sentTotal = 0;
+	while (offset < file.fileStat.st_size) {
+		if (control.stopped())
+			return {TRANSFER_ERROR, sentTotal};
+		const size_t part = std::min<uint64_t>(control.chunk(sendfileChunk), file.fileStat.st_size - offset);
+		const ssize_t sent = sock.write_n(file.data + offset, part);
+		if (sent < ssize_t(part))
+			return {TRANSFER_ERROR, sentTotal + std::max<ssize_t>(sent, 0)};
+		offset += sent;
+		sentTotal += sent;
+		control.add(sent);
+	}
+	return {TRANSFER_DONE, sentTotal};
+}
+
+#endif //CPP_FTP_HOTFILECACHE_HPP
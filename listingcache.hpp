@@ -0,0 +1,209 @@
+#ifndef CPP_FTP_LISTINGCACHE_HPP
+#define CPP_FTP_LISTINGCACHE_HPP
+
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <atomic>
+#include <cerrno>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include "globals.hpp"
+
+// server-wide cache of formatted directory listings
+// a listing is kept as the exact bytes sent over the data connection, so a repeated LIST is a single send
+// every cached directory has an inotify watch, any change in it drops the cached listing
+// the watch is added before the listing is built and every change bumps the generation of the watch,
+// so a listing which raced with a change is never stored
+// a watch is removed again as soon as no cached listing and no listing being built uses it,
+// so directories which are listed once don't hold on to the inotify watches of the user
+class listingCache {
+public:
+	typedef std::shared_ptr<const dataT> listingT;
+
+	std::atomic<uint64_t> hits {0}, misses {0}, invalidations {0};
+
+	explicit listingCache(size_t maxBytes_t) : maxBytes(maxBytes_t) {
+		inotifyFd = inotify_init1(IN_CLOEXEC);
+		if (inotifyFd < 0)
+			return;
+		watcher = std::thread(&listingCache::watch, this);
+	}
+
+	// the cache lives for the whole server lifetime, so the watcher thread is simply detached
+	~listingCache() {
+		if (watcher.joinable())
+			watcher.detach();
+	}
+
+	// check if inotify is available
+	explicit operator bool() const {
+		return inotifyFd >= 0;
+	}
+
+	// listing of the directory identified by key, on a miss it is built with build() and stored if nothing changed meanwhile
+	// watchPath is where inotify finds the directory, build can throw, then nothing is stored and the exception goes to the caller
+	template<typename buildFunction>
+	listingT get(const std::string &dir, const char *watchPath, buildFunction build) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			const auto found = entries.find(dir);
+			if (found != entries.end()) {
+				hits.fetch_add(1, std::memory_order_relaxed);
+				found->second.lastUse = ++useClock;
+				return found->second.listing;
+			}
+		}
+		misses.fetch_add(1, std::memory_order_relaxed);
+		const int wd = inotify_add_watch(inotifyFd, watchPath, watchMask);
+		// out of watches or not a directory, such a listing simply isn't cached
+		if (wd < 0)
+			return std::make_shared<const dataT>(build());
+		uint64_t generation;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			watchState &state = watches[wd];
+			state.dir = dir;
+			state.builders++;
+			generation = state.generation;
+		}
+		listingT listing;
+		try {
+			listing = std::make_shared<const dataT>(build());
+		} catch (...) {
+			std::lock_guard<std::mutex> lock(mutex);
+			finishBuild(wd);
+			throw;
+		}
+		std::lock_guard<std::mutex> lock(mutex);
+		const auto state = watches.find(wd);
+		if (state == watches.end() or state->second.generation != generation or listing->size() > maxBytes) {
+			finishBuild(wd);
+			return listing;
+		}
+		state->second.builders--;
+		// another session could have stored the same directory meanwhile
+		const auto previous = entries.find(dir);
+		if (previous != entries.end())
+			removeEntry(previous);
+		while (usedBytes + listing->size() > maxBytes)
+			evictOldest();
+		entries[dir] = {listing, wd, ++useClock};
+		usedBytes += listing->size();
+		watches[wd].entries++;
+		return listing;
+	}
+
+private:
+	// everything which can change a line of the listing: entries added, removed or renamed, sizes and permissions
+	static constexpr uint32_t watchMask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY | IN_ATTRIB |
+										  IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+
+	struct cacheEntry {
+		listingT listing;
+		int wd;
+		uint64_t lastUse;
+	};
+
+	struct watchState {
+		std::string dir;
+		uint64_t generation = 0;
+		// cached listings and listings being built which rely on the watch
+		uint32_t entries = 0, builders = 0;
+	};
+
+	const size_t maxBytes;
+	int inotifyFd = -1;
+	std::thread watcher;
+	std::mutex mutex;
+	std::unordered_map<std::string, cacheEntry> entries;
+	std::unordered_map<int, watchState> watches;
+	size_t usedBytes = 0;
+	uint64_t useClock = 0;
+
+	// remove the watch if nothing relies on it anymore, called with the mutex locked
+	void releaseWatch(int wd) {
+		const auto state = watches.find(wd);
+		if (state == watches.end() or state->second.entries != 0 or state->second.builders != 0)
+			return;
+		inotify_rm_watch(inotifyFd, wd);
+		watches.erase(state);
+	}
+
+	// a listing built under the watch wasn't stored, called with the mutex locked
+	void finishBuild(int wd) {
+		const auto state = watches.find(wd);
+		if (state == watches.end())
+			return;
+		state->second.builders--;
+		releaseWatch(wd);
+	}
+
+	// drop a cached listing and its watch if nothing else uses it, called with the mutex locked
+	void removeEntry(std::unordered_map<std::string, cacheEntry>::iterator entry) {
+		const int wd = entry->second.wd;
+		usedBytes -= entry->second.listing->size();
+		entries.erase(entry);
+		const auto state = watches.find(wd);
+		if (state == watches.end())
+			return;
+		state->second.entries--;
+		releaseWatch(wd);
+	}
+
+	// drop the least recently used listing, called with the mutex locked
+	void evictOldest() {
+		auto oldest = entries.begin();
+		for (auto entry = entries.begin(); entry != entries.end(); entry++)
+			if (entry->second.lastUse < oldest->second.lastUse)
+				oldest = entry;
+		removeEntry(oldest);
+	}
+
+	// drop the listing watched by wd, called with the mutex locked
+	void invalidate(int wd) {
+		const auto state = watches.find(wd);
+		if (state == watches.end())
+			return;
+		state->second.generation++;
+		const auto entry = entries.find(state->second.dir);
+		if (entry != entries.end() and entry->second.wd == wd) {
+			removeEntry(entry);
+			invalidations.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+
+	// main loop of the watcher thread, reads inotify events and drops the listings of changed directories
+	void watch() {
+		alignas(inotify_event) char events[1 << 16];
+		while (true) {
+			const ssize_t length = ::read(inotifyFd, events, sizeof(events));
+			if (length < 0 and errno == EINTR)
+				continue;
+			if (length <= 0)
+				return;
+			std::lock_guard<std::mutex> lock(mutex);
+			for (char *position = events; position < events + length; ) {
+				const inotify_event *event = reinterpret_cast<const inotify_event *>(position);
+				position += sizeof(inotify_event) + event->len;
+				// the kernel dropped events, so anything could have changed
+				if (event->mask & IN_Q_OVERFLOW) {
+					for (auto &state: watches)
+						state.second.generation++;
+					invalidations.fetch_add(entries.size(), std::memory_order_relaxed);
+					while (not entries.empty())
+						removeEntry(entries.begin());
+					continue;
+				}
+				invalidate(event->wd);
+				// the watch is gone (directory removed or the watch released)
+				if (event->mask & IN_IGNORED)
+					watches.erase(event->wd);
+			}
+		}
+	}
+};
+
+#endif //CPP_FTP_LISTINGCACHE_HPP
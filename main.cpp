@@ -20,65 +20,92 @@
 // header with the main ftp structure and functions related to sending data over ftp and handling ftp commands
 // rfc 959 compliant
 #include "ftp.hpp"
+// header with the epoll reactor which multiplexes control connections over a fixed set of threads
+#include "reactor.hpp"
+// header with admission control and the bounded pool of session threads
+#include "sessionpool.hpp"
 
 // all available commands for the ftp server
-// command - function map
-// so when we receive a command we just call it from this map
-const std::unordered_map<std::string,
-                   std::function<response(FTP&, const std::string)>>
-                   funcMap = {{"USER", userFTP}, {"PASS", passFTP}, {"REIN", reinFTP}, {"QUIT", quitFTP},
-							  {"TYPE", typeFTP}, {"MODE", modeFTP}, {"STRU", struFTP}, {"SYST", systFTP},
-							  {"PASV", pasvFTP}, {"PORT", portFTP}, {"HELP", helpFTP}, {"NOOP", noopFTP},
-							  {"PWD", pwdFTP}, {"CWD", cwdFTP}, {"CDUP", cdupFTP}, {"MKD", mkdFTP}, {"LIST", listFTP},
-							  {"STOR", storFTP}, {"RETR", retrFTP}};
-
-
-void runFtpPI(stringHashMap users_t, sockpp::tcp_socket sock, sockpp::inet_address peer, fs::path workdir, loggerT& logger) {
-	FTP ftp(users_t, std::move(sock), peer, workdir, logger);
+// command verb - function table
+// the table is a perfect hash built at compile time, so when we receive a command we just call it from this table
+typedef const response (*commandHandler)(FTP&, std::string_view);
+constexpr commandEntry<commandHandler> commandList[] = {
+	{verbKey("USER"), userFTP}, {verbKey("PASS"), passFTP}, {verbKey("REIN"), reinFTP}, {verbKey("QUIT"), quitFTP},
+	{verbKey("TYPE"), typeFTP}, {verbKey("MODE"), modeFTP}, {verbKey("STRU"), struFTP}, {verbKey("SYST"), systFTP},
+	{verbKey("PASV"), pasvFTP}, {verbKey("PORT"), portFTP}, {verbKey("HELP"), helpFTP}, {verbKey("NOOP"), noopFTP},
+	{verbKey("PWD"), pwdFTP}, {verbKey("CWD"), cwdFTP}, {verbKey("CDUP"), cdupFTP}, {verbKey("MKD"), mkdFTP},
+	{verbKey("LIST"), listFTP}, {verbKey("STOR"), storFTP}, {verbKey("RETR"), retrFTP}, {verbKey("ALLO"), alloFTP},
+	{verbKey("REST"), restFTP}, {verbKey("SIZE"), sizeFTP}, {verbKey("FEAT"), featFTP}, {verbKey("MLSD"), mlsdFTP},
+	{verbKey("MLST"), mlstFTP}, {verbKey("ABOR"), aborFTP}, {verbKey("STAT"), statFTP},
+	{verbKey("OPTS"), optsFTP}, {verbKey("SEGR"), segrFTP}, {verbKey("HASH"), hashFTP}, {verbKey("XCRC"), xcrcFTP},
+	{verbKey("XMD5"), xmd5FTP}, {verbKey("XSHA256"), xsha256FTP}, {verbKey("SITE"), siteFTP}};
+constexpr commandTable<commandHandler, std::size(commandList)> commandDispatch(commandList);
+
+
+// handles one received command line
+// shared between the thread-per-connection mode and the reactor
+// returns false if the control connection has to be closed
+bool processCommand(FTP &ftp, std::string_view buf) {
+	// if an error happened during reading
+	if (buf.empty()) {
+		queueReply(ftp, 500, "Invalid command (too long or can't read command)");
+		return true;
+	}
+	buf = skipTelnetSignals(buf);
+	// non ascii printable characters in command
+	if (std::find_if(buf.begin(), buf.end(), [&](byte val){ return val < 0x20 or val > 0x7f; }) != buf.end()) {
+		queueReply(ftp, 500, "Invalid chars in command");
+		return true;
+	}
+	// if we need to just quit right now, then lets just break the loop
+	if (buf == "XQUITNOW") {
+		shutdownError(ftp, "Bad error during trying to receive command");
+		return false;
+	}
+	// the verb and the params are views into the line, nothing is copied
+	const auto [verb, params] = getNextParam(buf);
+	const uint64_t command = verbKey(verb);
+	// while a transfer is running only a few commands are answered right away, other commands wait for it to end
+	// the reactor never gets here with a transfer running, it keeps such commands buffered until the transfer is done
+	if (not answeredDuringTransfer(command))
+		ftp.transfer.wait();
+
+	// find the corresponding function in the table
+	const commandHandler commandFunction = commandDispatch.find(command);
+	// check if we received an invalid command
+	if (commandFunction == nullptr) {
+		ftp.server.metrics.unknownCommands++;
+		queueReply(ftp, 502, "Command unknown or not implemented");
+		ftp.prevCommand = command;
+		return true;
+	}
+	// execute the command, the time spent in the handler goes into the latency histogram of the verb
+	const auto started = std::chrono::steady_clock::now();
+	const response reply = commandFunction(ftp, params);
+	ftp.server.metrics.recordCommand(command, std::chrono::steady_clock::now() - started);
+	ftp.prevCommand = command;
+	// queue the reply, it is sent together with the replies of the other commands in the batch
+	// transfers send their reply themselves once they are done
+	if (reply.code != 0)
+		queueReply(ftp, reply.code, reply.text());
+	return true;
+}
+
+void runFtpPI(stringHashMap users_t, sockpp::tcp_socket sock, sockpp::inet_address peer, fs::path workdir, loggerT& logger,
+			  serverContext &server) {
+	FTP ftp(users_t, std::move(sock), peer, workdir, logger, server);
 	// send 220 code since we are ready for working
 	sendReply(ftp, 220, "Ready for service, waiting for authorization. HELP command lists available commands");
 
 	// wait for commands from user
+	// the replies are flushed only when every pipelined command in the buffer has been processed
 	do {
-		const dataT buf = readline(ftp.controlSock, ftp.ftpBuf);
-		// if an error happened during reading
-		if (buf.empty()) {
-			sendReply(ftp, 500, "Invalid command (too long or can't read command)");
-			continue;
-		}
-		// non ascii printable characters in command
-		if (std::find_if(buf.begin(), buf.end(), [&](byte val){ return val < 0x20 or val > 0x7f; }) != buf.end()) {
-			sendReply(ftp, 500, "Invalid chars in command");
-			continue;
-		}
-		// convert safe buffer to string
-		std::string cmdString(buf.begin(), buf.end());
-		auto [command, params] = getNextParam(cmdString);
-		// convert the string to uppercase
-		std::transform(command.begin(), command.end(), command.begin(), toupper);
-
-		// if we need to just quit right now, then lets just break the loop
-		// first check is just an optimization
-		if (command[0] == 'X' and command == "XQUITNOW") {
-			shutdownError(ftp, "Bad error during trying to receive command");
+		const std::string_view buf = readline(ftp.controlSock, ftp.ftpBuf, [&]() { flushReplies(ftp); });
+		if (not processCommand(ftp, buf))
 			break;
-		}
-
-		// find the corresponding function in the hashmap
-		auto commandFunction = funcMap.find(command);
-		// check if we received an invalid command
-		if (commandFunction == funcMap.end()) {
-			sendReply(ftp, 502, "Command unknown or not implemented");
-			ftp.prevCommand = command;
-			continue;
-		}
-		// execute the command
-		auto [responseCode, responseString] = commandFunction->second(ftp, params);
-		ftp.prevCommand = command;
-		// send the reply
-		sendReply(ftp, responseCode, responseString);
-
 	} while (ftp.controlSock.is_open() and ftp.active);
+	flushReplies(ftp);
+	logReplyStats(ftp);
 }
 
 
@@ -88,17 +115,17 @@ int main(int argc, char* argv[]) {
 	std::cout << "Baseline FTP server " << serverVersion << std::endl;
 
 	// parse the arguments
-	const auto [serverPort, logFileName, dirPath, needToClose] = parseArgs(argc, const_cast<const char **>(argv));
+	const serverOptions options = parseArgs(argc, const_cast<const char **>(argv));
 
-	if (needToClose)
+	if (options.needToClose)
 		return 0;
 
 	// create the logger
-	loggerT logger = loggerT(logFileName);
+	loggerT logger(options.logFileName, options.logFlushMs);
 
 	// sockpp-based ftp server
-	logger << "Listening on port " << serverPort << ENDL;
-	sockpp::tcp_acceptor ftpServer(serverPort);
+	logger << "Listening on port " << options.port << ENDL;
+	sockpp::tcp_acceptor ftpServer(options.port, controlListenQueue);
 
 	// couldn't create the server for some reason, have to quit
 	if (not ftpServer) {
@@ -107,22 +134,37 @@ int main(int argc, char* argv[]) {
 	}
 
 	// get the list of valid users
+	// a line can end with the bandwidth limit of the user in KiB/s, username:password limit=KIB/S
+	// the limit is a separate word, so passwords with ':' and digits in them keep working
+	std::unordered_map<std::string, uint64_t> userRates;
 	const stringHashMap users = [&]() -> stringHashMap {
 		std::ifstream userFile(defaultUserFile);
 		// no file with usernames and passwords
 		if (not userFile.is_open()) {
 			std::cerr << "ERROR! no user file \"" << defaultUserFile << "\" with the list of valid users and passwords." <<
 						 std::endl << "Put this file in the same folder as the executable." << std::endl <<
-						 "The format is username:password." << std::endl;
+						 "The format is username:password, optionally followed by limit=KIB/S on the same line." << std::endl;
 			return {};
 		}
 		stringHashMap result;
+		std::string lastUser;
 		while (not userFile.eof()) {
 			std::string cur;
 			userFile >> cur;
+			// the rate limit of the user before it, a word of its own so that no password changes its meaning
+			static constexpr std::string_view limitPrefix = "limit=";
+			if (cur.compare(0, limitPrefix.size(), limitPrefix) == 0) {
+				uint64_t rate = 0;
+				if (lastUser.empty() or not parseRate(std::string_view(cur).substr(limitPrefix.size()), rate))
+					std::cerr << "Ignoring the invalid limit \"" << cur << "\" in \"" << defaultUserFile << "\"" << std::endl;
+				else
+					userRates[lastUser] = rate;
+				continue;
+			}
 			// location of ':' separator in string
 			auto location = cur.find(':');
-			result.insert({cur.substr(0, location), cur.substr(location + 1)});
+			lastUser = cur.substr(0, location);
+			result.insert({lastUser, cur.substr(location + 1)});
 		}
 		return result;
 	}();
@@ -134,7 +176,7 @@ int main(int argc, char* argv[]) {
 	}
 
 	// if the server root directory isn't created, make it
-	fs::path workDirectory(dirPath);
+	fs::path workDirectory(options.dirPath);
 	if (not fs::is_directory(workDirectory))
 		fs::create_directory(workDirectory);
 	workDirectory = fs::weakly_canonical(workDirectory);
@@ -142,6 +184,89 @@ int main(int argc, char* argv[]) {
 
 	logger << "Server root is at " << workDirectory.generic_string() << ENDL;
 
+	// server-wide state shared by the sessions
+	serverContext server;
+	// every path is resolved beneath this fd, so the sessions never use the path of the work directory itself
+	server.rootFd = uniqueFd(::open(workDirectory.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC));
+	if (not server.rootFd) {
+		std::cerr << "Can't open the server root " << workDirectory.generic_string() << ": " << std::strerror(errno) << std::endl;
+		return 1;
+	}
+	server.deflateLevel = options.deflateLevel;
+	server.maxSegments = options.maxSegments;
+	server.hashUploads = options.hashUploads;
+	server.rates.global.setRate(uint64_t(options.rateLimitKb) << 10);
+	server.rates.sessionRate = uint64_t(options.sessionRateKb) << 10;
+	for (const auto &[name, rate]: userRates)
+		server.rates.setUserRate(name, rate);
+	server.adminUser = options.adminUser;
+	if (options.engine == "uring") {
+		server.engine = ENGINE_URING;
+		server.uring = std::make_unique<uringEngine>();
+		// old kernels or seccomp policies don't allow io_uring, the sendfile engine works everywhere
+		if (not *server.uring) {
+			logger << "io_uring is not supported here (" << std::strerror(errno) << "), falling back to sendfile transfers" << ENDL;
+			server.engine = ENGINE_SENDFILE;
+			server.uring.reset();
+		}
+	} else if (options.engine == "blocking") {
+		server.engine = ENGINE_BLOCKING;
+	}
+	if (options.listCacheMb) {
+		server.listings = std::make_unique<listingCache>(size_t(options.listCacheMb) << 20);
+		if (not *server.listings) {
+			logger << "inotify is not available (" << std::strerror(errno) << "), directory listings won't be cached" << ENDL;
+			server.listings.reset();
+		}
+	}
+	if (options.hotCacheMb)
+		server.hotFiles = std::make_unique<hotFileCache>(size_t(options.hotCacheMb) << 20);
+	if (options.pasvPortMin) {
+		server.pasvPool = std::make_unique<passivePool>(options.pasvPortMin, options.pasvPortMax, options.maxSegments);
+		if (not *server.pasvPool) {
+			std::cerr << "Can't listen on any of the passive ports " << options.pasvPortMin << "-" << options.pasvPortMax << std::endl;
+			return 1;
+		}
+		logger << "Serving PASV from " << server.pasvPool->size() << " listeners on ports " << options.pasvPortMin << "-" <<
+			   options.pasvPortMax << ENDL;
+	}
+	// the metrics endpoint only listens on the loopback interface, it is meant for a local scraper or a tunnel
+	std::unique_ptr<metricsListener> metricsEndpoint;
+	if (options.metricsPort) {
+		metricsEndpoint = std::make_unique<metricsListener>(options.metricsPort, [&server]() { return metricsText(server); });
+		if (not *metricsEndpoint) {
+			std::cerr << "Can't serve the metrics on port " << options.metricsPort << ": " << metricsEndpoint->lastError() << std::endl;
+			return 1;
+		}
+		logger << "Serving the metrics on http://127.0.0.1:" << options.metricsPort << "/metrics" << ENDL;
+	}
+	logger << "Using the " << (server.engine == ENGINE_URING ? "uring" : server.engine == ENGINE_BLOCKING ? "blocking" : "sendfile") <<
+			  " engine for file transfers" << ENDL;
+
+	// limits on the number of active sessions, checked before anything is allocated for a connection
+	admissionControl admission(options.maxSessions, options.maxPerIp);
+
+	// in reactor mode all control connections are multiplexed over epoll and a fixed set of threads
+	std::unique_ptr<ftpReactor> reactor;
+	if (options.reactorMode) {
+		reactor = std::make_unique<ftpReactor>(users, workDirectory, logger, server, options.reactorThreads, processCommand);
+		if (not *reactor) {
+			std::cerr << "ERROR! couldn't create the epoll reactor: " << std::strerror(errno) << std::endl;
+			return 1;
+		}
+		logger << "Serving control connections from the reactor with " << options.reactorThreads << " threads" << ENDL;
+	}
+
+	// with workers set, sessions are served by a fixed pool of threads from a bounded queue
+	std::unique_ptr<sessionPool> pool;
+	if (not reactor and options.workers) {
+		pool = std::make_unique<sessionPool>(options.workers, options.sessionQueue,
+			[&](sockpp::tcp_socket sock, sockpp::inet_address peer) {
+				runFtpPI(users, std::move(sock), peer, workDirectory, logger, server);
+			});
+		logger << "Serving sessions from a pool of " << options.workers << " workers" << ENDL;
+	}
+
 	// try to execute the main loop of ftp server listener
 	try {
 		while (true) {
@@ -153,13 +278,38 @@ int main(int argc, char* argv[]) {
 			if (!sock) {
 				logger << "Error accepting incoming connection from" << peer.to_string() << ": " <<
 						  ftpServer.last_error_str() << ENDL;
+				// out of fds or buffers, accept would fail again right away, so give the sessions time to close some
+				const int error = ftpServer.last_error();
+				if (error == EMFILE or error == ENFILE or error == ENOBUFS or error == ENOMEM)
+					std::this_thread::sleep_for(acceptBackoff);
 			} else {
+				// check the limits first so that overload is rejected as cheaply as possible
+				const auto admitted = admission.admit(peer.address());
+				if (admitted != admissionControl::ADMITTED) {
+					logger << "Rejected a connection from " << peer.to_string() << ": session limit reached" << ENDL;
+					rejectConnection(sock, admitted == admissionControl::GLOBAL_LIMIT ? tooManySessionsReply : tooManyFromIpReply);
+					continue;
+				}
+				admissionTicket ticket(admission, peer.address());
 				logger << "Received a connection request from " << peer.to_string() << ENDL;
+				if (reactor) {
+					reactor->addSession(std::move(sock), peer, std::move(ticket));
+					continue;
+				}
+				if (pool) {
+					if (not pool->tryEnqueue(sock, peer, ticket)) {
+						logger << "Rejected a connection from " << peer.to_string() << ": session queue is full" << ENDL;
+						rejectConnection(sock, serverBusyReply);
+					}
+					continue;
+				}
 				// create a thread and transfer the new stream to it
 				// this is so we handle the user traffic in a different thread
 				// and we can talk to multiple users at the same time
 
-				std::thread thr(runFtpPI, users, std::move(sock), peer, workDirectory, std::ref(logger));
+				std::thread thr([&, ticket = std::move(ticket)](sockpp::tcp_socket sock, sockpp::inet_address peer) {
+					runFtpPI(users, std::move(sock), peer, workDirectory, logger, server);
+				}, std::move(sock), peer);
 				thr.detach();
 
 				// for testing
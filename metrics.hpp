@@ -0,0 +1,303 @@
+#ifndef CPP_FTP_METRICS_HPP
+#define CPP_FTP_METRICS_HPP
+
+#include <sockpp/tcp_acceptor.h>
+#include <sys/socket.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "globals.hpp"
+
+// HDR-style histogram of durations in microseconds
+// values below histogramSubBuckets are exact, above that every power of two is split into histogramSubBuckets
+// buckets, so a value is kept within 12.5% over the whole range from a microsecond to half an hour
+const size_t histogramSubBuckets = 8;
+const int histogramMaxExponent = 31;
+const size_t histogramBuckets = histogramSubBuckets * (histogramMaxExponent - 1);
+
+// bucket of a value, values past the range go into the last bucket
+constexpr size_t histogramBucket(uint64_t value) {
+	if (value < histogramSubBuckets)
+		return value;
+	const int exponent = 63 - __builtin_clzll(value);
+	const size_t bucket = histogramSubBuckets * (exponent - 2) + ((value >> (exponent - 3)) & (histogramSubBuckets - 1));
+	return std::min(bucket, histogramBuckets - 1);
+}
+
+// smallest value of a bucket, the bucket after the last one starts at 2^(histogramMaxExponent + 1)
+constexpr uint64_t histogramBucketStart(size_t bucket) {
+	if (bucket < histogramSubBuckets)
+		return bucket;
+	const int exponent = bucket / histogramSubBuckets + 2;
+	return (histogramSubBuckets + bucket % histogramSubBuckets) << (exponent - 3);
+}
+
+// counts of a histogram summed up over the shards
+struct histogramSnapshot {
+	uint64_t counts[histogramBuckets] {};
+	uint64_t total = 0, sum = 0;
+
+	// value below which the fraction q of the recorded values lies, as the largest value of its bucket
+	uint64_t quantile(double q) const {
+		if (total == 0)
+			return 0;
+		const uint64_t rank = std::max<uint64_t>(1, std::ceil(q * total));
+		uint64_t seen = 0;
+		for (size_t bucket = 0; bucket < histogramBuckets; bucket++) {
+			seen += counts[bucket];
+			if (seen >= rank)
+				return histogramBucketStart(bucket + 1) - 1;
+		}
+		return histogramBucketStart(histogramBuckets) - 1;
+	}
+
+	// number of values up to limit, for the cumulative buckets of Prometheus
+	uint64_t countBelow(uint64_t limit) const {
+		uint64_t result = 0;
+		for (size_t bucket = 0; bucket < histogramBuckets and histogramBucketStart(bucket + 1) <= limit; bucket++)
+			result += counts[bucket];
+		return result;
+	}
+};
+
+// server metrics: latency of the command handlers and duration of the transfers by verb, transferred bytes,
+// sessions and replies by class
+// every thread records into its own shard with relaxed atomic adds, so recording never takes a lock or shares
+// a cache line with other threads, the shards are only summed up when the metrics are read
+class serverMetrics {
+public:
+	std::atomic<uint64_t> sessionsActive {0}, sessionsTotal {0};
+	std::atomic<uint64_t> unknownCommands {0}, transfersFailed {0}, transfersAborted {0};
+	// replies by the first digit of the code
+	std::atomic<uint64_t> replies[6] {};
+
+	serverMetrics() : shards(std::make_unique<metricShard[]>(metricShards)) {}
+
+	void recordCommand(uint64_t verb, std::chrono::nanoseconds elapsed) {
+		const size_t row = rowOf(verb);
+		if (row < metricVerbs)
+			record(localShard().commands[row], elapsed);
+	}
+
+	// a finished transfer, only the transfers which succeeded go into the duration histogram
+	void recordTransfer(uint64_t verb, std::chrono::nanoseconds elapsed, uint64_t bytes, bool succeeded) {
+		const size_t row = rowOf(verb);
+		if (row >= metricVerbs)
+			return;
+		metricShard &shard = localShard();
+		shard.bytes[row].fetch_add(bytes, std::memory_order_relaxed);
+		if (succeeded)
+			record(shard.transfers[row], elapsed);
+	}
+
+	void recordReply(uint32_t code) {
+		replies[std::min<uint32_t>(code / 100, 5)].fetch_add(1, std::memory_order_relaxed);
+	}
+
+	// rows of the verbs which recorded anything with the names of the verbs, sorted by name
+	std::vector<std::pair<size_t, std::string>> verbs() const {
+		std::vector<std::pair<size_t, std::string>> result;
+		for (size_t row = 0; row < metricVerbs; row++) {
+			const uint64_t key = verbKeys[row].load(std::memory_order_acquire);
+			if (key == 0)
+				continue;
+			std::string name;
+			for (int shift = 56; shift >= 0; shift -= 8) {
+				if (key >> shift & 0xff)
+					name += char(key >> shift & 0xff);
+			}
+			result.emplace_back(row, name);
+		}
+		std::sort(result.begin(), result.end(), [](const auto &first, const auto &second) { return first.second < second.second; });
+		return result;
+	}
+
+	histogramSnapshot commandLatency(size_t row) const {
+		return snapshot(false, row);
+	}
+
+	histogramSnapshot transferDuration(size_t row) const {
+		return snapshot(true, row);
+	}
+
+	uint64_t transferBytes(size_t row) const {
+		uint64_t result = 0;
+		for (size_t shard = 0; shard < metricShards; shard++)
+			result += shards[shard].bytes[row].load(std::memory_order_relaxed);
+		return result;
+	}
+
+	// the metrics in the Prometheus text format
+	// the histograms are exported with a bucket for every power of two microseconds, exact to the bucket edges
+	std::string prometheus() const {
+		std::string text;
+		const auto scalar = [&](const char *name, const char *type, const char *help, uint64_t value) {
+			text += std::string("# HELP ") + name + " " + help + "\n# TYPE " + name + " " + type + "\n" + name + " " +
+					std::to_string(value) + "\n";
+		};
+		scalar("cpp_ftp_sessions_active", "gauge", "Sessions connected right now.", sessionsActive.load());
+		scalar("cpp_ftp_sessions_total", "counter", "Sessions accepted since the start.", sessionsTotal.load());
+		scalar("cpp_ftp_unknown_commands_total", "counter", "Commands which aren't implemented.", unknownCommands.load());
+		scalar("cpp_ftp_transfers_failed_total", "counter", "Transfers which ended with an error reply.", transfersFailed.load());
+		scalar("cpp_ftp_transfers_aborted_total", "counter", "Transfers aborted by the client.", transfersAborted.load());
+		text += "# HELP cpp_ftp_replies_total Replies sent by class.\n# TYPE cpp_ftp_replies_total counter\n";
+		for (int replyClass = 1; replyClass <= 5; replyClass++)
+			text += "cpp_ftp_replies_total{class=\"" + std::to_string(replyClass) + "xx\"} " +
+					std::to_string(replies[replyClass].load()) + "\n";
+
+		const auto verbList = verbs();
+		const auto histograms = [&](const char *name, const char *help, bool transfers) {
+			text += std::string("# HELP ") + name + " " + help + "\n# TYPE " + name + " histogram\n";
+			for (const auto &[row, verb]: verbList) {
+				const histogramSnapshot histogram = transfers ? transferDuration(row) : commandLatency(row);
+				if (histogram.total == 0)
+					continue;
+				const std::string label = std::string(name) + "_bucket{verb=\"" + verb + "\",le=\"";
+				for (int exponent = 0; exponent <= histogramMaxExponent; exponent++)
+					text += label + secondsText(uint64_t(1) << exponent) + "\"} " +
+							std::to_string(histogram.countBelow(uint64_t(1) << exponent)) + "\n";
+				text += label + "+Inf\"} " + std::to_string(histogram.total) + "\n";
+				text += std::string(name) + "_sum{verb=\"" + verb + "\"} " + secondsText(histogram.sum) + "\n";
+				text += std::string(name) + "_count{verb=\"" + verb + "\"} " + std::to_string(histogram.total) + "\n";
+			}
+		};
+		histograms("cpp_ftp_command_duration_seconds", "Time spent in the command handlers by verb.", false);
+		histograms("cpp_ftp_transfer_duration_seconds", "Duration of the successful transfers by verb.", true);
+		text += "# HELP cpp_ftp_transfer_bytes_total Bytes moved by the transfers by verb.\n"
+				"# TYPE cpp_ftp_transfer_bytes_total counter\n";
+		for (const auto &[row, verb]: verbList) {
+			const uint64_t bytes = transferBytes(row);
+			if (bytes or transferDuration(row).total)
+				text += "cpp_ftp_transfer_bytes_total{verb=\"" + verb + "\"} " + std::to_string(bytes) + "\n";
+		}
+		return text;
+	}
+
+private:
+	struct histogramRow {
+		std::atomic<uint64_t> counts[histogramBuckets] {};
+		std::atomic<uint64_t> sum {0};
+	};
+
+	struct alignas(64) metricShard {
+		histogramRow commands[metricVerbs], transfers[metricVerbs];
+		std::atomic<uint64_t> bytes[metricVerbs] {};
+	};
+
+	std::unique_ptr<metricShard[]> shards;
+	// verb of every row, claimed with a compare-exchange the first time the verb is recorded
+	std::atomic<uint64_t> verbKeys[metricVerbs] {};
+
+	// shard of the calling thread, the threads are spread over the shards in the order they record
+	metricShard &localShard() {
+		static std::atomic<uint32_t> nextShard {0};
+		thread_local const uint32_t shard = nextShard.fetch_add(1, std::memory_order_relaxed) % metricShards;
+		return shards[shard];
+	}
+
+	// row of the verb in the open addressing table of verbs, metricVerbs if the table is full
+	size_t rowOf(uint64_t verb) {
+		const size_t start = (verb * 0x9e3779b97f4a7c15ull) >> 32;
+		for (size_t probe = 0; probe < metricVerbs; probe++) {
+			const size_t row = (start + probe) % metricVerbs;
+			uint64_t key = verbKeys[row].load(std::memory_order_acquire);
+			if (key == 0 and verbKeys[row].compare_exchange_strong(key, verb, std::memory_order_acq_rel))
+				return row;
+			if (key == verb)
+				return row;
+		}
+		return metricVerbs;
+	}
+
+	// microseconds as seconds with all of their digits
+	static std::string secondsText(uint64_t micros) {
+		std::string text = std::to_string(micros / 1000000) + "." + std::to_string(1000000 + micros % 1000000).substr(1);
+		while (text.back() == '0')
+			text.pop_back();
+		if (text.back() == '.')
+			text.pop_back();
+		return text;
+	}
+
+	static void record(histogramRow &row, std::chrono::nanoseconds elapsed) {
+		const uint64_t micros = std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+		row.counts[histogramBucket(micros)].fetch_add(1, std::memory_order_relaxed);
+		row.sum.fetch_add(micros, std::memory_order_relaxed);
+	}
+
+	histogramSnapshot snapshot(bool transfers, size_t row) const {
+		histogramSnapshot result;
+		for (size_t shard = 0; shard < metricShards; shard++) {
+			const histogramRow &source = transfers ? shards[shard].transfers[row] : shards[shard].commands[row];
+			for (size_t bucket = 0; bucket < histogramBuckets; bucket++)
+				result.counts[bucket] += source.counts[bucket].load(std::memory_order_relaxed);
+			result.sum += source.sum.load(std::memory_order_relaxed);
+		}
+		for (const uint64_t count: result.counts)
+			result.total += count;
+		return result;
+	}
+};
+
+// local HTTP listener serving the metrics in the Prometheus text format
+// scrapes are rare and small, so one thread answers them one after another
+class metricsListener {
+public:
+	metricsListener(in_port_t port, std::function<std::string()> render_t) : render(std::move(render_t)) {
+		acceptor.open(sockpp::inet_address("127.0.0.1", port), metricsListenQueue);
+		if (not acceptor)
+			return;
+		worker = std::thread(&metricsListener::serve, this);
+	}
+
+	// the listener lives for the whole server lifetime, so the thread is simply detached
+	~metricsListener() {
+		if (worker.joinable())
+			worker.detach();
+	}
+
+	explicit operator bool() const {
+		return bool(acceptor);
+	}
+
+	std::string lastError() const {
+		return acceptor.last_error_str();
+	}
+
+private:
+	sockpp::tcp_acceptor acceptor;
+	std::function<std::string()> render;
+	std::thread worker;
+
+	void serve() {
+		while (true) {
+			sockpp::tcp_socket client = acceptor.accept();
+			if (not client)
+				continue;
+			// a client which doesn't send its request can't hold up the scrapes for long
+			client.read_timeout(metricsRequestTimeout);
+			std::string request;
+			char buffer[1024];
+			while (request.find("\r\n\r\n") == std::string::npos and request.size() < metricsRequestSize) {
+				const ssize_t numRead = client.read(buffer, sizeof(buffer));
+				if (numRead <= 0)
+					break;
+				request.append(buffer, numRead);
+			}
+			const bool found = request.rfind("GET /metrics ", 0) == 0 or request.rfind("GET / ", 0) == 0;
+			const std::string body = found ? render() : "Not found, the metrics are at /metrics\n";
+			const std::string reply = std::string(found ? "HTTP/1.0 200 OK" : "HTTP/1.0 404 Not Found") +
+									  "\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+									  std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+			client.write_n(reply.data(), reply.size());
+		}
+	}
+};
+
+#endif //CPP_FTP_METRICS_HPP
@@ -3,13 +3,19 @@
 
 #include "globals.hpp"
 #include <sockpp/socket.h>
+#include <sockpp/tcp_socket.h>
+#include <sys/socket.h>
+#include <cerrno>
+#include <cstring>
+#include <string_view>
+#include <utility>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
-// class for reading from sockpp line-by-line
-// we simply read into the buffer chunk-by-chunk
-// if we encounter CRLF in the buffer then return up until CRLF
-// and move the rest of the contents to the beginning
+// class for reading from sockpp chunk-by-chunk
+// we simply read into the buffer until it is full or the connection is closed
 // this way we can get large amounts of data and don't have to call socket read char-by-char
-// also we can use the same class for simply reading into the buffer until the connection is closed
 struct netbuffer {
 	dataT buffer;
 	netbuffer() {
@@ -17,63 +23,167 @@ struct netbuffer {
 	};
 };
 
-// function for cleaning up the buffer
-inline void clearBuffer(netbuffer &netbuff) {
-	netbuff.buffer.clear();
-	netbuff.buffer.reserve(BUFSIZE);
+// control connection buffer which cuts CRLF terminated lines out of the received data
+// the unread data is in [head, tail), lines are handed out as views into the storage so nothing is copied
+// scanPos remembers where the last search for CRLF stopped, so bytes are never searched twice
+// when the free space at the end runs out the unread part is moved back to the beginning,
+// this only ever moves a partial line, so the storage is reused like a ring but lines never wrap around
+struct lineBuffer {
+	dataT storage;
+	size_t head = 0, tail = 0, scanPos = 0;
+	lineBuffer() : storage(BUFSIZE) {}
+};
+
+// scalar search for CRLF, returns the position of the CR or size if there is no CRLF
+inline size_t findCRLFScalar(const byte *data, size_t size) {
+	for (size_t i = 0; i + 1 < size; i++)
+		if (data[i] == '\r' and data[i + 1] == '\n')
+			return i;
+	return size;
+}
+
+#if defined(__SSE2__)
+// compare a block against CR and the same block shifted by one byte against LF
+// a bit set in both masks means that a CRLF starts there
+inline size_t findCRLFSse2(const byte *data, size_t size) {
+	const __m128i cr = _mm_set1_epi8('\r'), lf = _mm_set1_epi8('\n');
+	size_t i = 0;
+	for (; i + 17 <= size; i += 16) {
+		const __m128i first = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+		const __m128i second = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i + 1));
+		const uint32_t mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, cr), _mm_cmpeq_epi8(second, lf)));
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+	return i + findCRLFScalar(data + i, size - i);
+}
+
+__attribute__((target("avx2")))
+inline size_t findCRLFAvx2(const byte *data, size_t size) {
+	const __m256i cr = _mm256_set1_epi8('\r'), lf = _mm256_set1_epi8('\n');
+	size_t i = 0;
+	for (; i + 33 <= size; i += 32) {
+		const __m256i first = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+		const __m256i second = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i + 1));
+		const uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(first, cr),
+																	_mm256_cmpeq_epi8(second, lf)));
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+	return i + findCRLFSse2(data + i, size - i);
 }
+#endif
 
-// function for moving leftovers beginning at pos to the beginning of the buffer (-2 to account for CRLF)
-inline void readyBuffer(netbuffer &netbuff, dataT::iterator pos) {
-	std::move_backward(pos + 2, netbuff.buffer.end(), netbuff.buffer.begin() + (netbuff.buffer.end() - pos - 2));
-	netbuff.buffer.resize(netbuff.buffer.end() - pos - 2);
+// find the first CRLF with the widest instructions the cpu has, returns the position of the CR or size if there is none
+inline size_t findCRLF(const byte *data, size_t size) {
+#if defined(__SSE2__)
+	static const auto search = __builtin_cpu_supports("avx2") ? findCRLFAvx2 : findCRLFSse2;
+	return search(data, size);
+#else
+	return findCRLFScalar(data, size);
+#endif
+}
+
+// free space at the end of the buffer for the next read
+// moves the unread data to the beginning if the end is reached, so lines handed out before are no longer valid
+inline std::pair<byte *, size_t> lineSpace(lineBuffer &lines) {
+	if (lines.tail == lines.storage.size() and lines.head != 0) {
+		std::memmove(lines.storage.data(), lines.storage.data() + lines.head, lines.tail - lines.head);
+		lines.tail -= lines.head;
+		lines.scanPos -= lines.head;
+		lines.head = 0;
+	}
+	return {lines.storage.data() + lines.tail, lines.storage.size() - lines.tail};
+}
+
+// result of trying to cut a line out of the buffer
+enum lineStatus {LINE_READY, LINE_PARTIAL, LINE_TOO_LONG};
+
+// incremental part of readline, cuts one CRLF line out of the data which is already in the buffer
+// doesn't touch the socket, so the reactor can feed the buffer on readiness events and then call this
+// the line points into the buffer and stays valid until the next read into it
+lineStatus extractLine(lineBuffer &lines, std::string_view &line) {
+	const size_t found = lines.scanPos + findCRLF(lines.storage.data() + lines.scanPos, lines.tail - lines.scanPos);
+	if (found == lines.tail) {
+		// if the buffer is full and there still isn't a CRLF then the command is too long
+		if (lines.head == 0 and lines.tail == lines.storage.size()) {
+			lines.tail = lines.scanPos = 0;
+			return LINE_TOO_LONG;
+		}
+		// a CR at the very end can still be followed by LF in the next read
+		lines.scanPos = lines.tail == lines.head ? lines.tail : lines.tail - 1;
+		return LINE_PARTIAL;
+	}
+	line = std::string_view(reinterpret_cast<const char *>(lines.storage.data() + lines.head), found - lines.head);
+	lines.head = lines.scanPos = found + 2;
+	// everything has been consumed, the next read can start at the beginning again
+	if (lines.head == lines.tail)
+		lines.head = lines.tail = lines.scanPos = 0;
+	return LINE_READY;
 }
 
-// function to find a pair of bytes in dataT
-// for finding CRLF
-dataT::iterator findPair(dataT::iterator start, dataT::iterator end, const std::pair<byte, byte> &toFind) {
-	// if we reached the end (only one char left)
-	if (start == end or start + 1 == end)
-		return end;
-	if (*start == toFind.first and *(start + 1) == toFind.second)
-		return start;
-	return findPair(start + 1, end, toFind);
+// put back the line extractLine just returned, the next call returns it again
+inline void unreadLine(lineBuffer &lines, std::string_view line) {
+	const size_t start = reinterpret_cast<const byte *>(line.data()) - lines.storage.data();
+	// extractLine starts over at the beginning once everything is consumed, but the data is still there
+	if (lines.head == lines.tail)
+		lines.tail = start + line.size() + 2;
+	lines.head = lines.scanPos = start;
 }
 
-// read CRLF line from net buffer and return the line read
-const dataT readline(sockpp::tcp_socket &socket, netbuffer &netbuff) {
-	dataT::iterator ptrToCRLF;
+// read everything which is currently available on the socket without blocking
+// returns false if the connection was closed or some error happened
+const bool readAvailable(sockpp::tcp_socket &socket, lineBuffer &lines) {
+	while (true) {
+		const auto [space, spaceSize] = lineSpace(lines);
+		if (spaceSize == 0)
+			return true;
+		const ssize_t readn = ::recv(socket.handle(), space, spaceSize, MSG_DONTWAIT);
+		if (readn > 0) {
+			lines.tail += readn;
+			continue;
+		}
+		// connection closed by the peer
+		if (readn == 0)
+			return false;
+		if (errno == EINTR)
+			continue;
+		// nothing left to read right now
+		return errno == EAGAIN or errno == EWOULDBLOCK;
+	}
+}
+
+// read CRLF line from the line buffer and return the line read
+// the line points into the buffer and stays valid until the next call
+// beforeWait is called every time there is no complete line left and we have to wait for the socket
+template<typename waitFunction>
+const std::string_view readline(sockpp::tcp_socket &socket, lineBuffer &lines, waitFunction beforeWait) {
+	std::string_view line;
+	lineStatus status;
 	// while we can't find CRLF and while the buffer isn't full
-	// if buffer is full then let's return a zero sized buffer, and cause a 500 error
-	while ((ptrToCRLF = findPair(netbuff.buffer.begin(), netbuff.buffer.end(), CRLFp)) == netbuff.buffer.end() and
-		   netbuff.buffer.size() != netbuff.buffer.capacity()) {
+	// if buffer is full then let's return a zero sized line, and cause a 500 error
+	while ((status = extractLine(lines, line)) == LINE_PARTIAL) {
+		beforeWait();
+		const auto [space, spaceSize] = lineSpace(lines);
 		// number of bytes read
-		int32_t readn = socket.read(netbuff.buffer.data() + netbuff.buffer.size(), netbuff.buffer.capacity() - netbuff.buffer.size());
+		const ssize_t readn = socket.read(space, spaceSize);
 		// we can't read anymore
 		// connection either ended, reset or dropped
 		// OR
 		// some error happened, we can't read anymore, we should close
-		if (readn <= 0) {
-			return {'X','Q','U','I','T','N','O','W'};
-		} else {
-			// fix up the vector structure
-			// resize vector so that the size is correct
-			netbuff.buffer.assign(netbuff.buffer.data(), netbuff.buffer.data() + netbuff.buffer.size() + readn);
-		}
+		if (readn <= 0)
+			return "XQUITNOW";
+		lines.tail += readn;
 	}
-	// if the command is too long return empty buffer
-	if (ptrToCRLF == netbuff.buffer.end()) {
-		clearBuffer(netbuff);
+	// if the command is too long return empty line
+	if (status == LINE_TOO_LONG)
 		return {};
-	}
-	const dataT returnBuffer(netbuff.buffer.begin(), ptrToCRLF);
-	readyBuffer(netbuff, ptrToCRLF);
-	return returnBuffer;
+	return line;
 }
 
-// function for simply reading the full buffer if we can and returning it
-// if some error happened then simply return zero size buffer
-const dataT read(sockpp::tcp_socket &socket, netbuffer &netbuff) {
+// function for filling the buffer until it is full or the connection is closed
+// the data stays in the buffer so the caller can use it in place, returns the number of bytes in the buffer
+const size_t fillBuffer(sockpp::stream_socket &socket, netbuffer &netbuff) {
 	// while the socket is open and while the buffer still has free space try to read
 	while(socket and netbuff.buffer.size() != netbuff.buffer.capacity()) {
 		int32_t readn = socket.read(netbuff.buffer.data() + netbuff.buffer.size(), netbuff.buffer.capacity() - netbuff.buffer.size());
@@ -83,6 +193,13 @@ const dataT read(sockpp::tcp_socket &socket, netbuffer &netbuff) {
 		// make the vector fix its structure and size for memory safe handling of data
 		netbuff.buffer.assign(netbuff.buffer.data(), netbuff.buffer.data() + netbuff.buffer.size() + readn);
 	}
+	return netbuff.buffer.size();
+}
+
+// function for simply reading the full buffer if we can and returning it
+// if some error happened then simply return zero size buffer
+const dataT read(sockpp::tcp_socket &socket, netbuffer &netbuff) {
+	fillBuffer(socket, netbuff);
 	// copy to a new buffer the data and then clear the buffer
 	// so that if we call again and sock is closed we get a correctly empty buffer
 	const dataT returnVal(netbuff.buffer.begin(), netbuff.buffer.end());
@@ -0,0 +1,276 @@
+#ifndef CPP_FTP_PASVPOOL_HPP
+#define CPP_FTP_PASVPOOL_HPP
+
+#include <sockpp/tcp_acceptor.h>
+#include <sockpp/tcp_socket.h>
+#include <sockpp/inet_address.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "globals.hpp"
+
+// pool of passive listeners opened once at startup on a fixed port range
+// PASV only hands out a ticket for one of the ports, so it costs no syscalls and the range can be opened in a firewall
+// a single dispatcher thread accepts on every listener and gives the connection to the session
+// whose ticket matches the port and the address of the peer, anything else is closed right away
+// tickets get a new token on every PASV, so a late connection for an old PASV never reaches a later transfer
+class passivePool {
+public:
+	// number of data connections given to sessions and closed because nobody waited for them
+	std::atomic<uint64_t> matched {0}, rejected {0};
+
+	// pendingLimit is the number of connections a ticket holds before the session takes them, SEGR needs one per segment
+	passivePool(in_port_t minPort_t, in_port_t maxPort_t, size_t pendingLimit_t)
+		: minPort(minPort_t), pendingLimit(pendingLimit_t), listeners(maxPort_t - minPort_t + 1) {
+		epollFd = epoll_create1(EPOLL_CLOEXEC);
+		if (epollFd < 0)
+			return;
+		for (size_t i = 0; i < listeners.size(); i++) {
+			sockpp::tcp_acceptor &listener = listeners[i];
+			// ports which are already taken are simply left out of the pool
+			if (not listener.open(sockpp::inet_address(0, minPort + i), pasvListenQueue) or
+				not listener.set_non_blocking(true)) {
+				listener.close();
+				continue;
+			}
+			epoll_event event {};
+			event.events = EPOLLIN;
+			event.data.u64 = i;
+			if (epoll_ctl(epollFd, EPOLL_CTL_ADD, listener.handle(), &event) < 0) {
+				listener.close();
+				continue;
+			}
+			openCount++;
+		}
+		if (openCount)
+			dispatcher = std::thread(&passivePool::dispatch, this);
+	}
+
+	// the pool lives for the whole server lifetime, so the dispatcher thread is simply detached
+	~passivePool() {
+		if (dispatcher.joinable())
+			dispatcher.detach();
+	}
+
+	// check if at least one listener could be opened
+	explicit operator bool() const {
+		return openCount != 0;
+	}
+
+	// number of ports the pool listens on
+	size_t size() const {
+		return openCount;
+	}
+
+	// reserve a port for the next data connections from the peer
+	// every port is given to one session per peer address at a time, so the port and the address identify the ticket
+	// returns the token and the port, or a zero port if every port is taken for this address
+	std::pair<uint64_t, in_port_t> reserve(in_addr_t peer) {
+		std::lock_guard<std::mutex> lock(mutex);
+		for (size_t attempt = 0; attempt < listeners.size(); attempt++) {
+			const size_t index = nextPort++ % listeners.size();
+			if (not listeners[index].is_open())
+				continue;
+			const uint64_t key = addressKey(peer, minPort + index);
+			if (byAddress.count(key))
+				continue;
+			const uint64_t token = ++lastToken;
+			byAddress[key] = token;
+			tickets[token].key = key;
+			return {token, minPort + index};
+		}
+		return {0, 0};
+	}
+
+	// wait until the peer connects to the port of the ticket
+	// the ticket stays valid, so the next transfer without another PASV gets the next connection
+	// returns a closed socket on timeout, if the ticket was released or once canceled is set and interrupt() called
+	sockpp::tcp_socket accept(uint64_t token, std::chrono::milliseconds timeout, const std::atomic<bool> &canceled) {
+		std::unique_lock<std::mutex> lock(mutex);
+		auto found = tickets.find(token);
+		const bool connected = cv.wait_for(lock, timeout, [&]() {
+			found = tickets.find(token);
+			return canceled or found == tickets.end() or not found->second.pending.empty();
+		});
+		if (not connected or canceled or found == tickets.end())
+			return sockpp::tcp_socket();
+		sockpp::tcp_socket sock = std::move(found->second.pending.front());
+		found->second.pending.pop_front();
+		return sock;
+	}
+
+	// wake up the sessions waiting in accept, so they see that their transfer was canceled
+	void interrupt() {
+		std::lock_guard<std::mutex> lock(mutex);
+		cv.notify_all();
+	}
+
+	// drop the ticket along with a connection which nobody took
+	void release(uint64_t token) {
+		std::lock_guard<std::mutex> lock(mutex);
+		const auto found = tickets.find(token);
+		if (found == tickets.end())
+			return;
+		byAddress.erase(found->second.key);
+		tickets.erase(found);
+		cv.notify_all();
+	}
+
+private:
+	struct ticket {
+		uint64_t key = 0;
+		// connections accepted for the ticket which the session hasn't taken yet, in the order they came
+		std::deque<sockpp::tcp_socket> pending;
+	};
+
+	const in_port_t minPort;
+	const size_t pendingLimit;
+	std::vector<sockpp::tcp_acceptor> listeners;
+	size_t openCount = 0;
+	int epollFd = -1;
+	std::thread dispatcher;
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::unordered_map<uint64_t, ticket> tickets;
+	// tickets by peer address and port
+	std::unordered_map<uint64_t, uint64_t> byAddress;
+	uint64_t lastToken = 0;
+	size_t nextPort = 0;
+
+	static uint64_t addressKey(in_addr_t address, in_port_t port) {
+		return uint64_t(address) << 16 | port;
+	}
+
+	// main loop of the dispatcher thread, accepts the connections and hands them to the tickets
+	void dispatch() {
+		epoll_event events[reactorMaxEvents];
+		// listeners taken out of the epoll set after accept failed for lack of resources, watched again at resumeAt
+		std::vector<size_t> paused;
+		std::chrono::steady_clock::time_point resumeAt;
+		while (true) {
+			int timeout = -1;
+			if (not paused.empty())
+				timeout = int(std::max<std::chrono::milliseconds::rep>(0, std::chrono::duration_cast<std::chrono::milliseconds>(
+					resumeAt - std::chrono::steady_clock::now()).count() + 1));
+			const int eventCount = epoll_wait(epollFd, events, reactorMaxEvents, timeout);
+			if (eventCount < 0 and errno == EINTR)
+				continue;
+			if (eventCount < 0)
+				return;
+			if (not paused.empty() and std::chrono::steady_clock::now() >= resumeAt) {
+				for (const size_t index: paused)
+					watch(index, EPOLLIN);
+				paused.clear();
+			}
+			for (int i = 0; i < eventCount; i++) {
+				const size_t index = events[i].data.u64;
+				sockpp::inet_address peer;
+				// the listeners are non-blocking, so take everything waiting in the queue
+				while (true) {
+					sockpp::tcp_socket sock = listeners[index].accept(&peer);
+					if (sock) {
+						handOver(std::move(sock), addressKey(peer.address(), minPort + index));
+						continue;
+					}
+					const int error = listeners[index].last_error();
+					// the peer gave up on this connection, the next one in the queue may be fine
+					if (error == ECONNABORTED or error == EPROTO or error == EINTR)
+						continue;
+					// out of fds or buffers (EMFILE, ENFILE, ENOBUFS, ENOMEM), the listener stays readable
+					// so it is left out for a while instead of spinning on it, the connections wait in the backlog
+					if (error != EAGAIN and error != EWOULDBLOCK) {
+						watch(index, 0);
+						if (paused.empty())
+							resumeAt = std::chrono::steady_clock::now() + acceptBackoff;
+						paused.push_back(index);
+					}
+					break;
+				}
+			}
+		}
+	}
+
+	// change the events the dispatcher waits for on a listener, no events keeps it in the set but never reports it
+	void watch(size_t index, uint32_t events) {
+		epoll_event event {};
+		event.events = events;
+		event.data.u64 = index;
+		epoll_ctl(epollFd, EPOLL_CTL_MOD, listeners[index].handle(), &event);
+	}
+
+	// give the connection to the ticket waiting for it
+	void handOver(sockpp::tcp_socket sock, uint64_t key) {
+		std::lock_guard<std::mutex> lock(mutex);
+		const auto token = byAddress.find(key);
+		// nobody expects a connection from this address or the session already has enough of them waiting
+		if (token == byAddress.end() or tickets[token->second].pending.size() >= pendingLimit) {
+			rejected.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		tickets[token->second].pending.push_back(std::move(sock));
+		matched.fetch_add(1, std::memory_order_relaxed);
+		cv.notify_all();
+	}
+};
+
+// ticket of a session in the passive pool, released when the session drops it
+class passiveTicket {
+public:
+	passiveTicket() = default;
+	passiveTicket(passivePool &pool_t, std::pair<uint64_t, in_port_t> reserved)
+		: pool(&pool_t), token(reserved.first), ticketPort(reserved.second) {}
+	passiveTicket(passiveTicket &&other) noexcept
+		: pool(other.pool), token(std::exchange(other.token, 0)), ticketPort(other.ticketPort) {}
+	passiveTicket &operator=(passiveTicket &&other) noexcept {
+		reset();
+		pool = other.pool;
+		token = std::exchange(other.token, 0);
+		ticketPort = other.ticketPort;
+		return *this;
+	}
+	passiveTicket(const passiveTicket &) = delete;
+	passiveTicket &operator=(const passiveTicket &) = delete;
+	~passiveTicket() {
+		reset();
+	}
+
+	// check if a port was reserved
+	explicit operator bool() const {
+		return token != 0;
+	}
+
+	in_port_t port() const {
+		return ticketPort;
+	}
+
+	sockpp::tcp_socket accept(std::chrono::milliseconds timeout, const std::atomic<bool> &canceled) {
+		return pool->accept(token, timeout, canceled);
+	}
+
+	void interrupt() {
+		pool->interrupt();
+	}
+
+	void reset() {
+		if (token)
+			pool->release(token);
+		token = 0;
+	}
+
+private:
+	passivePool *pool = nullptr;
+	uint64_t token = 0;
+	in_port_t ticketPort = 0;
+};
+
+#endif //CPP_FTP_PASVPOOL_HPP
@@ -0,0 +1,123 @@
+#ifndef CPP_FTP_RATELIMIT_HPP
+#define CPP_FTP_RATELIMIT_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <climits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include "globals.hpp"
+
+// parse a rate limit given in KiB/s into bytes per second, returns false if it isn't a number
+inline bool parseRate(std::string_view text, uint64_t &bytesPerSecond) {
+	uint64_t kilobytes = 0;
+	if (text.empty() or text.find_first_not_of("0123456789") != std::string_view::npos or
+		std::from_chars(text.data(), text.data() + text.size(), kilobytes).ec != std::errc() or kilobytes > (UINT64_MAX >> 10))
+		return false;
+	bytesPerSecond = kilobytes << 10;
+	return true;
+}
+
+// token bucket shaping the data connections
+// nothing refills the bucket in the background, it keeps the time at which it will be full again (GCRA),
+// so taking tokens is one compare-exchange and the tokens a transfer lacks turn into the time it has to wait
+class tokenBucket {
+public:
+	explicit tokenBucket(uint64_t bytesPerSecond_t = 0) : bytesPerSecond(bytesPerSecond_t) {}
+
+	// bytes per second, 0 means unlimited
+	uint64_t rate() const {
+		return bytesPerSecond.load(std::memory_order_relaxed);
+	}
+
+	void setRate(uint64_t bytesPerSecond_t) {
+		bytesPerSecond.store(bytesPerSecond_t, std::memory_order_relaxed);
+	}
+
+	// take the tokens for size bytes, the bucket may go into debt
+	// returns how long the caller has to wait until the debt is paid, a full bucket lets rateBurst worth of data through
+	std::chrono::nanoseconds take(uint64_t size) {
+		const uint64_t currentRate = rate();
+		if (currentRate == 0)
+			return std::chrono::nanoseconds(0);
+		const int64_t cost = static_cast<int64_t>(static_cast<double>(size) * 1e9 / currentRate);
+		const int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::steady_clock::now().time_since_epoch()).count();
+		int64_t full = fullAt.load(std::memory_order_relaxed), next;
+		do {
+			next = std::max(full, now) + cost;
+		} while (not fullAt.compare_exchange_weak(full, next, std::memory_order_relaxed));
+		return std::chrono::nanoseconds(std::max<int64_t>(0, next - now - std::chrono::nanoseconds(rateBurst).count()));
+	}
+
+private:
+	std::atomic<uint64_t> bytesPerSecond;
+	// steady clock time in nanoseconds at which the bucket is full again, in the past if it is full
+	std::atomic<int64_t> fullAt {0};
+};
+
+// the buckets one session is throttled by: the whole server, the user of the session and the session itself
+// every transfer pays all of them and waits for the one furthest in debt
+struct rateLimiter {
+	tokenBucket *global = nullptr, *user = nullptr;
+	tokenBucket session;
+
+	std::chrono::nanoseconds take(uint64_t size) {
+		std::chrono::nanoseconds wait = session.take(size);
+		if (global)
+			wait = std::max(wait, global->take(size));
+		if (user)
+			wait = std::max(wait, user->take(size));
+		return wait;
+	}
+
+	// check if any of the buckets has a limit
+	bool limited() const {
+		return session.rate() or (global and global->rate()) or (user and user->rate());
+	}
+
+	// largest chunk a throttled transfer should move at once, so it keeps the limit smoothly instead of in long bursts
+	size_t chunk(size_t preferred) const {
+		uint64_t slowest = session.rate();
+		for (const tokenBucket *bucket: {global, user}) {
+			if (bucket and bucket->rate() and (slowest == 0 or bucket->rate() < slowest))
+				slowest = bucket->rate();
+		}
+		if (slowest == 0)
+			return preferred;
+		const size_t burst = slowest * std::chrono::duration<double>(rateBurst).count();
+		return std::clamp(burst, std::min(rateMinChunk, preferred), preferred);
+	}
+};
+
+// rate limits of the whole server, the bucket of a user is shared by every session of that user
+class rateLimits {
+public:
+	tokenBucket global;
+	// limit every session starts with
+	uint64_t sessionRate = 0;
+
+	// bucket of the user, created unlimited the first time it is needed
+	tokenBucket *user(const std::string &name) {
+		std::lock_guard<std::mutex> lock(mutex);
+		auto &bucket = users[name];
+		if (not bucket)
+			bucket = std::make_unique<tokenBucket>();
+		return bucket.get();
+	}
+
+	void setUserRate(const std::string &name, uint64_t bytesPerSecond) {
+		user(name)->setRate(bytesPerSecond);
+	}
+
+private:
+	std::mutex mutex;
+	std::unordered_map<std::string, std::unique_ptr<tokenBucket>> users;
+};
+
+#endif //CPP_FTP_RATELIMIT_HPP
@@ -0,0 +1,195 @@
+#ifndef CPP_FTP_REACTOR_HPP
+#define CPP_FTP_REACTOR_HPP
+
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "globals.hpp"
+#include "netbuffer.hpp"
+#include "utils.hpp"
+#include "ftp.hpp"
+#include "sessionpool.hpp"
+
+// reactor for the control connections
+// instead of having a thread per connection which sits blocked in readline for the whole session
+// all of the control sockets are registered in one epoll instance and a small fixed set of threads waits on it
+// sockets are registered with EPOLLONESHOT, so only one thread at a time works with a session:
+// it reads whatever is available, runs every complete command and then rearms the socket
+// a command which has to wait for a running transfer stays in the buffer and the socket is rearmed by the transfer thread
+// once the transfer is done, so no reactor thread is ever blocked by a transfer
+class ftpReactor {
+public:
+	// function which handles a single received command line
+	// returns false if the control connection has to be closed
+	typedef std::function<bool(FTP&, std::string_view)> commandHandlerT;
+
+	ftpReactor(const stringHashMap &users_t, fs::path workDir_t, loggerT &logger_t, serverContext &server_t,
+			   uint32_t threadCount, commandHandlerT handler_t)
+		: users(users_t), workDir(workDir_t), logger(logger_t), server(server_t), handler(std::move(handler_t)) {
+		epollFd = epoll_create1(EPOLL_CLOEXEC);
+		if (epollFd < 0)
+			return;
+		for (uint32_t i = 0; i < threadCount; i++)
+			threads.emplace_back(&ftpReactor::run, this);
+	}
+
+	// the reactor lives for the whole server lifetime, so the threads are simply detached
+	~ftpReactor() {
+		for (auto &thr: threads)
+			thr.detach();
+	}
+
+	// check if the epoll instance was successfully created
+	explicit operator bool() const {
+		return epollFd >= 0;
+	}
+
+	// register a freshly accepted control connection
+	// sends the greeting and lets the reactor threads handle everything else
+	void addSession(sockpp::tcp_socket sock, sockpp::inet_address peer, admissionTicket ticket) {
+		const int fd = sock.handle();
+		auto ftp = std::make_unique<FTP>(users, std::move(sock), peer, workDir, logger, server);
+		// send 220 code since we are ready for working
+		if (sendReply(*ftp, 220, "Ready for service, waiting for authorization. HELP command lists available commands"))
+			return;
+		FTP &session = *ftp;
+		{
+			std::lock_guard<std::mutex> lock(sessionsMutex);
+			sessions.emplace(fd, reactorSession{std::move(ftp), std::move(ticket)});
+		}
+		epoll_event event {};
+		event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+		event.data.fd = fd;
+		if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) < 0) {
+			logger << getPeer(session) << " - can't register control connection in the reactor" << ENDL;
+			removeSession(fd, false);
+		}
+	}
+
+private:
+	// what is left to do with a session after serving it
+	enum serveStatus {SESSION_READY, SESSION_WAITING, SESSION_CLOSED};
+
+	// session with the admission slot it holds
+	struct reactorSession {
+		std::unique_ptr<FTP> ftp;
+		admissionTicket ticket;
+	};
+
+	// copy of the valid users which every session references
+	stringHashMap users;
+	fs::path workDir;
+	loggerT &logger;
+	serverContext &server;
+	commandHandlerT handler;
+	int epollFd = -1;
+	std::vector<std::thread> threads;
+	// sessions by the handle of their control socket
+	std::mutex sessionsMutex;
+	std::unordered_map<int, reactorSession> sessions;
+
+	// main loop of a reactor thread
+	void run() {
+		epoll_event events[reactorMaxEvents];
+		while (true) {
+			const int eventCount = epoll_wait(epollFd, events, reactorMaxEvents, -1);
+			if (eventCount < 0) {
+				if (errno == EINTR)
+					continue;
+				logger << "Reactor thread stopped, epoll_wait failed: " << std::strerror(errno) << ENDL;
+				return;
+			}
+			for (int i = 0; i < eventCount; i++) {
+				const int fd = events[i].data.fd;
+				FTP *ftp = findSession(fd);
+				if (ftp == nullptr)
+					continue;
+				const serveStatus status = serve(*ftp, fd);
+				if (status == SESSION_READY)
+					rearm(fd);
+				else if (status == SESSION_CLOSED)
+					removeSession(fd, true);
+			}
+		}
+	}
+
+	// read the available data and run every complete command in the buffer
+	// a command which has to wait for the running transfer stops the batch, the transfer thread resumes the session later
+	serveStatus serve(FTP &ftp, int fd) {
+		const bool connectionAlive = readAvailable(ftp.controlSock, ftp.ftpBuf);
+		std::string_view line;
+		bool sessionAlive = true;
+		while (sessionAlive) {
+			const lineStatus status = extractLine(ftp.ftpBuf, line);
+			if (status == LINE_PARTIAL)
+				break;
+			if (status == LINE_TOO_LONG)
+				line = {};
+			if (not line.empty() and not answeredDuringTransfer(verbKey(getNextParam(skipTelnetSignals(line)).first)) and
+				ftp.transfer.whenDone([this, fd]() { resume(fd); })) {
+				unreadLine(ftp.ftpBuf, line);
+				flushReplies(ftp);
+				return SESSION_WAITING;
+			}
+			sessionAlive = handler(ftp, line) and ftp.controlSock.is_open() and ftp.active;
+		}
+		// the replies of the whole batch go out together
+		flushReplies(ftp);
+		if (not sessionAlive)
+			return SESSION_CLOSED;
+		if (not connectionAlive) {
+			ftp.logger << getPeer(ftp) << " - control connection closed" << ENDL;
+			return SESSION_CLOSED;
+		}
+		return SESSION_READY;
+	}
+
+	FTP *findSession(int fd) {
+		std::lock_guard<std::mutex> lock(sessionsMutex);
+		const auto session = sessions.find(fd);
+		return session == sessions.end() ? nullptr : session->second.ftp.get();
+	}
+
+	void rearm(int fd) {
+		epoll_event event {};
+		event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+		event.data.fd = fd;
+		if (epoll_ctl(epollFd, EPOLL_CTL_MOD, fd, &event) < 0)
+			removeSession(fd, true);
+	}
+
+	// called on the transfer thread after the reply of the transfer which a buffered command waits for
+	// EPOLLOUT is reported right away on the idle control socket, so a reactor thread runs the buffered commands
+	// even if the client sends nothing more, the next rearm goes back to EPOLLIN only
+	void resume(int fd) {
+		epoll_event event {};
+		event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLONESHOT;
+		event.data.fd = fd;
+		if (epoll_ctl(epollFd, EPOLL_CTL_MOD, fd, &event) < 0)
+			logger << "Can't resume a control connection after its transfer: " << std::strerror(errno) << ENDL;
+	}
+
+	// the socket has to leave epoll before the FTP object closes it
+	void removeSession(int fd, bool registered) {
+		if (registered)
+			epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+		reactorSession session;
+		{
+			std::lock_guard<std::mutex> lock(sessionsMutex);
+			const auto found = sessions.find(fd);
+			if (found == sessions.end())
+				return;
+			session = std::move(found->second);
+			sessions.erase(found);
+		}
+		logReplyStats(*session.ftp);
+	}
+};
+
+#endif //CPP_FTP_REACTOR_HPP
@@ -0,0 +1,110 @@
+#ifndef CPP_FTP_REPLYQUEUE_HPP
+#define CPP_FTP_REPLYQUEUE_HPP
+
+#include <sockpp/stream_socket.h>
+#include <sys/uio.h>
+#include <cerrno>
+#include <charconv>
+#include <string_view>
+#include <vector>
+#include "globals.hpp"
+
+// output queue of the control connection
+// the replies of all pipelined commands are collected here and sent with one writev when the batch is done
+// a piece either points into the staging buffer or to text which stays valid until the flush (help lines, features),
+// the latter are never copied
+class replyQueue {
+public:
+	// number of writev calls and bytes sent, for the bytes per syscall statistics
+	uint64_t writes = 0, bytes = 0, replies = 0;
+
+	replyQueue() {
+		staging.reserve(replyStagingSize);
+		pieces.reserve(replyIovecs);
+	}
+
+	bool empty() const {
+		return pieces.empty();
+	}
+
+	// copy the text to the queue
+	void push(std::string_view text) {
+		if (text.empty())
+			return;
+		const size_t offset = staging.size();
+		staging.insert(staging.end(), text.begin(), text.end());
+		// text copied right after the previous piece simply extends it
+		if (not pieces.empty() and pieces.back().base == nullptr and pieces.back().offset + pieces.back().size == offset)
+			pieces.back().size += text.size();
+		else
+			pieces.push_back({nullptr, offset, text.size()});
+	}
+
+	// queue the text without copying, it has to stay valid until the queue is flushed
+	void pushStatic(std::string_view text) {
+		if (not text.empty())
+			pieces.push_back({text.data(), 0, text.size()});
+	}
+
+	// queue a reply in the form "code text CRLF"
+	void pushReply(uint32_t code, std::string_view text) {
+		char prefix[16];
+		char *end = std::to_chars(prefix, prefix + sizeof(prefix) - 1, code).ptr;
+		*end++ = ' ';
+		push(std::string_view(prefix, end - prefix));
+		push(text);
+		push(CRLF);
+		replies++;
+	}
+
+	// send everything queued, usually with a single writev
+	// returns true if an error happened, the queue is empty afterwards either way
+	bool flush(sockpp::stream_socket &sock) {
+		size_t first = 0, skip = 0;
+		bool error = false;
+		while (first < pieces.size()) {
+			iovec iov[replyIovecs];
+			size_t count = 0;
+			for (size_t i = first; i < pieces.size() and count < replyIovecs; i++, count++) {
+				const char *base = pieces[i].base ? pieces[i].base : staging.data() + pieces[i].offset;
+				const size_t skipped = i == first ? skip : 0;
+				iov[count] = {const_cast<char *>(base) + skipped, pieces[i].size - skipped};
+			}
+			ssize_t written = ::writev(sock.handle(), iov, count);
+			if (written <= 0) {
+				if (written < 0 and errno == EINTR)
+					continue;
+				error = true;
+				break;
+			}
+			writes++;
+			bytes += written;
+			// skip over everything which has been written, the last piece might be written only partially
+			while (written > 0) {
+				const size_t left = pieces[first].size - skip;
+				if (static_cast<size_t>(written) < left) {
+					skip += written;
+					break;
+				}
+				written -= left;
+				first++;
+				skip = 0;
+			}
+		}
+		pieces.clear();
+		staging.clear();
+		return error;
+	}
+
+private:
+	// base is nullptr for pieces in the staging buffer, which are addressed by offset since the buffer can grow
+	struct piece {
+		const char *base;
+		size_t offset, size;
+	};
+
+	std::vector<char> staging;
+	std::vector<piece> pieces;
+};
+
+#endif //CPP_FTP_REPLYQUEUE_HPP
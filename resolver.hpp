@@ -0,0 +1,222 @@
+#ifndef CPP_FTP_RESOLVER_HPP
+#define CPP_FTP_RESOLVER_HPP
+
+#include <linux/openat2.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <string>
+#include <string_view>
+#include <utility>
+#include "globals.hpp"
+#include "utils.hpp"
+
+// open relative to dirFd without letting the path (symlinks and .. included) leave dirFd
+// returns -1 with ENOSYS if the kernel doesn't have openat2
+inline int openBeneath(int dirFd, const char *path, int flags, mode_t mode) {
+	open_how how {};
+	how.flags = flags | O_CLOEXEC;
+	how.mode = flags & O_CREAT ? mode : 0;
+	how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+	int fd;
+	do {
+		fd = ::syscall(SYS_openat2, dirFd, path, &how, sizeof(how));
+	} while (fd < 0 and errno == EINTR);
+	return fd;
+}
+
+// resolves client paths relative to the work directory of the server
+// paths are normalized lexically (no syscalls) and then opened with openat2(RESOLVE_BENEATH) from a directory fd,
+// so the containment check and the open are the same syscall and there is no gap between them
+// the session keeps an fd of its current directory and a few recently used parent directories,
+// like the cwd of a process they keep pointing at the same directory even if it is renamed meanwhile
+// on kernels without openat2 the opened file is checked through /proc/self/fd instead
+class pathResolver {
+public:
+	pathResolver(int rootFd_t, const fs::path &workDir) : rootFd(rootFd_t), rootPath(workDir.generic_string()),
+														  rootName(workDir.filename().generic_string()) {}
+
+	// path of the current directory relative to the work directory, empty for the work directory itself
+	const std::string &currentDir() const {
+		return curRelative;
+	}
+
+	// normalize the client path against the current directory
+	// absolute paths start at the parent of the work directory (the client sees the work directory as /NAME)
+	// returns false if the path leaves the work directory
+	bool normalize(std::string_view path, std::string &relative) const {
+		// components of the path starting from the virtual root
+		std::string virtualPath;
+		if (path.empty() or (path[0] != '/' and path[0] != '\\')) {
+			virtualPath = rootName;
+			if (not curRelative.empty())
+				virtualPath += "/" + curRelative;
+		}
+		size_t start = 0;
+		while (start <= path.size()) {
+			size_t end = path.find_first_of("/\\", start);
+			if (end == std::string_view::npos)
+				end = path.size();
+			const std::string_view component = path.substr(start, end - start);
+			start = end + 1;
+			if (component.empty() or component == ".")
+				continue;
+			if (component == "..") {
+				// going up from the virtual root stays at the root
+				const size_t slash = virtualPath.rfind('/');
+				virtualPath.resize(slash == std::string::npos ? 0 : slash);
+				continue;
+			}
+			if (not virtualPath.empty())
+				virtualPath += '/';
+			virtualPath += component;
+		}
+		if (virtualPath.compare(0, rootName.size(), rootName) != 0 or
+			(virtualPath.size() > rootName.size() and virtualPath[rootName.size()] != '/'))
+			return false;
+		relative = virtualPath.size() > rootName.size() ? virtualPath.substr(rootName.size() + 1) : "";
+		return true;
+	}
+
+	// absolute path of a normalized relative path, for logging and messages
+	const std::string fullPath(const std::string &relative) const {
+		return relative.empty() ? rootPath : rootPath + "/" + relative;
+	}
+
+	// path of a normalized relative path as shown to the client
+	const std::string displayPath(const std::string &relative) const {
+		return relative.empty() ? "/" + rootName : "/" + rootName + "/" + relative;
+	}
+
+	// parent directory and last component of a normalized relative path
+	static const std::pair<std::string, std::string_view> splitPath(const std::string &relative) {
+		const size_t slash = relative.rfind('/');
+		if (slash == std::string::npos)
+			return {{}, relative};
+		return {relative.substr(0, slash), std::string_view(relative).substr(slash + 1)};
+	}
+
+	// open a normalized relative path, returns an invalid fd with errno set on failure
+	uniqueFd open(const std::string &relative, int flags, mode_t mode = 0) {
+		if (relative.empty())
+			return uniqueFd(openContained(rootFd, ".", flags, mode));
+		const auto [parent, name] = splitPath(relative);
+		const int dirFd = directoryFd(parent);
+		if (dirFd < 0)
+			return uniqueFd(-1);
+		// the name is the tail of relative, so it is null terminated
+		int fd = openContained(dirFd, name.data(), flags, mode);
+		// a symlink which leads out of its own directory can still point inside the work directory
+		if (fd < 0 and errno == EXDEV and dirFd != rootFd)
+			fd = openContained(rootFd, relative.c_str(), flags, mode);
+		return uniqueFd(fd);
+	}
+
+	// fd of a directory given by a normalized relative path, owned by the resolver
+	// returns -1 with errno set on failure
+	int directoryFd(const std::string &relative) {
+		if (relative.empty())
+			return rootFd;
+		if (curDirFd and relative == curRelative)
+			return curDirFd.get();
+		const auto now = std::chrono::steady_clock::now();
+		cachedDir *oldest = &dirCache[0];
+		for (auto &entry: dirCache) {
+			if (entry.fd and entry.relative == relative and now - entry.opened < resolverCacheTtl) {
+				entry.lastUse = ++useClock;
+				return entry.fd.get();
+			}
+			if (entry.lastUse < oldest->lastUse)
+				oldest = &entry;
+		}
+		uniqueFd fd(openContained(rootFd, relative.c_str(), O_PATH | O_DIRECTORY, 0));
+		if (not fd)
+			return -1;
+		oldest->fd = std::move(fd);
+		oldest->relative = relative;
+		oldest->opened = now;
+		oldest->lastUse = ++useClock;
+		return oldest->fd.get();
+	}
+
+	// change the current directory, returns false with errno set if it isn't an accessible directory
+	bool changeDir(const std::string &relative) {
+		// the work directory is the root fd itself
+		uniqueFd fd(relative.empty() ? -1 : openContained(rootFd, relative.c_str(), O_PATH | O_DIRECTORY, 0));
+		if (not fd and not relative.empty())
+			return false;
+		curDirFd = std::move(fd);
+		curRelative = relative;
+		return true;
+	}
+
+	// create the directory and every missing directory before it, like mkdir -p
+	bool makeDirs(const std::string &relative) {
+		// the work directory always exists
+		if (relative.empty())
+			return true;
+		for (size_t end = relative.find('/'); ; end = relative.find('/', end + 1)) {
+			const std::string prefix = relative.substr(0, end);
+			const auto [parent, name] = splitPath(prefix);
+			const int dirFd = directoryFd(parent);
+			if (dirFd < 0)
+				return false;
+			if (::mkdirat(dirFd, name.data(), 0777) < 0 and errno != EEXIST)
+				return false;
+			if (end == std::string::npos)
+				return true;
+		}
+	}
+
+private:
+	struct cachedDir {
+		uniqueFd fd;
+		std::string relative;
+		std::chrono::steady_clock::time_point opened;
+		uint64_t lastUse = 0;
+	};
+
+	// fd of the work directory, shared by the whole server
+	const int rootFd;
+	const std::string rootPath, rootName;
+	uniqueFd curDirFd;
+	std::string curRelative;
+	std::array<cachedDir, resolverCacheSize> dirCache;
+	uint64_t useClock = 0;
+
+	// openat2 if the kernel has it, otherwise open and check where the fd actually points
+	// whether openat2 works is probed once on the root with O_PATH, which can't fail for any other reason,
+	// so an EPERM of a real open (immutable files, protected_regular) never switches the server to the fallback
+	// seccomp policies which don't know openat2 fail it with EPERM instead of ENOSYS, so both mean unsupported
+	int openContained(int dirFd, const char *path, int flags, mode_t mode) const {
+		static const bool hasOpenat2 = [this]() {
+			const uniqueFd probe(openBeneath(rootFd, ".", O_PATH | O_DIRECTORY, 0));
+			return probe or (errno != ENOSYS and errno != EPERM);
+		}();
+		if (hasOpenat2)
+			return openBeneath(dirFd, path, flags, mode);
+		// without openat2 a symlink in the last component could make us create or truncate a file outside,
+		// so files are only created through their real names
+		const int fd = ::openat(dirFd, path, flags | O_CLOEXEC | (flags & O_CREAT ? O_NOFOLLOW : 0), mode);
+		if (fd < 0)
+			return fd;
+		char link[64], target[PATH_MAX];
+		snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+		const ssize_t length = ::readlink(link, target, sizeof(target));
+		const std::string_view real(target, length > 0 ? length : 0);
+		if (length <= 0 or real.substr(0, rootPath.size()) != rootPath or
+			(real.size() > rootPath.size() and real[rootPath.size()] != '/')) {
+			::close(fd);
+			errno = EXDEV;
+			return -1;
+		}
+		return fd;
+	}
+};
+
+#endif //CPP_FTP_RESOLVER_HPP
@@ -0,0 +1,144 @@
+#ifndef CPP_FTP_SESSIONPOOL_HPP
+#define CPP_FTP_SESSIONPOOL_HPP
+
+#include <sockpp/tcp_socket.h>
+#include <sockpp/inet_address.h>
+#include <sys/socket.h>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "globals.hpp"
+
+// admission control for new control connections
+// counts the active sessions globally and per peer ip, zero limits mean unlimited
+struct admissionControl {
+	enum RESULT {ADMITTED, GLOBAL_LIMIT, PER_IP_LIMIT};
+
+	const uint32_t maxSessions, maxPerIp;
+	std::mutex mutex;
+	uint32_t activeSessions = 0;
+	std::unordered_map<in_addr_t, uint32_t> perIp;
+
+	admissionControl(uint32_t maxSessions_t, uint32_t maxPerIp_t)
+		: maxSessions(maxSessions_t), maxPerIp(maxPerIp_t) {}
+
+	RESULT admit(in_addr_t ip) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (maxSessions and activeSessions >= maxSessions)
+			return GLOBAL_LIMIT;
+		uint32_t &fromIp = perIp[ip];
+		if (maxPerIp and fromIp >= maxPerIp)
+			return PER_IP_LIMIT;
+		fromIp++;
+		activeSessions++;
+		return ADMITTED;
+	}
+
+	void release(in_addr_t ip) {
+		std::lock_guard<std::mutex> lock(mutex);
+		activeSessions--;
+		const auto fromIp = perIp.find(ip);
+		if (fromIp != perIp.end() and --fromIp->second == 0)
+			perIp.erase(fromIp);
+	}
+};
+
+// owned by an admitted session for its whole lifetime
+// gives the slot back to admission control when destroyed
+class admissionTicket {
+public:
+	admissionTicket() = default;
+	admissionTicket(admissionControl &control_t, in_addr_t ip_t) : control(&control_t), ip(ip_t) {}
+	admissionTicket(admissionTicket &&other) noexcept : control(other.control), ip(other.ip) {
+		other.control = nullptr;
+	}
+	admissionTicket &operator=(admissionTicket &&other) noexcept {
+		std::swap(control, other.control);
+		std::swap(ip, other.ip);
+		return *this;
+	}
+	admissionTicket(const admissionTicket &) = delete;
+	admissionTicket &operator=(const admissionTicket &) = delete;
+	~admissionTicket() {
+		if (control)
+			control->release(ip);
+	}
+
+private:
+	admissionControl *control = nullptr;
+	in_addr_t ip = 0;
+};
+
+// fast rejection path for connections we can't serve
+// the reply is preformatted and sent without blocking, no FTP object is ever created
+void rejectConnection(sockpp::tcp_socket &sock, const std::string &reply) {
+	::send(sock.handle(), reply.data(), reply.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+	sock.close();
+}
+
+// fixed set of threads serving control connections from a bounded queue
+// a thread serves a session from start to end, waiting sessions stay in the queue
+class sessionPool {
+public:
+	// function which serves a whole session
+	typedef std::function<void(sockpp::tcp_socket, sockpp::inet_address)> sessionRunnerT;
+
+	sessionPool(uint32_t workerCount, uint32_t queueSize_t, sessionRunnerT runner_t)
+		: queueSize(queueSize_t), runner(std::move(runner_t)) {
+		for (uint32_t i = 0; i < workerCount; i++)
+			workers.emplace_back(&sessionPool::run, this);
+	}
+
+	// the pool lives for the whole server lifetime, so the threads are simply detached
+	~sessionPool() {
+		for (auto &thr: workers)
+			thr.detach();
+	}
+
+	// try to queue an accepted connection
+	// returns false if the queue is full, the socket is then left with the caller to reject it
+	bool tryEnqueue(sockpp::tcp_socket &sock, sockpp::inet_address peer, admissionTicket &ticket) {
+		{
+			std::lock_guard<std::mutex> lock(queueMutex);
+			if (queue.size() >= queueSize)
+				return false;
+			queue.push_back({std::move(sock), peer, std::move(ticket)});
+		}
+		queueCondition.notify_one();
+		return true;
+	}
+
+private:
+	struct pendingSession {
+		sockpp::tcp_socket sock;
+		sockpp::inet_address peer;
+		admissionTicket ticket;
+	};
+
+	const uint32_t queueSize;
+	sessionRunnerT runner;
+	std::vector<std::thread> workers;
+	std::mutex queueMutex;
+	std::condition_variable queueCondition;
+	std::deque<pendingSession> queue;
+
+	void run() {
+		while (true) {
+			pendingSession session;
+			{
+				std::unique_lock<std::mutex> lock(queueMutex);
+				queueCondition.wait(lock, [this]{ return not queue.empty(); });
+				session = std::move(queue.front());
+				queue.pop_front();
+			}
+			// the ticket is released when the session goes out of scope
+			runner(std::move(session.sock), session.peer);
+		}
+	}
+};
+
+#endif //CPP_FTP_SESSIONPOOL_HPP
@@ -0,0 +1,155 @@
+#ifndef CPP_FTP_TRANSFERTASK_HPP
+#define CPP_FTP_TRANSFERTASK_HPP
+
+#include <sys/socket.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "ftptransfer.h"
+
+// data transfer of a session running on its own thread
+// the control connection keeps reading commands meanwhile, so the client can ask for the progress or abort
+// aborting shuts the data connection down, which wakes up whatever the transfer is blocked in,
+// so the file and the connection are released right away instead of at the end of the transfer
+class transferTask {
+public:
+	transferControl control;
+
+	transferTask() = default;
+	transferTask(const transferTask &) = delete;
+	transferTask &operator=(const transferTask &) = delete;
+
+	// a transfer which is still running when the session ends is canceled
+	~transferTask() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			onDone = nullptr;
+		}
+		cancel();
+		wait();
+	}
+
+	// run body on the transfer thread, waits for the previous transfer first
+	// dataFd is shut down if the transfer is aborted, the body has to call dataClosed() before closing it
+	// a negative dataFd means that the body registers its connections with watch()
+	template<typename bodyFunction>
+	void start(std::string description_t, uint64_t expected_t, int dataFd_t, bodyFunction body) {
+		wait();
+		description = std::move(description_t);
+		expected = expected_t;
+		started = std::chrono::steady_clock::now();
+		control.bytes = 0;
+		control.canceled = false;
+		control.limit = transferControl::noLimit;
+		control.exceeded = false;
+		dataFds.clear();
+		interrupter = nullptr;
+		if (dataFd_t >= 0)
+			dataFds.push_back(dataFd_t);
+		active = true;
+		worker = std::thread([this, body = std::move(body)]() mutable {
+			body();
+			std::function<void()> next;
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				active = false;
+				next = std::move(onDone);
+				onDone = nullptr;
+			}
+			if (next)
+				next();
+		});
+	}
+
+	// check if a transfer is running right now
+	bool running() const {
+		return active.load();
+	}
+
+	// call next on the transfer thread once the body is done and its reply is sent, instead of waiting for it
+	// returns false if no transfer is running, then next is never called and the caller simply goes on
+	bool whenDone(std::function<void()> next) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (not active)
+			return false;
+		onDone = std::move(next);
+		return true;
+	}
+
+	// stop the running transfer as soon as possible
+	void cancel() {
+		std::lock_guard<std::mutex> lock(mutex);
+		control.cancel();
+		for (const int dataFd: dataFds)
+			::shutdown(dataFd, SHUT_RDWR);
+		if (interrupter)
+			interrupter();
+	}
+
+	// shut down this connection as well if the transfer is aborted, for transfers using several connections
+	void watch(int dataFd) {
+		std::lock_guard<std::mutex> lock(mutex);
+		dataFds.push_back(dataFd);
+		if (control.canceled)
+			::shutdown(dataFd, SHUT_RDWR);
+	}
+
+	// stop shutting down this connection on abort, it is closed or handed over to the next transfer
+	void unwatch(int dataFd) {
+		std::lock_guard<std::mutex> lock(mutex);
+		dataFds.erase(std::remove(dataFds.begin(), dataFds.end(), dataFd), dataFds.end());
+	}
+
+	// call interrupt on abort as well, for waits which can't be woken up by shutting down an fd
+	// nullptr removes it again, it must not be called anymore once the body stops waiting
+	void interruptWith(std::function<void()> interrupt) {
+		std::lock_guard<std::mutex> lock(mutex);
+		interrupter = std::move(interrupt);
+		if (interrupter and control.canceled)
+			interrupter();
+	}
+
+	// wait for the transfer thread to finish
+	void wait() {
+		if (worker.joinable())
+			worker.join();
+	}
+
+	// the data connections are about to be closed, so cancel() mustn't touch their fds anymore
+	void dataClosed() {
+		std::lock_guard<std::mutex> lock(mutex);
+		dataFds.clear();
+	}
+
+	// what is being transferred, the number of bytes expected (0 if unknown) and the time since the start
+	const std::string &what() const {
+		return description;
+	}
+
+	uint64_t expectedBytes() const {
+		return expected;
+	}
+
+	double elapsedSeconds() const {
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+	}
+
+private:
+	std::thread worker;
+	std::atomic<bool> active {false};
+	std::mutex mutex;
+	std::vector<int> dataFds;
+	std::function<void()> onDone;
+	std::function<void()> interrupter;
+	std::string description;
+	uint64_t expected = 0;
+	std::chrono::steady_clock::time_point started;
+};
+
+#endif //CPP_FTP_TRANSFERTASK_HPP
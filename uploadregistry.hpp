@@ -0,0 +1,143 @@
+#ifndef CPP_FTP_UPLOADREGISTRY_HPP
+#define CPP_FTP_UPLOADREGISTRY_HPP
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include "globals.hpp"
+#include "utils.hpp"
+
+// server-wide registry of files uploaded in byte ranges by several sessions at once
+// the ranges are written with positional writes into NAME.part, which has the announced size from the start,
+// and the file gets its real name only once every byte of it arrived, so nobody sees a file with holes
+class uploadRegistry {
+public:
+	// one file being uploaded in ranges
+	struct upload {
+		// the .part file and the directory it is in
+		uniqueFd fileFd, dirFd;
+		std::string name;
+		uint64_t size = 0;
+		// ranges received so far, merged, by start offset
+		std::map<uint64_t, uint64_t> received;
+		uint64_t receivedBytes = 0;
+		// number of transfers writing into the file right now
+		uint32_t writers = 0;
+		std::chrono::steady_clock::time_point lastUse;
+	};
+	typedef std::shared_ptr<upload> uploadT;
+
+	// outcome of a finished range
+	struct progress {
+		uint64_t received, size;
+		// every range arrived and the file was renamed to its real name, or renaming it failed
+		bool complete, failed;
+	};
+
+	// join the upload of the file named name in the directory dirFd, the first range creates the .part file
+	// returns nullptr with errno set if the file can't be created or an upload with a different size is running
+	uploadT join(const std::string &key, int dirFd, const std::string &name, uint64_t size) {
+		std::lock_guard<std::mutex> lock(mutex);
+		const auto now = std::chrono::steady_clock::now();
+		dropAbandoned(now);
+		uploadT &entry = uploads[key];
+		if (entry and entry->size != size) {
+			errno = EBUSY;
+			return nullptr;
+		}
+		if (not entry) {
+			auto created = std::make_shared<upload>();
+			created->dirFd = uniqueFd(::fcntl(dirFd, F_DUPFD_CLOEXEC, 0));
+			created->name = name;
+			created->size = size;
+			// a .part which isn't in the registry was left by an upload it forgot after uploadIdleTimeout or a restart,
+			// nobody knows which of its ranges arrived, so the upload starts over instead of never completing
+			created->fileFd = uniqueFd(::openat(dirFd, (name + partSuffix).c_str(),
+												O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0666));
+			// the file gets its final size right away and the whole file is allocated up front,
+			// so the ranges don't fragment it however they arrive
+			// filesystems without fallocate simply get the ranges written wherever they land
+			if (not created->dirFd or not created->fileFd or ::ftruncate(created->fileFd.get(), size) < 0 or
+				(::fallocate(created->fileFd.get(), 0, 0, size) < 0 and errno != EOPNOTSUPP)) {
+				const int error = errno;
+				uploads.erase(key);
+				errno = error;
+				return nullptr;
+			}
+			entry = std::move(created);
+		}
+		entry->writers++;
+		entry->lastUse = now;
+		return entry;
+	}
+
+	// record the range [offset, offset + length) of the file and leave the upload
+	// the last writer of a file which is complete renames it and removes it from the registry
+	progress finish(const std::string &key, const uploadT &file, uint64_t offset, uint64_t length) {
+		std::lock_guard<std::mutex> lock(mutex);
+		file->writers--;
+		file->lastUse = std::chrono::steady_clock::now();
+		addRange(*file, offset, std::min(offset + length, file->size));
+		const bool covered = file->receivedBytes == file->size;
+		if (not covered or file->writers != 0)
+			return {file->receivedBytes, file->size, false, false};
+		const auto found = uploads.find(key);
+		if (found != uploads.end() and found->second == file)
+			uploads.erase(found);
+		if (::renameat(file->dirFd.get(), (file->name + partSuffix).c_str(), file->dirFd.get(), file->name.c_str()) < 0)
+			return {file->receivedBytes, file->size, false, true};
+		return {file->receivedBytes, file->size, true, false};
+	}
+
+private:
+	static constexpr const char *partSuffix = ".part";
+
+	std::mutex mutex;
+	std::unordered_map<std::string, uploadT> uploads;
+
+	// merge the range into the received ranges and count the bytes which are new
+	static void addRange(upload &file, uint64_t start, uint64_t end) {
+		if (start >= end)
+			return;
+		auto next = file.received.upper_bound(start);
+		// join the range before it if they touch
+		if (next != file.received.begin()) {
+			auto previous = std::prev(next);
+			if (previous->second >= start) {
+				if (previous->second >= end)
+					return;
+				start = previous->first;
+				file.receivedBytes -= previous->second - previous->first;
+				file.received.erase(previous);
+			}
+		}
+		// swallow every range which starts inside of it
+		while (next != file.received.end() and next->first <= end) {
+			end = std::max(end, next->second);
+			file.receivedBytes -= next->second - next->first;
+			next = file.received.erase(next);
+		}
+		file.received[start] = end;
+		file.receivedBytes += end - start;
+	}
+
+	// forget uploads nobody wrote to for a long time, their .part files stay until the next upload of the file starts over
+	void dropAbandoned(std::chrono::steady_clock::time_point now) {
+		for (auto it = uploads.begin(); it != uploads.end(); ) {
+			if (it->second->writers == 0 and now - it->second->lastUse > uploadIdleTimeout)
+				it = uploads.erase(it);
+			else
+				++it;
+		}
+	}
+};
+
+#endif //CPP_FTP_UPLOADREGISTRY_HPP
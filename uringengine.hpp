@@ -0,0 +1,427 @@
+#ifndef CPP_FTP_URINGENGINE_HPP
+#define CPP_FTP_URINGENGINE_HPP
+
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <atomic>
+#include <cerrno>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "globals.hpp"
+#include "ftptransfer.h"
+
+// io_uring data transfer engine
+// one thread drives the file and socket I/O of every transfer in the server through a single ring,
+// the session threads hand it a transfer and wait for the result
+// file data moves through a pool of buffers registered with the kernel:
+// for RETR the file read and the socket write of a chunk are queued together as linked SQEs,
+// for STOR the length of a socket read is unknown in advance, so the file write is queued once the read completes
+// the engine thread can't wait for the rate limits of one transfer, so a throttled transfer is handed back
+// to its session thread after every chunk, waits there for the limits and is queued again
+// we talk to the kernel with raw syscalls, so there is no dependency on liburing
+class uringEngine {
+public:
+	explicit uringEngine(uint32_t entries = uringEntries) {
+		io_uring_params params {};
+		ringFd = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+		if (ringFd < 0)
+			return;
+		if (not mapRings(params) or not registerBuffers())
+			return;
+		eventFd = ::eventfd(0, EFD_CLOEXEC);
+		if (eventFd < 0)
+			return;
+		running = true;
+		worker = std::thread(&uringEngine::run, this);
+	}
+
+	~uringEngine() {
+		if (running) {
+			stopping = true;
+			wake();
+			worker.join();
+		}
+		if (sqes != nullptr)
+			::munmap(sqes, sqesSize);
+		if (sqRing != nullptr)
+			::munmap(sqRing, sqRingSize);
+		if (cqRing != nullptr and cqRing != sqRing)
+			::munmap(cqRing, cqRingSize);
+		if (eventFd >= 0)
+			::close(eventFd);
+		if (ringFd >= 0)
+			::close(ringFd);
+	}
+
+	// check if the kernel supports everything the engine needs
+	explicit operator bool() const {
+		return running;
+	}
+
+	// send the file from offset up to its end to the socket
+	const transferResult sendFile(sockpp::stream_socket &sock, int fileFd, off_t offset, transferControl &control) {
+		struct stat fileStat {};
+		if (not running or ::fstat(fileFd, &fileStat) < 0)
+			return {TRANSFER_UNSUPPORTED, 0};
+		transferJob job;
+		job.upload = false;
+		job.control = &control;
+		job.sockFd = sock.handle();
+		job.fileFd = fileFd;
+		job.offset = offset;
+		job.fileEnd = fileStat.st_size;
+		return runJob(job);
+	}
+
+	// receive the data from the socket into the file at offset until the peer closes the connection
+	const transferResult receiveFile(sockpp::stream_socket &sock, int fileFd, off_t offset, transferControl &control) {
+		if (not running)
+			return {TRANSFER_UNSUPPORTED, 0};
+		transferJob job;
+		job.upload = true;
+		job.control = &control;
+		job.sockFd = sock.handle();
+		job.fileFd = fileFd;
+		job.offset = offset;
+		return runJob(job);
+	}
+
+private:
+	// state of a single transfer, owned by the waiting session thread and driven by the engine thread
+	struct transferJob {
+		bool upload = false;
+		// progress and the cancel flag of the session
+		transferControl *control = nullptr;
+		int sockFd = -1, fileFd = -1;
+		off_t offset = 0, fileEnd = 0;
+		// registered buffer used by the transfer and the state of the chunk in it
+		int buffer = -1;
+		uint32_t chunkSize = 0, chunkDone = 0;
+		// number of SQEs which haven't completed yet
+		uint32_t inFlight = 0;
+		bool failed = false;
+		uint64_t moved = 0;
+		// the job was handed back to wait for the rate limits of unpaid bytes, which the engine already counted
+		bool paused = false;
+		uint64_t unpaid = 0;
+		std::promise<transferResult> result;
+	};
+
+	// stages are stored in the low bits of user_data next to the job pointer
+	enum STAGE : uint64_t {FILE_READ = 0, SOCKET_WRITE = 1, SOCKET_READ = 2, FILE_WRITE = 3, WAKEUP = 4};
+	static constexpr uint64_t stageMask = 7;
+
+	int ringFd = -1, eventFd = -1;
+	bool running = false;
+	std::atomic<bool> stopping = false;
+	std::thread worker;
+
+	// mapped ring memory
+	void *sqRing = nullptr, *cqRing = nullptr;
+	size_t sqRingSize = 0, cqRingSize = 0, sqesSize = 0;
+	io_uring_sqe *sqes = nullptr;
+	io_uring_cqe *cqes = nullptr;
+	unsigned *sqHead = nullptr, *sqTail = nullptr, *sqArray = nullptr, *cqHead = nullptr, *cqTail = nullptr;
+	unsigned sqMask = 0, sqEntries = 0, cqMask = 0;
+	// number of SQEs queued since the last io_uring_enter
+	unsigned toSubmit = 0;
+
+	// registered buffers
+	std::vector<byte> bufferMemory;
+	std::vector<int> freeBuffers;
+	// target of the eventfd read which wakes the engine up
+	uint64_t wakeValue = 0;
+
+	// transfers handed over by the sessions and transfers waiting for a free buffer
+	std::mutex incomingMutex;
+	std::deque<transferJob*> incoming;
+	std::deque<transferJob*> waitingForBuffer;
+
+	bool mapRings(const io_uring_params &params) {
+		sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+		cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+		const bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+		if (singleMmap)
+			sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+		sqRing = ::mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+		if (sqRing == MAP_FAILED) {
+			sqRing = nullptr;
+			return false;
+		}
+		if (singleMmap)
+			cqRing = sqRing;
+		else {
+			cqRing = ::mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+			if (cqRing == MAP_FAILED) {
+				cqRing = nullptr;
+				return false;
+			}
+		}
+		sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+		void *sqesMemory = ::mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+		if (sqesMemory == MAP_FAILED)
+			return false;
+		sqes = static_cast<io_uring_sqe *>(sqesMemory);
+
+		byte *sq = static_cast<byte *>(sqRing), *cq = static_cast<byte *>(cqRing);
+		sqHead = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+		sqTail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+		sqArray = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+		sqMask = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+		sqEntries = params.sq_entries;
+		cqHead = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+		cqTail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+		cqMask = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+		cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+		return true;
+	}
+
+	// register the buffer pool so the kernel doesn't have to map the pages on every operation
+	bool registerBuffers() {
+		bufferMemory.resize(static_cast<size_t>(uringBuffers) * BUFSIZE);
+		std::vector<iovec> iovecs(uringBuffers);
+		for (uint32_t i = 0; i < uringBuffers; i++) {
+			iovecs[i] = {bufferMemory.data() + static_cast<size_t>(i) * BUFSIZE, BUFSIZE};
+			freeBuffers.push_back(i);
+		}
+		return ::syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_BUFFERS, iovecs.data(), uringBuffers) == 0;
+	}
+
+	byte *bufferData(int buffer) {
+		return bufferMemory.data() + static_cast<size_t>(buffer) * BUFSIZE;
+	}
+
+	void wake() {
+		const uint64_t one = 1;
+		// can only fail if the counter overflows, in which case the engine is awake anyway
+		[[maybe_unused]] const ssize_t written = ::write(eventFd, &one, sizeof(one));
+	}
+
+	// called from the session threads, blocks until the engine has finished the transfer
+	// a throttled transfer comes back after every chunk, the session thread waits for the rate limits and queues it again
+	const transferResult runJob(transferJob &job) {
+		while (true) {
+			job.result = std::promise<transferResult>();
+			std::future<transferResult> result = job.result.get_future();
+			{
+				std::lock_guard<std::mutex> lock(incomingMutex);
+				incoming.push_back(&job);
+			}
+			wake();
+			const transferResult done = result.get();
+			if (not job.paused)
+				return done;
+			job.paused = false;
+			job.control->pace(std::exchange(job.unpaid, 0));
+		}
+	}
+
+	// get a free SQE, flushing the queue to the kernel if it is full
+	io_uring_sqe *getSqe() {
+		while (true) {
+			const unsigned head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+			const unsigned tail = *sqTail;
+			if (tail - head < sqEntries) {
+				io_uring_sqe *sqe = &sqes[tail & sqMask];
+				*sqe = {};
+				sqArray[tail & sqMask] = tail & sqMask;
+				__atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+				toSubmit++;
+				return sqe;
+			}
+			submit(0);
+		}
+	}
+
+	int submit(unsigned waitFor) {
+		const int submitted = static_cast<int>(::syscall(__NR_io_uring_enter, ringFd, toSubmit, waitFor,
+														 waitFor ? IORING_ENTER_GETEVENTS : 0, nullptr, 0));
+		if (submitted > 0)
+			toSubmit -= std::min<unsigned>(toSubmit, submitted);
+		return submitted;
+	}
+
+	void prepare(io_uring_sqe *sqe, uint8_t opcode, int fd, byte *data, uint32_t size, uint64_t offset,
+				 int buffer, transferJob *job, STAGE stage) {
+		sqe->opcode = opcode;
+		sqe->fd = fd;
+		sqe->addr = reinterpret_cast<uint64_t>(data);
+		sqe->len = size;
+		sqe->off = offset;
+		sqe->buf_index = buffer;
+		sqe->user_data = reinterpret_cast<uint64_t>(job) | stage;
+		if (job != nullptr)
+			job->inFlight++;
+	}
+
+	void queueWakeupRead() {
+		io_uring_sqe *sqe = getSqe();
+		prepare(sqe, IORING_OP_READ, eventFd, reinterpret_cast<byte *>(&wakeValue), sizeof(wakeValue), 0, 0, nullptr, WAKEUP);
+	}
+
+	// queue the next chunk of the transfer
+	void step(transferJob &job) {
+		job.chunkDone = 0;
+		// nothing is in flight between chunks, so a canceled transfer can end right here
+		if (job.control->stopped()) {
+			job.failed = true;
+			finish(job);
+			return;
+		}
+		// the limits are checked on every chunk, so they apply as soon as they are set
+		if (job.unpaid) {
+			job.paused = true;
+			finish(job);
+			return;
+		}
+		if (job.upload) {
+			prepare(getSqe(), IORING_OP_READ_FIXED, job.sockFd, bufferData(job.buffer), BUFSIZE, -1ull,
+					job.buffer, &job, SOCKET_READ);
+			return;
+		}
+		if (job.offset >= job.fileEnd) {
+			finish(job);
+			return;
+		}
+		// the socket write only starts once the file read has completed
+		// and it is canceled by the kernel if the read fails or comes up short
+		job.chunkSize = static_cast<uint32_t>(std::min<off_t>(BUFSIZE, job.fileEnd - job.offset));
+		io_uring_sqe *readSqe = getSqe();
+		prepare(readSqe, IORING_OP_READ_FIXED, job.fileFd, bufferData(job.buffer), job.chunkSize, job.offset,
+				job.buffer, &job, FILE_READ);
+		readSqe->flags |= IOSQE_IO_LINK;
+		prepare(getSqe(), IORING_OP_WRITE_FIXED, job.sockFd, bufferData(job.buffer), job.chunkSize, -1ull,
+				job.buffer, &job, SOCKET_WRITE);
+	}
+
+	// queue the rest of the chunk after a short write
+	void writeRest(transferJob &job, STAGE stage) {
+		const int fd = stage == SOCKET_WRITE ? job.sockFd : job.fileFd;
+		const uint64_t offset = stage == SOCKET_WRITE ? -1ull : job.offset + job.chunkDone;
+		prepare(getSqe(), IORING_OP_WRITE_FIXED, fd, bufferData(job.buffer) + job.chunkDone, job.chunkSize - job.chunkDone,
+				offset, job.buffer, &job, stage);
+	}
+
+	void finish(transferJob &job) {
+		freeBuffers.push_back(job.buffer);
+		job.buffer = -1;
+		job.result.set_value({job.failed ? TRANSFER_ERROR : TRANSFER_DONE, job.moved});
+	}
+
+	void complete(transferJob &job, STAGE stage, int32_t res) {
+		job.inFlight--;
+		if (job.failed) {
+			if (job.inFlight == 0)
+				finish(job);
+			return;
+		}
+		switch (stage) {
+			case FILE_READ:
+				// a short read breaks the link, the canceled socket write is then queued again with the right size
+				if (res < 0)
+					job.failed = true;
+				else if (static_cast<uint32_t>(res) < job.chunkSize)
+					job.chunkSize = res;
+				break;
+			case SOCKET_READ:
+				// the peer closed the connection, everything was received
+				if (res == 0) {
+					finish(job);
+					return;
+				}
+				if (res < 0) {
+					job.failed = true;
+					break;
+				}
+				job.chunkSize = res;
+				writeRest(job, FILE_WRITE);
+				break;
+			case SOCKET_WRITE:
+			case FILE_WRITE:
+				if (res == -ECANCELED and stage == SOCKET_WRITE) {
+					// the file shrank while we were sending it, there is nothing more to send
+					if (job.chunkSize == 0) {
+						finish(job);
+						return;
+					}
+					writeRest(job, stage);
+					break;
+				}
+				if (res <= 0) {
+					job.failed = true;
+					break;
+				}
+				job.chunkDone += res;
+				if (job.chunkDone < job.chunkSize) {
+					writeRest(job, stage);
+					break;
+				}
+				job.offset += job.chunkSize;
+				job.moved += job.chunkSize;
+				// the engine thread serves every transfer, so it only counts, the session thread pays for the chunk
+				// chunks moved while no limit applied cost nothing, like they would with add()
+				job.control->count(job.chunkSize);
+				if (job.control->throttled())
+					job.unpaid += job.chunkSize;
+				step(job);
+				return;
+			default:
+				break;
+		}
+		if (job.failed and job.inFlight == 0)
+			finish(job);
+	}
+
+	// give buffers to the transfers waiting for them and start them
+	void startWaiting() {
+		{
+			std::lock_guard<std::mutex> lock(incomingMutex);
+			waitingForBuffer.insert(waitingForBuffer.end(), incoming.begin(), incoming.end());
+			incoming.clear();
+		}
+		while (not waitingForBuffer.empty() and not freeBuffers.empty()) {
+			transferJob &job = *waitingForBuffer.front();
+			waitingForBuffer.pop_front();
+			job.buffer = freeBuffers.back();
+			freeBuffers.pop_back();
+			step(job);
+		}
+	}
+
+	// main loop of the engine thread
+	void run() {
+		queueWakeupRead();
+		while (not stopping) {
+			if (submit(1) < 0 and errno != EINTR and errno != EAGAIN and errno != EBUSY)
+				break;
+			unsigned head = *cqHead;
+			const unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+			bool woken = false;
+			for (; head != tail; head++) {
+				const io_uring_cqe &cqe = cqes[head & cqMask];
+				const STAGE stage = static_cast<STAGE>(cqe.user_data & stageMask);
+				if (stage == WAKEUP) {
+					woken = true;
+					continue;
+				}
+				complete(*reinterpret_cast<transferJob *>(cqe.user_data & ~stageMask), stage, cqe.res);
+			}
+			__atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+			if (woken)
+				queueWakeupRead();
+			// buffers could have been freed by the completions, so always try to start waiting transfers
+			startWaiting();
+		}
+	}
+};
+
+#endif //CPP_FTP_URINGENGINE_HPP
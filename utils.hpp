@@ -5,6 +5,15 @@
 #include <iostream>
 #include <utility>
 #include <vector>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <sstream>
+#include <string_view>
+#include <thread>
+#include <unistd.h>
+#include "globals.hpp"
 // for working with filesystem
 #include <ghc/filesystem.hpp>
 namespace fs = ghc::filesystem;
@@ -12,52 +21,193 @@ namespace fs = ghc::filesystem;
 // endline for logger
 enum loggerEndl {ENDL};
 
-// logger class which outputs to stdout as well to log
-// if we don't supply a log file name then we simply set the logfile ptr to nullptr
+// asynchronous logger which outputs to stdout as well to log
+// if we don't supply a log file name then the logfile ptr stays nullptr
+// every thread builds its record in a thread-local stream, ENDL copies the complete record
+// into a preallocated slot of a lock-free ring (bounded MPSC queue, slots carry sequence numbers)
+// and a background thread takes the records in batches, writes them and flushes every flush interval
+// if the ring is full the record is dropped and counted instead of blocking the session
+// there is a single thread-local stream per thread, so a thread shouldn't build records for two loggers at once
 struct loggerT {
 
 	// unique_ptr for easier checking
 	// also it will automatically close on really bad errors
 	std::unique_ptr<std::ofstream> logFile;
 
-	loggerT(const std::string logFileName) {
-		if (logFileName == "")
-			logFile = std::make_unique<std::ofstream>(nullptr);
-		else {
-			logFile = std::make_unique<std::ofstream>(std::ofstream(logFileName.c_str()));
+	loggerT(const std::string logFileName, uint32_t flushIntervalMs = defaultLogFlushMs)
+		: flushInterval(flushIntervalMs), slots(logRingSlots) {
+		for (size_t i = 0; i < slots.size(); i++)
+			slots[i].sequence.store(i, std::memory_order_relaxed);
+		if (logFileName != "") {
+			logFile = std::make_unique<std::ofstream>(logFileName.c_str());
 			std::cout << "Logging to file " << logFileName << std::endl;
 		}
+		writer = std::thread(&loggerT::run, this);
+	}
+
+	~loggerT() {
+		close();
 	}
 
 	// operators for outputting various values
+	// the value only goes to the record of the current thread
 	template<typename T>
 	loggerT& operator<<(T value) {
-		std::cout << value;
-		if (logFile)
-			*logFile << value;
+		threadRecord() << value;
 		return *this;
 	}
 
 	// only accept the specific ENDL value
-	// send std::endl to both streams, effectively flushing them
+	// finishes the record of the current thread and hands it to the writer thread
 	loggerT& operator<<(const loggerEndl) {
-		std::cout << std::endl;
-		if (logFile)
-			*logFile << std::endl;
+		std::ostringstream &record = threadRecord();
+		push(record.view());
+		record.str("");
 		return *this;
 	}
 
-	// correctly handle the closing of required file
+	// number of records dropped because the ring was full
+	uint64_t dropped() const {
+		return droppedRecords.load(std::memory_order_relaxed);
+	}
+
+	// stop the writer thread after it has written everything and correctly handle the closing of required file
 	void close() {
+		if (writer.joinable()) {
+			stopping = true;
+			writer.join();
+		}
 		if (logFile)
 			logFile->close();
 	}
+
+private:
+	struct slot {
+		std::atomic<uint64_t> sequence;
+		uint32_t length;
+		char data[logRecordSize];
+	};
+
+	const std::chrono::milliseconds flushInterval;
+	std::vector<slot> slots;
+	// position of the next record to be written by the producers and read by the writer thread
+	alignas(64) std::atomic<uint64_t> enqueuePos = 0;
+	alignas(64) uint64_t dequeuePos = 0;
+	std::atomic<uint64_t> droppedRecords = 0;
+	std::atomic<bool> stopping = false;
+	std::thread writer;
+
+	static std::ostringstream &threadRecord() {
+		thread_local std::ostringstream record;
+		return record;
+	}
+
+	// copy a finished record into a free slot, records longer than a slot are truncated
+	void push(std::string_view record) {
+		const uint64_t mask = slots.size() - 1;
+		uint64_t pos = enqueuePos.load(std::memory_order_relaxed);
+		while (true) {
+			slot &current = slots[pos & mask];
+			const int64_t diff = static_cast<int64_t>(current.sequence.load(std::memory_order_acquire) - pos);
+			if (diff == 0) {
+				if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					current.length = std::min<size_t>(record.size(), logRecordSize);
+					std::memcpy(current.data, record.data(), current.length);
+					current.sequence.store(pos + 1, std::memory_order_release);
+					return;
+				}
+			} else if (diff < 0) {
+				// the writer thread hasn't freed this slot yet, the ring is full
+				droppedRecords.fetch_add(1, std::memory_order_relaxed);
+				return;
+			} else {
+				pos = enqueuePos.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	// take every finished record from the ring and append it to the batch
+	void drain(std::string &batch) {
+		const uint64_t mask = slots.size() - 1;
+		while (true) {
+			slot &current = slots[dequeuePos & mask];
+			if (current.sequence.load(std::memory_order_acquire) != dequeuePos + 1)
+				return;
+			batch.append(current.data, current.length);
+			batch.push_back('\n');
+			current.sequence.store(dequeuePos + slots.size(), std::memory_order_release);
+			dequeuePos++;
+		}
+	}
+
+	// writer thread, wakes up every flush interval and writes everything in one batch
+	void run() {
+		std::string batch;
+		uint64_t reportedDrops = 0;
+		while (true) {
+			const bool lastRound = stopping;
+			drain(batch);
+			const uint64_t drops = dropped();
+			if (drops != reportedDrops) {
+				batch += "Logger dropped " + std::to_string(drops - reportedDrops) + " records, the ring was full\n";
+				reportedDrops = drops;
+			}
+			if (not batch.empty()) {
+				std::cout.write(batch.data(), batch.size());
+				std::cout.flush();
+				if (logFile) {
+					logFile->write(batch.data(), batch.size());
+					logFile->flush();
+				}
+				batch.clear();
+			}
+			if (lastRound)
+				return;
+			std::this_thread::sleep_for(flushInterval);
+		}
+	}
+};
+
+// owning wrapper for a raw file descriptor which closes it when destroyed
+// used for the paths which work with the kernel directly (sendfile and friends)
+class uniqueFd {
+public:
+	uniqueFd() = default;
+	explicit uniqueFd(int fd_t) : fd(fd_t) {}
+	uniqueFd(uniqueFd &&other) noexcept : fd(other.release()) {}
+	uniqueFd &operator=(uniqueFd &&other) noexcept {
+		reset(other.release());
+		return *this;
+	}
+	uniqueFd(const uniqueFd &) = delete;
+	uniqueFd &operator=(const uniqueFd &) = delete;
+	~uniqueFd() {
+		reset();
+	}
+
+	int get() const { return fd; }
+	explicit operator bool() const { return fd >= 0; }
+
+	int release() {
+		const int tmp = fd;
+		fd = -1;
+		return tmp;
+	}
+
+	void reset(int fd_t = -1) {
+		if (fd >= 0)
+			::close(fd);
+		fd = fd_t;
+	}
+
+private:
+	int fd = -1;
 };
 
 // function which returns current parameter and the rest of the string (separated by space)
-const std::pair<std::string, std::string> getNextParam(const std::string str) {
+const std::pair<std::string_view, std::string_view> getNextParam(std::string_view str) {
 	auto pos = str.find(' ');
-	if (pos == std::string::npos)
+	if (pos == std::string_view::npos)
 		return {str, ""};
 	return {str.substr(0, pos), str.substr(pos + 1)};
 }